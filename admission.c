@@ -0,0 +1,217 @@
+/* admission.c: Admission Control Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CODEL_INTERVAL  100000000ULL    /* Interval of CoDel shedding (ns) */
+
+#define REJECT_BODY     "<h1>503 Service Unavailable</h1>\n"
+#define REJECT_COUNT    "33"            /* Length of REJECT_BODY */
+
+_Static_assert(sizeof(REJECT_BODY) - 1 == 33, "REJECT_COUNT must be the length of REJECT_BODY");
+
+static const char RejectResponse[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Server: spidey\r\n"
+    "Retry-After: " RETRY_AFTER "\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: " REJECT_COUNT "\r\n"
+    "\r\n"
+    REJECT_BODY;
+
+/* Global Variables */
+
+size_t MaxConnections = 0;
+size_t MaxCGI         = 0;
+size_t MaxStreams     = 256;
+size_t QueueTarget    = 0;
+
+Admission *AdmissionState = NULL;
+
+static pthread_mutex_t CoDelLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Allocate admission counters.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The counters are placed in an anonymous shared mapping so that forked
+ * children see (and update) the same in-flight CGI count as the parent.
+ **/
+int admission_init(void) {
+  AdmissionState = mmap(NULL, sizeof(Admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (AdmissionState == MAP_FAILED) {
+    log("Unable to map admission counters: %s", strerror(errno));
+    AdmissionState = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Try to admit a new connection.
+ *
+ * @return  true if the connection may be handled, false if over the limit.
+ *
+ * Admitted connections must be released with admission_leave.
+ **/
+bool admission_enter(void) {
+  size_t connections = __sync_add_and_fetch(&AdmissionState->connections, 1);
+  if (MaxConnections && connections > MaxConnections) {
+    __sync_sub_and_fetch(&AdmissionState->connections, 1);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Release an admitted connection.
+ **/
+void admission_leave(void) {
+  __sync_sub_and_fetch(&AdmissionState->connections, 1);
+}
+
+/**
+ * Try to start a CGI process.
+ *
+ * @return  true if the CGI may run, false if over the limit.
+ *
+ * Started CGI processes must be released with admission_cgi_leave.
+ **/
+bool admission_cgi_enter(void) {
+  size_t running = __sync_add_and_fetch(&AdmissionState->cgi, 1);
+  if (MaxCGI && running > MaxCGI) {
+    __sync_sub_and_fetch(&AdmissionState->cgi, 1);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Release a CGI process.
+ **/
+void admission_cgi_leave(void) {
+  __sync_sub_and_fetch(&AdmissionState->cgi, 1);
+}
+
+/**
+ * Try to start an HTTP/2 stream.
+ *
+ * @return  true if the stream may run, false if over a limit.
+ *
+ * Each running stream has a thread of its own, so it counts as a connection
+ * (against MaxConnections) as well as against MaxStreams.  Started streams
+ * must be released with admission_stream_leave.
+ **/
+bool admission_stream_enter(void) {
+  size_t running = __sync_add_and_fetch(&AdmissionState->streams, 1);
+  if ((MaxStreams && running > MaxStreams) || !admission_enter()) {
+    __sync_sub_and_fetch(&AdmissionState->streams, 1);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Release an HTTP/2 stream.
+ **/
+void admission_stream_leave(void) {
+  admission_leave();
+  __sync_sub_and_fetch(&AdmissionState->streams, 1);
+}
+
+/**
+ * Decide whether a queued request should still be handled.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  true if the request should be handled, false if it should be shed.
+ *
+ * This is the CoDel-style policy used for server queues: track the minimum
+ * queueing delay seen over each CODEL_INTERVAL.  If even the minimum exceeded
+ * QueueTarget, the queue is standing rather than absorbing a burst, so during
+ * the next interval only requests that waited at most QueueTarget are served.
+ * Otherwise requests may wait up to a whole interval.  Bursts are absorbed but
+ * a persistent backlog is shed, bounding latency for admitted requests.
+ **/
+bool admission_admit(Request *r) {
+  static unsigned long long interval_end = 0;
+  static unsigned long long min_delay    = 0;
+  static bool               overloaded   = false;
+  unsigned long long now   = monotonic_ns();
+  unsigned long long delay = now - r->accepted;
+  unsigned long long target = QueueTarget * 1000000ULL;
+  bool admit;
+
+  if (!QueueTarget) {
+    return true;
+  }
+
+  pthread_mutex_lock(&CoDelLock);
+  if (now >= interval_end) {
+    overloaded   = interval_end && min_delay > target;
+    min_delay    = delay;
+    interval_end = now + CODEL_INTERVAL;
+  } else if (delay < min_delay) {
+    min_delay = delay;
+  }
+  admit = delay <= (overloaded ? target : CODEL_INTERVAL);
+  pthread_mutex_unlock(&CoDelLock);
+
+  if (!admit) {
+    debug("Shedding request queued for %llu us", delay / 1000);
+  }
+  return admit;
+}
+
+/**
+ * Reject connection with prebuilt 503 Service Unavailable response.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * The response is sent without blocking (if the socket buffer is full the
+ * client simply gets a closed connection), and whatever part of the request
+ * has already arrived is discarded so that closing does not reset the
+ * connection before the client reads the response.
+ *
+ * A TLS client only gets the response if its handshake is already done;
+ * one rejected at accept time just sees the connection close.
+ **/
+void reject_request(Request *r) {
+  char buffer[BUFSIZ];
+  ssize_t nsent;
+
+#ifdef TLS
+  if (r->ssl) {
+    struct iovec iov = { (void *)RejectResponse, sizeof(RejectResponse) - 1 };
+    nsent = tls_writev(r, &iov, 1);
+  } else
+#endif
+  nsent = send(r->fd, RejectResponse, sizeof(RejectResponse) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (nsent < 0) {
+    debug("Unable to send rejection: %s", strerror(errno));
+  }
+  shutdown(r->fd, SHUT_WR);
+  while (recv(r->fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+
+  __sync_fetch_and_add(&AdmissionState->rejected, 1);
+  log("Rejected request from %s:%s", request_host(r), request_port(r));
+}
+
+/**
+ * Log admission counters.
+ **/
+void admission_dump_metrics(void) {
+  log("METRICS admission connections=%zu cgi=%zu streams=%zu rejected=%lu",
+      AdmissionState->connections, AdmissionState->cgi, AdmissionState->streams,
+      AdmissionState->rejected);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
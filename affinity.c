@@ -0,0 +1,136 @@
+/* affinity.c: CPU Affinity Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Global Variables */
+
+cpu_set_t *AffinitySet = NULL;
+
+/**
+ * Parse CPU affinity specification.
+ *
+ * @param   spec        Either "auto" or a list of CPUs (ie. "0,2,4-7").
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * This sets AffinitySet.  With "auto", every CPU the process is currently
+ * allowed to run on is used.
+ **/
+bool affinity_parse(const char *spec) {
+  static cpu_set_t set;
+  char *copy = strdup(spec);
+  char *save = NULL;
+  bool result = true;
+
+  CPU_ZERO(&set);
+  if (streq(spec, "auto")) {
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+      log("Unable to get affinity: %s", strerror(errno));
+      result = false;
+    }
+    goto done;
+  }
+
+  for (char *token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+    char *end;
+    long first = strtol(token, &end, 10);
+    long last  = (*end == '-') ? strtol(end + 1, &end, 10) : first;
+
+    if (end == token || *end || first < 0 || last < first || last >= CPU_SETSIZE) {
+      log("Invalid CPU list: %s", spec);
+      result = false;
+      goto done;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, &set);
+    }
+  }
+
+done:
+  free(copy);
+  AffinitySet = (result && CPU_COUNT(&set) > 0) ? &set : NULL;
+  return AffinitySet != NULL;
+}
+
+/**
+ * Return the nth CPU in AffinitySet (wrapping around).
+ *
+ * @param   n           Index of CPU.
+ * @return  CPU number (or -1 if affinity is disabled).
+ **/
+int affinity_cpu(size_t n) {
+  if (!AffinitySet) {
+    return -1;
+  }
+
+  n %= CPU_COUNT(AffinitySet);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, AffinitySet) && n-- == 0) {
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Pin calling thread to a single CPU.
+ *
+ * @param   cpu         CPU number.
+ * @return  -1 on error and 0 on success.
+ *
+ * Memory first touched after pinning is allocated from the CPU's local NUMA
+ * node by the kernel's default policy, so workers should pin before building
+ * any per-worker state.
+ **/
+int affinity_pin(int cpu) {
+  cpu_set_t set;
+
+  if (cpu < 0) {
+    return -1;
+  }
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+    log("Unable to pin to CPU %d: %s", cpu, strerror(errno));
+    return -1;
+  }
+  debug("Pinned to CPU %d", cpu);
+  return 0;
+}
+
+/**
+ * Pin calling thread to the CPU that received a connection.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   n           Fallback index into AffinitySet.
+ * @return  -1 on error and 0 on success.
+ *
+ * SO_INCOMING_CPU reports the CPU whose NIC queue processed the connection.
+ * If that CPU is in AffinitySet, the request is handled there so its socket
+ * buffers stay in that core's cache; otherwise the nth CPU is used.
+ **/
+int affinity_pin_connection(int fd, size_t n) {
+  int cpu = -1;
+
+  if (!AffinitySet) {
+    return -1;
+  }
+
+#ifdef SO_INCOMING_CPU
+  socklen_t length = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) < 0 ||
+      cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, AffinitySet)) {
+    cpu = -1;
+  }
+#endif
+
+  return affinity_pin(cpu >= 0 ? cpu : affinity_cpu(n));
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# Measure TLS handshakes and bulk throughput of spidey, and report whether the
+# kernel took over encryption (kTLS offload).
+#
+# Usage: benchmark_tls.sh [SECONDS [MEGABYTES]]
+#
+# Expects ./spidey to be built with TLS (make TLS=1).  A throwaway certificate
+# is generated for the run.  Kernel TLS also needs the tls module (modprobe
+# tls) and an OpenSSL built with enable-ktls; otherwise OpenSSL encrypts.
+
+PROGRAM=spidey
+WORKSPACE=/tmp/$PROGRAM.tls.$(id -u)
+SECONDS_=${1:-5}
+MEGABYTES=${2:-64}
+PORT=$((9000 + RANDOM % 1000))
+PID=
+
+# Functions
+
+cleanup() {
+    STATUS=${1:-0}
+    [ -n "$PID" ] && kill $PID 2> /dev/null && wait $PID 2> /dev/null
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+fatal() {
+    echo "$@"
+    [ -r $WORKSPACE/log ] && (echo; tail $WORKSPACE/log; echo)
+    cleanup 1
+}
+
+metric() {
+    kill -USR1 $PID
+    sleep 0.5
+    grep "METRICS tls" $WORKSPACE/log | tail -n 1 | sed -En "s/.* $1=([0-9]+).*/\1/p"
+}
+
+# Setup
+
+mkdir -p $WORKSPACE/www
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+if ! ./$PROGRAM -h 2>&1 | grep -q -- '-s port'; then
+    fatal "./$PROGRAM was not built with TLS (make TLS=1)"
+fi
+
+printf " %-64s ... " "Generating certificate"
+if ! openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+	-keyout $WORKSPACE/key.pem -out $WORKSPACE/cert.pem > /dev/null 2>&1; then
+    fatal "Failure"
+fi
+echo "Success"
+
+echo '<h1>spidey</h1>' > $WORKSPACE/www/index.html
+head -c $((MEGABYTES * 1024 * 1024)) /dev/zero > $WORKSPACE/www/bulk
+
+./$PROGRAM -r $WORKSPACE/www -s $PORT -E $WORKSPACE/cert.pem -K $WORKSPACE/key.pem -c threaded \
+    > $WORKSPACE/log 2>&1 &
+PID=$!
+sleep 1
+kill -0 $PID 2> /dev/null || fatal "Unable to start $PROGRAM"
+
+# Handshakes
+
+printf "\n %-64s\n" "Handshakes ($SECONDS_ seconds each)"
+
+for mode in new reuse; do
+    printf "     %-60s ... " "$mode sessions"
+    openssl s_time -connect localhost:$PORT -$mode -www /index.html -time $SECONDS_ 2> /dev/null \
+	| awk '/connections\/user sec/ { rate = $5 } / real seconds/ { count = $1; real = $4 }
+	       END { printf "%s connections/user sec (%s in %s real seconds)\n", rate, count, real }'
+done
+
+# Throughput
+
+printf "\n %-64s\n" "Throughput ($MEGABYTES MB file, 3 downloads)"
+
+for i in 1 2 3; do
+    printf "     %-60s ... " "download $i"
+    curl -sk -o /dev/null -w '%{speed_download}\n' https://localhost:$PORT/bulk \
+	| awk '{ printf "%.1f MB/s\n", $1 / 1048576 }'
+done
+
+# Offload
+
+printf "\n %-64s ... " "Kernel TLS offload"
+HANDSHAKES=$(metric handshakes)
+OFFLOADED=$(metric offloaded)
+if [ -z "$OFFLOADED" ]; then
+    fatal "Unknown (no METRICS tls line)"
+elif [ "$OFFLOADED" -gt 0 ]; then
+    echo "Active ($OFFLOADED of $HANDSHAKES handshakes)"
+else
+    echo "Inactive (0 of $HANDSHAKES handshakes; is the tls module loaded?)"
+fi
+
+echo
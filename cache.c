@@ -0,0 +1,791 @@
+/* cache.c: Cache Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NEGATIVE_ENTRIES    1024        /* Number of negative entries (power of 2) */
+#define NEGATIVE_TTL        10000000000ULL  /* Lifetime of negative entry (ns) */
+
+#define NEGATIVE_EVENTS     (IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define CACHE_SHARDS        16          /* Number of independently locked shards */
+#define CACHE_BUCKETS       256         /* Hash buckets per shard (power of 2) */
+#define CACHE_ENTRIES       256         /* Entries per shard */
+#define CACHE_HOSTS         64          /* Hosts with tracked cache usage */
+#define CACHE_HOST_SIZE     256         /* Longest host name tracked (including NUL) */
+#define CACHE_PAGE_SIZE     CACHE_BODY_LIMIT    /* Size of slab page */
+#define CACHE_MIN_CHUNK     256         /* Size of smallest slab chunk */
+#define CACHE_CLASSES       9           /* Chunk sizes 256 B to 64 KiB */
+
+_Static_assert(CACHE_MIN_CHUNK << (CACHE_CLASSES - 1) == CACHE_PAGE_SIZE, "largest chunk must fill a page");
+
+typedef struct {
+    unsigned long      generation;      /*< Generation entry was added in */
+    unsigned long long expires;         /*< Time entry expires (ns) */
+    char               path[CACHE_KEY_SIZE];    /*< Unresolved path (root + URI) */
+} NegativeEntry;
+
+typedef struct {
+    unsigned long   id;                 /*< Hash of host name (0 = unused) */
+    char            name[CACHE_HOST_SIZE];  /*< Host name */
+    size_t          used;               /*< Bytes cached for host */
+} HostUsage;
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Protects shard */
+    pthread_cond_t  filled;             /*< Broadcast when a fill completes */
+    CacheEntry      *buckets[CACHE_BUCKETS];    /*< Hash index of entries */
+    CacheEntry      *newest[CACHE_CLASSES];     /*< Most recently used entry per class */
+    CacheEntry      *oldest[CACHE_CLASSES];     /*< Least recently used entry per class */
+    void            *chunks[CACHE_CLASSES];     /*< Free chunks per class */
+    CacheEntry      *unused;            /*< Free entry headers */
+    char            *pages;             /*< Slab pages of shard */
+    size_t          npages;             /*< Number of slab pages */
+    size_t          used_pages;         /*< Pages handed to a class */
+    CacheEntry      entries[CACHE_ENTRIES];     /*< Entry headers */
+} CacheShard;
+
+typedef struct {
+    pthread_mutex_t negative_lock;      /*< Protects negative entries */
+    unsigned long   negative_generation;    /*< Current negative generation */
+    NegativeEntry   negative[NEGATIVE_ENTRIES]; /*< Direct-mapped negative entries */
+    pthread_mutex_t hosts_lock;         /*< Protects claiming of host usage slots */
+    HostUsage       hosts[CACHE_HOSTS]; /*< Per-host cache usage */
+    CacheShard      shards[CACHE_SHARDS];   /*< Content cache shards */
+} CacheSegment;
+
+/* Global Variables */
+
+size_t   CacheSize   = 16 * 1024 * 1024;
+unsigned CGICacheTTL = 0;
+
+CacheMetrics *CacheState = NULL;
+
+static CacheSegment *Segment = NULL;
+static int           NegativeWatch = -1;
+
+/* Internal Functions */
+
+/**
+ * Initialize mutex (and condition variable) shared between processes.
+ *
+ * @param   lock        Mutex to initialize.
+ * @param   cond        Condition variable to initialize (may be NULL).
+ *
+ * The mutex is robust, so a worker that dies while holding it does not wedge
+ * every other worker (see cache_lock).
+ **/
+static void cache_init_lock(pthread_mutex_t *lock, pthread_cond_t *cond) {
+  pthread_mutexattr_t mattr;
+  pthread_condattr_t  cattr;
+
+  pthread_mutexattr_init(&mattr);
+  pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(lock, &mattr);
+  pthread_mutexattr_destroy(&mattr);
+
+  if (cond) {
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+  }
+}
+
+/**
+ * Lock shared mutex, recovering it if its owner died.
+ *
+ * @param   lock        Mutex to lock.
+ **/
+static void cache_lock(pthread_mutex_t *lock) {
+  if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+    log("Recovering cache lock from dead worker.");
+    pthread_mutex_consistent(lock);
+  }
+}
+
+/**
+ * Join document root and normalized URI.
+ *
+ * @param   root        Real path of document root.
+ * @param   uri         Normalized URI.
+ * @param   path        Buffer of CACHE_KEY_SIZE bytes.
+ * @return  true if the path fits, false if it is too long to cache.
+ **/
+static bool negative_key(const char *root, const char *uri, char *path) {
+  return (size_t)snprintf(path, CACHE_KEY_SIZE, "%s%s", root, uri) < CACHE_KEY_SIZE;
+}
+
+/**
+ * Drop every negative entry if a watched directory changed.
+ *
+ * The inotify instance is created before any worker is forked, so every
+ * process shares it (and the watches added through it): whichever process
+ * reads an event moves the shared table to a new generation for all of them.
+ * When nothing changed this is a single non-blocking read.
+ *
+ * Must be called with negative_lock held.
+ **/
+static void negative_check(void) {
+  char events[sizeof(struct inotify_event) + NAME_MAX + 1];
+
+  if (read(NegativeWatch, events, sizeof(events)) > 0) {
+    debug("Watched directory changed, flushing negative cache");
+    while (read(NegativeWatch, events, sizeof(events)) > 0);
+    Segment->negative_generation++;
+    __sync_fetch_and_add(&CacheState->negative_flushes, 1);
+  }
+}
+
+/**
+ * Return slab class of body length.
+ *
+ * @param   length      Length of body.
+ * @return  Smallest class whose chunks fit the body.
+ **/
+static int cache_class(size_t length) {
+  int cls = 0;
+  while ((size_t)(CACHE_MIN_CHUNK << cls) < length) {
+    cls++;
+  }
+  return cls;
+}
+
+/**
+ * Return usage slot of host, claiming one if needed.
+ *
+ * @param   host        VirtualHost structure.
+ * @return  Index of usage slot (or CACHE_HOSTS if no slot can be used).
+ *
+ * Hosts are identified by name rather than by address, since each worker may
+ * have loaded its own copy of the virtual hosts table.  Slots are probed from
+ * the hash of the name, and the name is compared so that hosts whose names
+ * collide keep separate usage.  Workers claim slots concurrently, so that
+ * happens under the hosts lock.
+ **/
+static size_t cache_host(VirtualHost *host) {
+  unsigned long id = hash_string(host->name) | 1;
+  size_t found = CACHE_HOSTS;
+
+  if (strlen(host->name) >= CACHE_HOST_SIZE) {
+    return CACHE_HOSTS;
+  }
+
+  cache_lock(&Segment->hosts_lock);
+  for (size_t i = 0; i < CACHE_HOSTS; i++) {
+    HostUsage *u = &Segment->hosts[(id + i) % CACHE_HOSTS];
+    if (!u->id) {
+      u->id = id;
+      strcpy(u->name, host->name);
+    }
+    if (u->id == id && streq(u->name, host->name)) {
+      found = (id + i) % CACHE_HOSTS;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&Segment->hosts_lock);
+  return found;
+}
+
+/**
+ * Change cached bytes charged to host.
+ *
+ * @param   slot        Usage slot of host.
+ * @param   delta       Bytes added (or removed, if negative).
+ **/
+static void cache_charge(size_t slot, ssize_t delta) {
+  if (slot < CACHE_HOSTS) {
+    __sync_fetch_and_add(&Segment->hosts[slot].used, delta);
+  }
+}
+
+/**
+ * Return entry header and body chunk to their free lists.
+ *
+ * @param   s           CacheShard of entry.
+ * @param   e           CacheEntry structure.
+ *
+ * Must be called with the shard lock held.
+ **/
+static void cache_free(CacheShard *s, CacheEntry *e) {
+  if (e->data) {
+    *(void **)e->data = s->chunks[e->cls];
+    s->chunks[e->cls] = e->data;
+    e->data = NULL;
+  }
+  e->next   = s->unused;
+  s->unused = e;
+}
+
+/**
+ * Move ready entry to the front of its class's LRU list.
+ *
+ * @param   s           CacheShard of entry.
+ * @param   e           CacheEntry structure.
+ *
+ * Must be called with the shard lock held.
+ **/
+static void cache_touch(CacheShard *s, CacheEntry *e) {
+  if (s->newest[e->cls] == e) {
+    return;
+  }
+
+  /* Take out of list (if it is in it) */
+  if (e->newer) {
+    e->newer->older = e->older;
+  }
+  if (e->older) {
+    e->older->newer = e->newer;
+  } else if (s->oldest[e->cls] == e) {
+    s->oldest[e->cls] = e->newer;
+  }
+
+  /* Put in front of list */
+  e->newer = NULL;
+  e->older = s->newest[e->cls];
+  if (s->newest[e->cls]) {
+    s->newest[e->cls]->newer = e;
+  }
+  s->newest[e->cls] = e;
+  if (!s->oldest[e->cls]) {
+    s->oldest[e->cls] = e;
+  }
+}
+
+/**
+ * Remove entry from the cache.
+ *
+ * @param   s           CacheShard of entry.
+ * @param   e           CacheEntry structure.
+ *
+ * The entry is freed once the last request using it releases it.
+ *
+ * Must be called with the shard lock held.
+ **/
+static void cache_unlink(CacheShard *s, CacheEntry *e) {
+  CacheEntry **link = &s->buckets[(hash_string(e->key) / CACHE_SHARDS) & (CACHE_BUCKETS - 1)];
+  while (*link != e) {
+    link = &(*link)->next;
+  }
+  *link = e->next;
+
+  if (e->state == CACHE_READY) {
+    if (e->newer) {
+      e->newer->older = e->older;
+    } else {
+      s->newest[e->cls] = e->older;
+    }
+    if (e->older) {
+      e->older->newer = e->newer;
+    } else {
+      s->oldest[e->cls] = e->newer;
+    }
+    cache_charge(e->host, -(ssize_t)e->length);
+  }
+  e->newer = e->older = NULL;
+  e->linked = false;
+  if (e->refs == 0) {
+    cache_free(s, e);
+  }
+}
+
+/**
+ * Evict least recently used entry of shard.
+ *
+ * @param   s           CacheShard structure.
+ * @param   cls         Only evict from this class (or -1 for any class).
+ * @param   host        Only evict entries of this host slot (or -1 for any host).
+ * @return  true if an entry was evicted, false if none could be.
+ *
+ * Entries that are in use by a request are skipped.
+ *
+ * Must be called with the shard lock held.
+ **/
+static bool cache_evict(CacheShard *s, int cls, ssize_t host) {
+  int first = cls < 0 ? 0 : cls;
+  int last  = cls < 0 ? CACHE_CLASSES - 1 : cls;
+
+  for (int c = first; c <= last; c++) {
+    for (CacheEntry *e = s->oldest[c]; e; e = e->newer) {
+      if (e->refs == 0 && (host < 0 || e->host == (size_t)host)) {
+        cache_unlink(s, e);
+        __sync_fetch_and_add(&CacheState->evictions, 1);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Allocate slab chunk for body.
+ *
+ * @param   s           CacheShard structure.
+ * @param   cls         Slab class of body.
+ * @return  Chunk (or NULL if nothing can be evicted to make room).
+ *
+ * Chunks come from the class's free list, then from a fresh page split into
+ * chunks of the class, and finally from evicting the class's least recently
+ * used entries.  Pages are never moved between classes.
+ *
+ * Must be called with the shard lock held.
+ **/
+static void *cache_alloc(CacheShard *s, int cls) {
+  size_t size = CACHE_MIN_CHUNK << cls;
+
+  while (!s->chunks[cls]) {
+    if (s->used_pages < s->npages) {
+      char *page = s->pages + (s->used_pages++) * CACHE_PAGE_SIZE;
+      for (size_t offset = 0; offset < CACHE_PAGE_SIZE; offset += size) {
+        *(void **)(page + offset) = s->chunks[cls];
+        s->chunks[cls] = page + offset;
+      }
+    } else if (!cache_evict(s, cls, -1)) {
+      return NULL;
+    }
+  }
+
+  void *chunk = s->chunks[cls];
+  s->chunks[cls] = *(void **)chunk;
+  return chunk;
+}
+
+/**
+ * Check whether process filling an entry is still running.
+ *
+ * @param   pid         Process ID of filler.
+ * @return  true if the process is running, false if it exited.
+ *
+ * A worker that exited is only reaped when its parent gets around to it, so
+ * zombies count as exited too.
+ **/
+static bool cache_filler_alive(pid_t pid) {
+  char path[64];
+  char stat[128];
+  ssize_t nread;
+  int fd;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+  }
+  nread = read(fd, stat, sizeof(stat) - 1);
+  close(fd);
+  if (nread <= 0) {
+    return false;
+  }
+  stat[nread] = '\0';
+
+  /* State follows the parenthesized command name */
+  char *state = strrchr(stat, ')');
+  return !state || (state[1] != ' ' || (state[2] != 'Z' && state[2] != 'X'));
+}
+
+/**
+ * Return shard holding key.
+ *
+ * @param   key         Key of entry.
+ * @return  CacheShard structure.
+ **/
+static CacheShard *cache_shard(const char *key) {
+  return &Segment->shards[hash_string(key) % CACHE_SHARDS];
+}
+
+/* External Functions */
+
+/**
+ * Allocate shared cache segment and counters.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Everything lives in anonymous shared mappings made before any worker is
+ * started, so forked children find (and fill) the same cache as the parent
+ * and each other, at the same addresses.  CacheSize bytes of slab pages are
+ * split evenly between the shards.  The mimetypes table needs no such
+ * treatment: it is loaded before forking and only ever read, so children
+ * share its pages copy-on-write.
+ **/
+int cache_init(void) {
+  size_t npages = (CacheSize / CACHE_SHARDS + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE;
+  size_t header = (sizeof(CacheSegment) + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE;
+  size_t size   = header + CACHE_SHARDS * npages * CACHE_PAGE_SIZE;
+
+  CacheState = mmap(NULL, sizeof(CacheMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (CacheState == MAP_FAILED) {
+    log("Unable to map cache counters: %s", strerror(errno));
+    CacheState = NULL;
+    return -1;
+  }
+
+  Segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (Segment == MAP_FAILED) {
+    log("Unable to map cache segment: %s", strerror(errno));
+    Segment = NULL;
+    return -1;
+  }
+
+  if ((NegativeWatch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    log("Unable to watch directories: %s", strerror(errno));
+  }
+  cache_init_lock(&Segment->negative_lock, NULL);
+  Segment->negative_generation = 1;
+  cache_init_lock(&Segment->hosts_lock, NULL);
+
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *s = &Segment->shards[i];
+    cache_init_lock(&s->lock, &s->filled);
+    s->pages  = (char *)Segment + header + i * npages * CACHE_PAGE_SIZE;
+    s->npages = npages;
+    for (size_t j = 0; j < CACHE_ENTRIES; j++) {
+      s->entries[j].next = s->unused;
+      s->unused = &s->entries[j];
+    }
+  }
+
+  debug("Mapped %zu byte cache segment", size);
+  return 0;
+}
+
+/**
+ * Check whether a URI is known not to exist.
+ *
+ * @param   root        Real path of document root.
+ * @param   uri         Normalized URI.
+ * @return  true if the URI recently resolved to nothing, false otherwise.
+ **/
+bool negative_lookup(const char *root, const char *uri) {
+  char path[CACHE_KEY_SIZE];
+  bool hit;
+
+  if (NegativeWatch < 0 || !negative_key(root, uri, path)) {
+    return false;
+  }
+
+  cache_lock(&Segment->negative_lock);
+  negative_check();
+  NegativeEntry *e = &Segment->negative[hash_string(path) & (NEGATIVE_ENTRIES - 1)];
+  hit = e->generation == Segment->negative_generation && e->expires > monotonic_ns() && streq(e->path, path);
+  pthread_mutex_unlock(&Segment->negative_lock);
+
+  __sync_fetch_and_add(hit ? &CacheState->negative_hits : &CacheState->negative_misses, 1);
+  return hit;
+}
+
+/**
+ * Remember that a URI does not exist.
+ *
+ * @param   root        Real path of document root.
+ * @param   uri         Normalized URI.
+ *
+ * The nearest existing directory above the path is watched with inotify, so
+ * creating (or renaming into place) anything that could make the path exist
+ * flushes the cache.  Entries also expire after NEGATIVE_TTL, in case a change
+ * happens out of sight of the watch (such as below a symbolic link).  The
+ * table is direct-mapped, so a new entry simply replaces whatever was in its
+ * slot and the cache never grows.
+ **/
+void negative_insert(const char *root, const char *uri) {
+  char path[CACHE_KEY_SIZE];
+  char directory[CACHE_KEY_SIZE];
+  struct stat st;
+
+  if (NegativeWatch < 0 || !negative_key(root, uri, path)) {
+    return;
+  }
+
+  /* Find nearest existing directory (the root itself at worst) */
+  strcpy(directory, path);
+  do {
+    char *slash = strrchr(directory, '/');
+    if (!slash || slash == directory) {
+      return;
+    }
+    *slash = '\0';
+  } while (stat(directory, &st) < 0 || !S_ISDIR(st.st_mode));
+
+  /* Watch before the final check, so a file created meanwhile is not missed */
+  cache_lock(&Segment->negative_lock);
+  negative_check();
+  if (inotify_add_watch(NegativeWatch, directory, NEGATIVE_EVENTS) >= 0 && lstat(path, &st) < 0) {
+    NegativeEntry *e = &Segment->negative[hash_string(path) & (NEGATIVE_ENTRIES - 1)];
+    e->generation = Segment->negative_generation;
+    e->expires    = monotonic_ns() + NEGATIVE_TTL;
+    strcpy(e->path, path);
+  }
+  pthread_mutex_unlock(&Segment->negative_lock);
+}
+
+/**
+ * Acquire content entry, waiting for (or becoming) its single filler.
+ *
+ * @param   host        Virtual host the content belongs to.
+ * @param   key         Real path of file (with any query for CGI output).
+ * @param   st          Status of source file to validate against (or NULL).
+ * @param   ttl         Lifetime of the entry in seconds (0 for no limit).
+ * @param   fill        Set to whether the caller must fill the entry.
+ * @return  Acquired entry (or NULL if the content cannot be cached).
+ *
+ * Only one request fills a missing (or stale) entry: it gets fill set and must
+ * call cache_complete.  Concurrent requests for the same key, in any worker
+ * process, wait for that request instead of repeating its work and then share
+ * its result.  If the fill fails (or the filling process dies), the waiters
+ * get NULL and do the work without the cache.
+ *
+ * Acquired entries must be released with cache_release.
+ **/
+CacheEntry *cache_acquire(VirtualHost *host, const char *key, const struct stat *st, unsigned ttl, bool *fill) {
+  CacheShard *s = cache_shard(key);
+  size_t bucket = (hash_string(key) / CACHE_SHARDS) & (CACHE_BUCKETS - 1);
+  CacheEntry *e;
+
+  *fill = false;
+  if (!CacheSize || strlen(key) >= CACHE_KEY_SIZE) {
+    return NULL;
+  }
+
+  cache_lock(&s->lock);
+  for (e = s->buckets[bucket]; e && !streq(e->key, key); e = e->next);
+
+  /* Wait for request already filling the entry */
+  if (e && e->state == CACHE_FILLING) {
+    e->refs++;
+    __sync_fetch_and_add(&CacheState->coalesced, 1);
+    while (e->state == CACHE_FILLING) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec++;
+      int status = pthread_cond_timedwait(&s->filled, &s->lock, &deadline);
+      if (status == EOWNERDEAD) {
+        pthread_mutex_consistent(&s->lock);
+      }
+      if (status == ETIMEDOUT && e->state == CACHE_FILLING && !cache_filler_alive(e->filler)) {
+        log("Cache filler %d exited without completing.", e->filler);
+        e->state = CACHE_FAILED;
+        e->refs--;
+        cache_unlink(s, e);
+        pthread_cond_broadcast(&s->filled);
+      }
+    }
+    if (e->state == CACHE_READY) {
+      pthread_mutex_unlock(&s->lock);
+      return e;
+    }
+    if (--e->refs == 0 && !e->linked) {
+      cache_free(s, e);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+  }
+
+  /* Serve current entry */
+  if (e && (!e->expires || monotonic_ns() < e->expires) &&
+      (!st || (e->ino == st->st_ino && e->size == st->st_size &&
+               e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec))) {
+    e->refs++;
+    cache_touch(s, e);
+    pthread_mutex_unlock(&s->lock);
+    __sync_fetch_and_add(&CacheState->hits, 1);
+    return e;
+  }
+  if (e) {
+    cache_unlink(s, e);
+  }
+
+  /* Become filler of new entry */
+  if (!s->unused && !cache_evict(s, -1, -1)) {
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+  }
+  e = s->unused;
+  s->unused = e->next;
+  memset(e, 0, sizeof(CacheEntry));
+  strcpy(e->key, key);
+  e->state   = CACHE_FILLING;
+  e->filler  = getpid();
+  e->host    = cache_host(host);
+  e->budget  = host->cache_size;
+  e->refs    = 1;
+  e->linked  = true;
+  e->expires = ttl;
+  if (st) {
+    e->ino   = st->st_ino;
+    e->size  = st->st_size;
+    e->mtime = st->st_mtim;
+  }
+  e->next = s->buckets[bucket];
+  s->buckets[bucket] = e;
+  pthread_mutex_unlock(&s->lock);
+
+  __sync_fetch_and_add(&CacheState->misses, 1);
+  *fill = true;
+  return e;
+}
+
+/**
+ * Complete filling content entry and wake requests waiting for it.
+ *
+ * @param   e           CacheEntry structure (acquired with fill set).
+ * @param   data        Body (or NULL if the fill failed).
+ * @param   length      Length of body.
+ * @param   type        Content-Type of body (may be NULL).
+ * @return  true if the body was stored, false otherwise.
+ *
+ * The body is copied into a slab chunk of the shared segment, so the caller
+ * keeps ownership of data.  The host's least recently used entries in the
+ * shard are evicted first to keep it within its cache_size (if it has one);
+ * since hosts are charged across all shards this budget is approximate.
+ **/
+bool cache_complete(CacheEntry *e, const char *data, size_t length, const char *type) {
+  CacheShard *s = cache_shard(e->key);
+  bool stored = false;
+
+  cache_lock(&s->lock);
+  if (data && e->linked && length <= CACHE_BODY_LIMIT && (!e->budget || length <= e->budget)) {
+    e->cls = cache_class(length);
+
+    /* Keep host within its budget */
+    while (e->budget && e->host < CACHE_HOSTS &&
+           Segment->hosts[e->host].used + length > e->budget &&
+           cache_evict(s, -1, e->host));
+
+    if ((e->data = cache_alloc(s, e->cls)) != NULL) {
+      memcpy(e->data, data, length);
+      e->length = length;
+      snprintf(e->type, sizeof(e->type), "%s", type ? type : "");
+      if (e->expires) {
+        e->expires = monotonic_ns() + e->expires * 1000000000ULL;
+      }
+      e->state = CACHE_READY;
+      cache_charge(e->host, length);
+      cache_touch(s, e);
+      stored = true;
+    }
+  }
+
+  if (!stored) {
+    e->state = CACHE_FAILED;
+    if (e->linked) {
+      cache_unlink(s, e);
+    }
+  }
+  pthread_cond_broadcast(&s->filled);
+  pthread_mutex_unlock(&s->lock);
+  return stored;
+}
+
+/**
+ * Release acquired content entry.
+ *
+ * @param   e           CacheEntry structure.
+ **/
+void cache_release(CacheEntry *e) {
+  CacheShard *s = cache_shard(e->key);
+
+  cache_lock(&s->lock);
+  if (--e->refs == 0 && !e->linked) {
+    cache_free(s, e);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Fill cache entry with contents of small file.
+ *
+ * @param   host        Virtual host the file is served for.
+ * @param   path        Real path of file.
+ * @param   st          Status of file.
+ * @return  Acquired entry holding the file (or NULL if it is not cached).
+ *
+ * If the file is not cached (or changed since), the caller reads it while any
+ * concurrent requests for the same file wait for it (see cache_acquire).
+ **/
+CacheEntry *cache_file(VirtualHost *host, const char *path, const struct stat *st) {
+  char *data = NULL;
+  char *type;
+  ssize_t nread = 0;
+  bool fill, stored;
+  int fd;
+
+  CacheEntry *e = cache_acquire(host, path, st, 0, &fill);
+  if (!e || !fill) {
+    return e;
+  }
+
+  /* Read whole file (it must not have changed since it was checked) */
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+    if ((data = malloc(st->st_size + 1)) != NULL) {
+      nread = read(fd, data, st->st_size + 1);
+    }
+    close(fd);
+  }
+  if (!data || nread != st->st_size) {
+    free(data);
+    cache_complete(e, NULL, 0, NULL);
+    cache_release(e);
+    return NULL;
+  }
+
+  /* Body is copied into the shared cache (unless there is no room for it) */
+  type   = determine_mimetype(path, host->mimetype);
+  stored = cache_complete(e, data, nread, type);
+  free(type);
+  free(data);
+  if (!stored) {
+    cache_release(e);
+    return NULL;
+  }
+  return e;
+}
+
+/**
+ * Drop every content entry.
+ *
+ * This is used when the virtual hosts are reloaded, since entries are charged
+ * to the hosts they were cached for.
+ **/
+void cache_flush(void) {
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *s = &Segment->shards[i];
+    cache_lock(&s->lock);
+    for (size_t b = 0; b < CACHE_BUCKETS; b++) {
+      while (s->buckets[b]) {
+        cache_unlink(s, s->buckets[b]);
+      }
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+/**
+ * Log cache counters.
+ **/
+void cache_dump_metrics(void) {
+  size_t pages = 0;
+
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    pages += Segment->shards[i].used_pages;
+  }
+
+  log("METRICS cache hits=%lu misses=%lu coalesced=%lu evictions=%lu pages=%zu/%zu",
+      CacheState->hits, CacheState->misses, CacheState->coalesced, CacheState->evictions,
+      pages, CACHE_SHARDS * Segment->shards[0].npages);
+  log("METRICS negative hits=%lu misses=%lu flushes=%lu",
+      CacheState->negative_hits, CacheState->negative_misses, CacheState->negative_flushes);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,49 +6,96 @@
 #include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Listening sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
  * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * handle the requests on the connection.  If an affinity list is set, the child pins itself to
+ * the CPU that received the connection (or the next CPU in the list).
+ *
+ * If MaxConnections children are already running, the connection is rejected
+ * with 503 Service Unavailable instead of forking another child.
+ *
+ * The loop ends when handle_signals reports that a new binary has taken over
+ * the server sockets, at which point the parent waits for its children to
+ * finish their in-flight requests before exiting.
+ *
+ * Children never call handle_signals, so SIGTERM is reset to its default
+ * action in them: a child told to terminate (say, along with the rest of its
+ * process group) does so instead of setting a flag no one reads.  SIGTERM is
+ * blocked across fork so that one arriving in between is not lost either.
  **/
-int forking_server(int sfd) {
+int forking_server(ListenerSet *listeners) {
+  size_t connections = 0;
+  
   /* Accept and handle HTTP request */
-  while (true) {
+  while (handle_signals(listeners)) {
     /* Accept request */
     debug("Accepting client request.");
-    Request *r = accept_request(sfd);
+    int i = socket_wait(listeners);
+    Request *r = i < 0 ? NULL : accept_request(listeners->fds[i], listeners->tls[i]);
+    
+    /* Reap finished children */
+    while(waitpid(-1, NULL, WNOHANG) > 0){
+      admission_leave();
+    }
+    
     if(!r){
       continue;
     }
     
+    /* Reject request if too many children are running */
+    if(!admission_enter()){
+      reject_request(r);
+      free_request(r);
+      continue;
+    }
+    
     /* Ignore children */
     signal(SIGINT, SIG_IGN);
     
     /* Fork off child process to handle request */
+    sigset_t term, previous;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term, &previous);
     pid_t rc = fork();
     if(rc == 0){
       // child
-      close(sfd);
-      exit(handle_request(r) != 0);
-    }else if(rc > 0){
-      // parent
+      signal(SIGTERM, SIG_DFL);
+      sigprocmask(SIG_SETMASK, &previous, NULL);
+      socket_close(listeners);
+      affinity_pin_connection(r->fd, connections);
+      HTTPStatus status = handle_connection(r);
+      free_request(r);
+      exit(status != HTTP_STATUS_OK);
+    }
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+    if(rc > 0){
+      // parent (the child owns the connection and its trace record)
+      connections++;
+#ifdef TRACE
+      memset(r->trace, 0, sizeof(r->trace));
+#endif
       free_request(r);
       continue;
     }else if(rc < 0){
       // error
+      admission_leave();
       free_request(r);
       continue;
     }
   }
   
-  /* Close server socket */
-  close(sfd);
+  /* Close server sockets and drain children */
+  socket_close(listeners);
+  while(waitpid(-1, NULL, 0) > 0 || errno == EINTR);
   return EXIT_SUCCESS;
 }
 
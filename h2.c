@@ -0,0 +1,1741 @@
+/* h2.c: HTTP/2 Connection Functions */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH   24
+#define H2_PREFACE_LINE     16          /* Request line of preface (parsed by parse_request) */
+#define H2_FRAME_HEADER     9           /* Length, type, flags, and stream of frame */
+#define H2_FRAME_SIZE       16384       /* Largest frame sent or accepted */
+#define H2_MAX_STREAMS      32          /* Concurrent streams per connection */
+#define H2_MAX_BURST        128         /* Streams allowed before SETTINGS is acknowledged */
+#define H2_HEADER_BLOCK     (64 * 1024) /* Largest request header block */
+#define H2_TABLE_SIZE       4096        /* Size of HPACK dynamic table */
+#define H2_TABLE_ENTRIES    (H2_TABLE_SIZE / 32)
+#define H2_WINDOW           65535       /* Initial flow control window */
+#define H2_WINDOW_MAX       0x7fffffff  /* Largest flow control window */
+#define H2_BODY_LIMIT       BUFSIZ      /* Largest request body (the stream receive window) */
+#define H2_HEAD_LIMIT       BUFSIZ      /* Largest response head */
+#define H2_FIELD_OVERHEAD   16          /* Largest encoding of a field besides name and value */
+
+typedef enum {
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION,
+} H2FrameType;
+
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+typedef enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE,
+    H2_SETTINGS_MAX_FRAME_SIZE,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+} H2Setting;
+
+typedef enum {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+} H2Error;
+
+/* HPACK static table (RFC 7541, Appendix A), indexed from 1 */
+static const char *StaticTable[][2] = {
+    {":authority",                    ""},
+    {":method",                       "GET"},
+    {":method",                       "POST"},
+    {":path",                         "/"},
+    {":path",                         "/index.html"},
+    {":scheme",                       "http"},
+    {":scheme",                       "https"},
+    {":status",                       "200"},
+    {":status",                       "204"},
+    {":status",                       "206"},
+    {":status",                       "304"},
+    {":status",                       "400"},
+    {":status",                       "404"},
+    {":status",                       "500"},
+    {"accept-charset",                ""},
+    {"accept-encoding",               "gzip, deflate"},
+    {"accept-language",               ""},
+    {"accept-ranges",                 ""},
+    {"accept",                        ""},
+    {"access-control-allow-origin",   ""},
+    {"age",                           ""},
+    {"allow",                         ""},
+    {"authorization",                 ""},
+    {"cache-control",                 ""},
+    {"content-disposition",           ""},
+    {"content-encoding",              ""},
+    {"content-language",              ""},
+    {"content-length",                ""},
+    {"content-location",              ""},
+    {"content-range",                 ""},
+    {"content-type",                  ""},
+    {"cookie",                        ""},
+    {"date",                          ""},
+    {"etag",                          ""},
+    {"expect",                        ""},
+    {"expires",                       ""},
+    {"from",                          ""},
+    {"host",                          ""},
+    {"if-match",                      ""},
+    {"if-modified-since",             ""},
+    {"if-none-match",                 ""},
+    {"if-range",                      ""},
+    {"if-unmodified-since",           ""},
+    {"last-modified",                 ""},
+    {"link",                          ""},
+    {"location",                      ""},
+    {"max-forwards",                  ""},
+    {"proxy-authenticate",            ""},
+    {"proxy-authorization",           ""},
+    {"range",                         ""},
+    {"referer",                       ""},
+    {"refresh",                       ""},
+    {"retry-after",                   ""},
+    {"server",                        ""},
+    {"set-cookie",                    ""},
+    {"strict-transport-security",     ""},
+    {"transfer-encoding",             ""},
+    {"user-agent",                    ""},
+    {"vary",                          ""},
+    {"via",                           ""},
+    {"www-authenticate",              ""},
+};
+
+/* Number of Huffman codes of each length (RFC 7541, Appendix B) */
+static const uint8_t HuffmanCounts[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+/* Huffman symbols in code order (the code is canonical) */
+static const uint16_t HuffmanSymbols[257] = {
+     48,  49,  50,  97,  99, 101, 105, 111, 115, 116,  32,  37,
+     45,  46,  47,  51,  52,  53,  54,  55,  56,  57,  61,  65,
+     95,  98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+     58,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,
+     77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122,  38,  42,  44,  59,
+     88,  90,  33,  34,  40,  41,  63,  39,  43, 124,  35,  62,
+      0,  36,  64,  91,  93, 126,  94, 125,  60,  96, 123,  92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239,   9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254,   2,   3,   4,   5,
+      6,   7,   8,  11,  12,  14,  15,  16,  17,  18,  19,  20,
+     21,  23,  24,  25,  26,  27,  28,  29,  30,  31, 127, 220,
+    249,  10,  13,  22, 256,
+};
+
+typedef struct {
+    char        *name;                  /*< Name of header */
+    char        *value;                 /*< Value of header */
+} HPACKEntry;
+
+typedef struct {
+    HPACKEntry  entries[H2_TABLE_ENTRIES]; /*< Ring of entries (newest at head) */
+    size_t      head;                   /*< Index of newest entry */
+    size_t      count;                  /*< Number of entries */
+    size_t      size;                   /*< Size of entries (as counted by HPACK) */
+    size_t      limit;                  /*< Size allowed by the client's encoder */
+} HPACKTable;
+
+typedef struct h2_connection H2Connection;
+
+struct h2_stream {
+    Request     request;                /*< Request carried by stream */
+    H2Connection *conn;                 /*< Connection of stream */
+    uint32_t    id;                     /*< Stream identifier */
+    int32_t     window;                 /*< Bytes the client lets us send */
+    bool        running;                /*< Whether the request is being handled */
+    bool        complete;               /*< Whether the client ended the stream */
+    bool        reset;                  /*< Whether the stream was reset */
+    bool        replied;                /*< Whether HEADERS were sent */
+    bool        ended;                  /*< Whether END_STREAM was sent */
+    bool        released;               /*< Whether the stream stopped counting as open */
+    char        *head;                  /*< Response head being collected */
+    size_t      nhead;                  /*< Length of response head */
+    H2Stream    *next;                  /*< Next open stream of connection */
+};
+
+struct h2_connection {
+    Request     *r;                     /*< Connection (socket and read buffer) */
+    pthread_mutex_t lock;               /*< Protects streams, windows, and settings */
+    pthread_mutex_t wlock;              /*< Keeps frames written to socket whole */
+    pthread_cond_t  changed;            /*< Signalled when windows open or streams end */
+    H2Stream    *streams;               /*< Open streams */
+    size_t      nstreams;               /*< Number of open streams */
+    size_t      nopen;                  /*< Streams counted against H2_MAX_STREAMS */
+    int32_t     window;                 /*< Bytes the client lets us send */
+    int32_t     initial;                /*< Send window of new streams */
+    uint32_t    max_frame;              /*< Largest frame the client accepts */
+    uint32_t    last;                   /*< Highest stream identifier received */
+    size_t      consumed;               /*< Received DATA bytes not yet returned */
+    size_t      nrequests;              /*< Streams started */
+    bool        settled;                /*< Whether the client acknowledged our SETTINGS */
+    bool        goaway;                 /*< Whether new streams are refused */
+    bool        closing;                /*< Whether the connection is going away */
+    HPACKTable  table;                  /*< Decoder state */
+    uint8_t     *block;                 /*< Header block being collected */
+    size_t      nblock;                 /*< Length of header block */
+    uint32_t    bstream;                /*< Stream of header block (0 = none) */
+    uint8_t     bflags;                 /*< Flags of HEADERS frame starting block */
+    uint8_t     frame[H2_FRAME_SIZE];   /*< Payload of frame being read */
+};
+
+/* Internal Functions */
+
+/**
+ * Read 32-bit big-endian integer.
+ **/
+static uint32_t h2_get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * Write 32-bit big-endian integer.
+ **/
+static void h2_put32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/**
+ * Write frame to socket (with the write lock held).
+ *
+ * @param   c           Connection structure.
+ * @param   type        Type of frame.
+ * @param   flags       Flags of frame.
+ * @param   stream      Stream identifier (0 for the connection).
+ * @param   payload     Payload of frame.
+ * @param   length      Length of payload.
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_frame_locked(H2Connection *c, H2FrameType type, uint8_t flags, uint32_t stream,
+                           const void *payload, size_t length) {
+  uint8_t header[H2_FRAME_HEADER] = { length >> 16, length >> 8, length, type, flags };
+  struct iovec iov[] = {
+    { header, sizeof(header) },
+    { (void *)payload, length },
+  };
+  struct iovec *v = iov;
+  int iovcnt = length ? 2 : 1;
+
+  h2_put32(header + 5, stream);
+  while (iovcnt > 0) {
+    ssize_t nwritten = writev(c->r->fd, v, iovcnt);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)nwritten >= v->iov_len) {
+      nwritten -= v->iov_len;
+      v++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      v->iov_base = (char *)v->iov_base + nwritten;
+      v->iov_len -= nwritten;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Write frame to socket.
+ *
+ * @return  -1 on error and 0 on success (see h2_frame_locked).
+ *
+ * Streams write from their own threads, so each frame is written under the
+ * write lock to keep it whole.
+ **/
+static int h2_frame(H2Connection *c, H2FrameType type, uint8_t flags, uint32_t stream,
+                    const void *payload, size_t length) {
+  int status;
+
+  pthread_mutex_lock(&c->wlock);
+  status = h2_frame_locked(c, type, flags, stream, payload, length);
+  pthread_mutex_unlock(&c->wlock);
+  return status;
+}
+
+/**
+ * Reset stream.
+ *
+ * @param   c           Connection structure.
+ * @param   stream      Stream identifier.
+ * @param   error       Error code.
+ **/
+static void h2_reset(H2Connection *c, uint32_t stream, H2Error error) {
+  uint8_t payload[4];
+
+  h2_put32(payload, error);
+  h2_frame(c, H2_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+/**
+ * Tell client the connection is going away.
+ *
+ * @param   c           Connection structure.
+ * @param   error       Error code.
+ * @return  false (so frame handlers can return it to end the connection).
+ **/
+static bool h2_goaway(H2Connection *c, H2Error error) {
+  uint8_t payload[8];
+
+  h2_put32(payload, c->last);
+  h2_put32(payload + 4, error);
+  h2_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  if (error != H2_NO_ERROR) {
+    log("HTTP/2 connection error %d", error);
+  }
+  c->goaway = true;
+  return false;
+}
+
+/**
+ * Read bytes from client.
+ *
+ * @param   c           Connection structure.
+ * @param   buffer      Buffer to read into.
+ * @param   length      Number of bytes to read.
+ * @return  1 on success, 0 if the client sent nothing for KeepAliveTimeout
+ * seconds before the first byte, and -1 on error or EOF.
+ *
+ * Bytes the client sent before switching to HTTP/2 (that are still in the
+ * connection's read buffer) are read first.
+ **/
+static int h2_read(H2Connection *c, void *buffer, size_t length) {
+  Request *r = c->r;
+  size_t n = 0;
+
+  while (n < length) {
+    if (r->bstart < r->bend) {
+      size_t available = r->bend - r->bstart < length - n ? r->bend - r->bstart : length - n;
+      memcpy((char *)buffer + n, r->buffer + r->bstart, available);
+      r->bstart += available;
+      n += available;
+      continue;
+    }
+
+    ssize_t nread = read(r->fd, (char *)buffer + n, length - n);
+    if (nread < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && n == 0) {
+      return 0;
+    }
+    if (nread <= 0) {
+      return -1;
+    }
+    n += nread;
+  }
+  return 1;
+}
+
+/**
+ * Find open stream.
+ *
+ * @param   c           Connection structure.
+ * @param   id          Stream identifier.
+ * @return  Stream (or NULL if the stream is not open).
+ *
+ * Must be called with the connection lock held.
+ **/
+static H2Stream *h2_find(H2Connection *c, uint32_t id) {
+  for (H2Stream *s = c->streams; s; s = s->next) {
+    if (s->id == id) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Open stream for request.
+ *
+ * @param   c           Connection structure.
+ * @param   id          Stream identifier.
+ * @return  Newly allocated stream (or NULL on error).
+ *
+ * The stream's request shares the connection's socket and client address, so
+ * handlers, logs, and CGI see the same client as for HTTP/1.
+ **/
+static H2Stream *h2_open(H2Connection *c, uint32_t id) {
+  H2Stream *s = calloc(1, sizeof(H2Stream));
+  Request  *r;
+
+  if (!s) {
+    return NULL;
+  }
+
+  r = &s->request;
+  r->fd       = c->r->fd;
+  r->addr     = c->r->addr;
+  r->addrlen  = c->r->addrlen;
+  r->output   = -1;
+  r->stream   = s;
+  r->accepted = monotonic_ns();
+  trace(r, TRACE_ACCEPT);
+  trace(r, TRACE_FIRST_BYTE);
+
+  s->conn = c;
+  s->id   = id;
+
+  pthread_mutex_lock(&c->lock);
+  s->window  = c->initial;
+  s->next    = c->streams;
+  c->streams = s;
+  c->nstreams++;
+  c->nopen++;
+  pthread_mutex_unlock(&c->lock);
+  return s;
+}
+
+/**
+ * Stop counting stream as open.
+ *
+ * @param   s           Stream structure.
+ *
+ * The client may open another stream as soon as it sees this one end, which
+ * can be before the stream's thread is done with it, so a stream stops
+ * counting against H2_MAX_STREAMS just before its last frame is sent.
+ **/
+static void h2_release(H2Stream *s) {
+  H2Connection *c = s->conn;
+
+  pthread_mutex_lock(&c->lock);
+  if (!s->released) {
+    s->released = true;
+    c->nopen--;
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Close stream and deallocate it.
+ *
+ * @param   s           Stream structure.
+ **/
+static void h2_close(H2Stream *s) {
+  H2Connection *c = s->conn;
+  Request *r = &s->request;
+
+  h2_release(s);
+  pthread_mutex_lock(&c->lock);
+  for (H2Stream **p = &c->streams; *p; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  }
+  c->nstreams--;
+  pthread_cond_broadcast(&c->changed);
+  pthread_mutex_unlock(&c->lock);
+
+  /* The body buffer is the stream's own, not one borrowed from the pool */
+  free(r->buffer);
+  r->buffer = NULL;
+  r->bstart = r->bend = 0;
+  reset_request(r);
+  free(s->head);
+  free(s);
+}
+
+/* HPACK */
+
+/**
+ * Find entry of HPACK table.
+ *
+ * @param   t           Dynamic table.
+ * @param   index       Index (static entries first, from 1).
+ * @param   name        Set to name of entry.
+ * @param   value       Set to value of entry.
+ * @return  true if the entry exists, false otherwise.
+ **/
+static bool hpack_lookup(HPACKTable *t, size_t index, const char **name, const char **value) {
+  size_t nstatic = sizeof(StaticTable) / sizeof(StaticTable[0]);
+
+  if (index == 0) {
+    return false;
+  }
+  if (index <= nstatic) {
+    *name  = StaticTable[index - 1][0];
+    *value = StaticTable[index - 1][1];
+    return true;
+  }
+  if (index - nstatic > t->count) {
+    return false;
+  }
+  HPACKEntry *e = &t->entries[(t->head + index - nstatic - 1) % H2_TABLE_ENTRIES];
+  *name  = e->name;
+  *value = e->value;
+  return true;
+}
+
+/**
+ * Evict oldest entries of HPACK table until it fits in size.
+ **/
+static void hpack_evict(HPACKTable *t, size_t size) {
+  while (t->count > 0 && t->size > size) {
+    HPACKEntry *e = &t->entries[(t->head + t->count - 1) % H2_TABLE_ENTRIES];
+    t->size -= strlen(e->name) + strlen(e->value) + 32;
+    free(e->name);
+    free(e->value);
+    t->count--;
+  }
+}
+
+/**
+ * Add entry to HPACK table.
+ *
+ * @param   t           Dynamic table.
+ * @param   name        Name of header.
+ * @param   value       Value of header.
+ *
+ * Entries too large for the table empty it (RFC 7541, Section 4.4).  Every
+ * entry takes at least 32 bytes, so the ring never holds more than
+ * H2_TABLE_ENTRIES.
+ **/
+static void hpack_insert(HPACKTable *t, const char *name, const char *value) {
+  size_t size = strlen(name) + strlen(value) + 32;
+
+  if (size > t->limit) {
+    hpack_evict(t, 0);
+    return;
+  }
+  hpack_evict(t, t->limit - size);
+  t->head = (t->head + H2_TABLE_ENTRIES - 1) % H2_TABLE_ENTRIES;
+  t->entries[t->head].name  = strdup(name);
+  t->entries[t->head].value = strdup(value);
+  t->size += size;
+  t->count++;
+}
+
+/**
+ * Decode HPACK integer.
+ *
+ * @param   p           Position in header block (advanced).
+ * @param   end         End of header block.
+ * @param   prefix      Number of bits of the first byte used.
+ * @param   value       Set to decoded integer.
+ * @return  true on success, false if the integer is truncated or too large.
+ **/
+static bool hpack_integer(const uint8_t **p, const uint8_t *end, int prefix, size_t *value) {
+  size_t max = (1U << prefix) - 1;
+
+  if (*p >= end) {
+    return false;
+  }
+  *value = *(*p)++ & max;
+  if (*value < max) {
+    return true;
+  }
+  for (int shift = 0; *p < end && shift <= 21; shift += 7) {
+    uint8_t b = *(*p)++;
+    *value += (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Decode Huffman-coded string.
+ *
+ * @param   data        Coded string.
+ * @param   length      Length of coded string.
+ * @return  Allocated string (or NULL if the coding is invalid).
+ *
+ * The code is canonical, so codes of each length are consecutive numbers that
+ * follow on from the codes one bit shorter; a symbol is found by comparing
+ * the bits read so far against the first code of their length.
+ **/
+static char *hpack_huffman(const uint8_t *data, size_t length) {
+  char *s = malloc(length * 8 / 5 + 1);
+  uint32_t code = 0, first = 0;
+  size_t offset = 0, n = 0;
+  int bits = 0;
+
+  if (!s) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    for (int b = 7; b >= 0; b--) {
+      code = code << 1 | ((data[i] >> b) & 1);
+      bits++;
+      if (bits > 30) {
+        goto fail;
+      }
+      if (code - first < HuffmanCounts[bits]) {
+        uint16_t symbol = HuffmanSymbols[offset + code - first];
+        if (symbol == 256) {
+          goto fail;
+        }
+        s[n++] = symbol;
+        code = first = offset = bits = 0;
+        continue;
+      }
+      offset += HuffmanCounts[bits];
+      first   = (first + HuffmanCounts[bits]) << 1;
+    }
+  }
+
+  /* Padding is the most significant bits of EOS (all ones), under a byte */
+  if (bits > 7 || code != (1U << bits) - 1) {
+    goto fail;
+  }
+  s[n] = '\0';
+  return s;
+
+fail:
+  free(s);
+  return NULL;
+}
+
+/**
+ * Decode HPACK string literal.
+ *
+ * @param   p           Position in header block (advanced).
+ * @param   end         End of header block.
+ * @return  Allocated string (or NULL on error).
+ **/
+static char *hpack_string(const uint8_t **p, const uint8_t *end) {
+  bool huffman;
+  size_t length;
+  char *s;
+
+  if (*p >= end) {
+    return NULL;
+  }
+  huffman = **p & 0x80;
+  if (!hpack_integer(p, end, 7, &length) || length > (size_t)(end - *p)) {
+    return NULL;
+  }
+  s = huffman ? hpack_huffman(*p, length) : strndup((const char *)*p, length);
+  *p += length;
+  return s;
+}
+
+/**
+ * Add decoded header field to stream request.
+ *
+ * @param   r           Request of stream (NULL to discard the field).
+ * @param   name        Name of field.
+ * @param   value       Value of field.
+ * @return  true on success, false if the request is malformed.
+ *
+ * The pseudo-headers take the place of the request line: :path is split into
+ * the URI and query, and :authority becomes the Host header.
+ **/
+static bool h2_field(Request *r, const char *name, const char *value) {
+  if (!r) {
+    return true;
+  }
+
+  if (name[0] == ':') {
+    if (streq(name, ":method") && !r->method) {
+      r->method = strdup(value);
+    } else if (streq(name, ":path") && !r->uri && value[0]) {
+      const char *query = strchr(value, '?');
+      r->uri   = query ? strndup(value, query - value) : strdup(value);
+      r->query = query ? strdup(query + 1) : NULL;
+    } else if (streq(name, ":authority")) {
+      name = "Host";
+    } else if (!streq(name, ":scheme")) {
+      return false;
+    }
+    if (name[0] == ':') {
+      return true;
+    }
+  }
+
+  Header *header = calloc(1, sizeof(Header));
+  if (!header) {
+    return false;
+  }
+  header->name  = strdup(name);
+  header->value = strdup(value);
+  header->next  = r->headers;
+  r->headers    = header;
+  return true;
+}
+
+/**
+ * Decode HPACK header block into stream request.
+ *
+ * @param   c           Connection structure.
+ * @param   r           Request of stream (NULL to only update the table).
+ * @param   malformed   Set if the request is malformed (the block decoded).
+ * @return  -1 on a compression error (fatal to the connection) and 0 otherwise.
+ *
+ * Blocks of refused and reset streams must still be decoded, since they may
+ * change the dynamic table.
+ **/
+static int hpack_decode(H2Connection *c, Request *r, bool *malformed) {
+  const uint8_t *p = c->block, *end = c->block + c->nblock;
+  HPACKTable *t = &c->table;
+  bool sized = false;
+
+  while (p < end) {
+    const char *iname = NULL, *ivalue = NULL;
+    char *name = NULL, *value = NULL;
+    size_t index;
+    bool indexing = false;
+
+    if (*p & 0x80) {
+      /* Indexed field */
+      if (!hpack_integer(&p, end, 7, &index) || !hpack_lookup(t, index, &iname, &ivalue)) {
+        return -1;
+      }
+      *malformed |= !h2_field(r, iname, ivalue);
+      continue;
+    }
+
+    if ((*p & 0xe0) == 0x20) {
+      /* Dynamic table size update (only at the start of a block) */
+      if (sized || !hpack_integer(&p, end, 5, &index) || index > H2_TABLE_SIZE) {
+        return -1;
+      }
+      t->limit = index;
+      hpack_evict(t, t->limit);
+      continue;
+    }
+
+    /* Literal field, with incremental indexing or without (or never) indexed */
+    indexing = (*p & 0xc0) == 0x40;
+    if (!hpack_integer(&p, end, indexing ? 6 : 4, &index)) {
+      return -1;
+    }
+    if (index && !hpack_lookup(t, index, &iname, &ivalue)) {
+      return -1;
+    }
+    if (!index && (name = hpack_string(&p, end)) == NULL) {
+      return -1;
+    }
+    if ((value = hpack_string(&p, end)) == NULL) {
+      free(name);
+      return -1;
+    }
+    if (indexing) {
+      hpack_insert(t, name ? name : iname, value);
+    }
+    *malformed |= !h2_field(r, name ? name : iname, value);
+    free(name);
+    free(value);
+    sized = true;
+  }
+  return 0;
+}
+
+/**
+ * Encode HPACK integer.
+ *
+ * @param   out         Buffer to encode into.
+ * @param   value       Integer.
+ * @param   prefix      Number of bits of the first byte used.
+ * @param   pattern     High bits of the first byte.
+ * @return  Number of bytes written.
+ **/
+static size_t hpack_put_integer(uint8_t *out, size_t value, int prefix, uint8_t pattern) {
+  size_t max = (1U << prefix) - 1;
+  size_t n = 0;
+
+  if (value < max) {
+    out[n++] = pattern | value;
+    return n;
+  }
+  out[n++] = pattern | max;
+  for (value -= max; value >= 0x80; value >>= 7) {
+    out[n++] = (value & 0x7f) | 0x80;
+  }
+  out[n++] = value;
+  return n;
+}
+
+/**
+ * Encode HPACK string literal (without Huffman coding).
+ **/
+static size_t hpack_put_string(uint8_t *out, const char *s, size_t length) {
+  size_t n = hpack_put_integer(out, length, 7, 0);
+  memcpy(out + n, s, length);
+  return n + length;
+}
+
+/**
+ * Encode response header field.
+ *
+ * @param   out         Buffer to encode into (with room for the field).
+ * @param   name        Name of field (lower case).
+ * @param   value       Value of field.
+ * @param   length      Length of value.
+ * @return  Number of bytes written.
+ *
+ * Responses are encoded without the dynamic table: a field is sent as a
+ * static table entry if one matches exactly, and otherwise as a literal that
+ * is not indexed (using a static table name if there is one).  That keeps the
+ * encoder stateless, so streams can encode their headers concurrently.
+ **/
+static size_t hpack_put_field(uint8_t *out, const char *name, const char *value, size_t length) {
+  size_t nstatic = sizeof(StaticTable) / sizeof(StaticTable[0]);
+  size_t index = 0;
+  size_t n = 0;
+
+  for (size_t i = 0; i < nstatic; i++) {
+    if (streq(StaticTable[i][0], name)) {
+      if (strlen(StaticTable[i][1]) == length && strncmp(StaticTable[i][1], value, length) == 0) {
+        return hpack_put_integer(out, i + 1, 7, 0x80);
+      }
+      if (!index) {
+        index = i + 1;
+      }
+    }
+  }
+
+  n = hpack_put_integer(out, index, 4, 0x00);
+  if (!index) {
+    n += hpack_put_string(out + n, name, strlen(name));
+  }
+  return n + hpack_put_string(out + n, value, length);
+}
+
+/* Streams */
+
+/**
+ * Send response body bytes.
+ *
+ * @param   s           Stream structure.
+ * @param   data        Bytes to send.
+ * @param   length      Number of bytes to send.
+ * @return  -1 if the stream or connection went away and 0 on success.
+ *
+ * Bytes are sent in DATA frames no larger than the client's send windows of
+ * the stream and the connection allow, waiting for WINDOW_UPDATE frames when
+ * either window is closed.  Each frame is written separately, so the frames
+ * of concurrent streams interleave.
+ **/
+static int h2_data(H2Stream *s, const char *data, size_t length) {
+  H2Connection *c = s->conn;
+  size_t sent = 0;
+
+  while (sent < length) {
+    size_t n = length - sent;
+
+    pthread_mutex_lock(&c->lock);
+    while (!s->reset && !c->closing && (c->window <= 0 || s->window <= 0)) {
+      pthread_cond_wait(&c->changed, &c->lock);
+    }
+    if (s->reset || c->closing) {
+      pthread_mutex_unlock(&c->lock);
+      return -1;
+    }
+    if (n > c->max_frame) {
+      n = c->max_frame;
+    }
+    if (n > (size_t)c->window) {
+      n = c->window;
+    }
+    if (n > (size_t)s->window) {
+      n = s->window;
+    }
+    c->window -= n;
+    s->window -= n;
+    pthread_mutex_unlock(&c->lock);
+
+    if (h2_frame(c, H2_DATA, 0, s->id, data + sent, n) < 0) {
+      return -1;
+    }
+    sent += n;
+  }
+  return 0;
+}
+
+/**
+ * Send response headers from HTTP/1 response head.
+ *
+ * @param   s           Stream structure.
+ * @param   head        Response head (status line and headers).
+ * @param   length      Length of response head (up to its blank line).
+ * @return  -1 on error and 0 on success.
+ *
+ * Handlers (and CGI scripts and upstream servers) write HTTP/1 responses, so
+ * the head is converted here: the status comes from the status line (or a
+ * CGI Status header, or is 200), header names are lowered, and headers that
+ * only mean something to an HTTP/1 connection are dropped.  Responses that
+ * never have a body end the stream with their HEADERS frame.
+ *
+ * Short header lines can grow when encoded, so a head whose header block
+ * would not fit is refused before anything is sent (and h2_finish then
+ * answers 502 Bad Gateway).
+ **/
+static int h2_reply(H2Stream *s, char *head, size_t length) {
+  static const char *HopHeaders[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "status",
+  };
+  H2Connection *c = s->conn;
+  uint8_t block[H2_HEAD_LIMIT + 64];
+  char status[4] = "200";
+  size_t n = 0;
+  int result = 0;
+
+  /* Status line or CGI Status header */
+  for (char *line = head; line < head + length; line = memchr(line, '\n', head + length - line) + 1) {
+    if (line == head && strncmp(line, "HTTP/", 5) == 0) {
+      char *code = memchr(line, ' ', length);
+      if (code && code + 4 <= head + length) {
+        memcpy(status, code + 1, 3);
+      }
+    } else if (strncasecmp(line, "Status:", 7) == 0) {
+      memcpy(status, line + 7 + strspn(line + 7, " \t"), 3);
+    }
+  }
+  n += hpack_put_field(block + n, ":status", status, 3);
+
+  /* Headers */
+  for (char *line = head; line < head + length; line = memchr(line, '\n', head + length - line) + 1) {
+    char *eol   = memchr(line, '\n', head + length - line);
+    char *colon = memchr(line, ':', eol - line);
+    char name[64];
+    bool hop = false;
+
+    if (!colon || (size_t)(colon - line) >= sizeof(name)) {
+      continue;
+    }
+    for (size_t i = 0; i < (size_t)(colon - line); i++) {
+      name[i] = tolower((unsigned char)line[i]);
+    }
+    name[colon - line] = '\0';
+    for (size_t i = 0; i < sizeof(HopHeaders) / sizeof(HopHeaders[0]); i++) {
+      hop |= streq(name, HopHeaders[i]);
+    }
+    if (hop) {
+      continue;
+    }
+
+    char *value = colon + 1 + strspn(colon + 1, " \t");
+    char *vend  = eol;
+    while (vend > value && (vend[-1] == '\r' || vend[-1] == ' ')) {
+      vend--;
+    }
+    if (n + H2_FIELD_OVERHEAD + (colon - line) + (vend - value) > sizeof(block)) {
+      log("Response headers too large.");
+      return -1;
+    }
+    n += hpack_put_field(block + n, name, value, vend - value);
+  }
+
+  /* No body follows for HEAD or 1xx, 204, and 304 responses */
+  bool bodyless = streq(s->request.method, "HEAD") || status[0] == '1' ||
+                  strncmp(status, "204", 3) == 0 || strncmp(status, "304", 3) == 0;
+
+  /* Send HEADERS, and CONTINUATION frames if the block is larger than a frame */
+  if (bodyless) {
+    h2_release(s);
+  }
+  pthread_mutex_lock(&c->wlock);
+  for (size_t sent = 0; sent < n && result == 0; ) {
+    size_t chunk = n - sent < c->max_frame ? n - sent : c->max_frame;
+    uint8_t flags = sent + chunk == n ? H2_FLAG_END_HEADERS : 0;
+    if (sent == 0 && bodyless) {
+      flags |= H2_FLAG_END_STREAM;
+    }
+    result = h2_frame_locked(c, sent ? H2_CONTINUATION : H2_HEADERS, flags, s->id, block + sent, chunk);
+    sent += chunk;
+  }
+  pthread_mutex_unlock(&c->wlock);
+
+  s->replied = true;
+  s->ended   = bodyless;
+  return result;
+}
+
+/**
+ * Pass response bytes written by handler to stream.
+ *
+ * @param   s           Stream structure.
+ * @param   data        Bytes written.
+ * @param   length      Number of bytes.
+ * @return  -1 on error and 0 on success.
+ *
+ * Bytes are collected until the end of the response head (a blank line,
+ * which CGI scripts may end with a bare newline) and the rest is body.
+ **/
+static int h2_feed(H2Stream *s, const char *data, size_t length) {
+  if (!s->replied) {
+    size_t before = s->nhead;
+    size_t n = length < H2_HEAD_LIMIT - s->nhead ? length : H2_HEAD_LIMIT - s->nhead;
+    char *end = NULL;
+
+    if (!s->head && (s->head = malloc(H2_HEAD_LIMIT)) == NULL) {
+      return -1;
+    }
+    memcpy(s->head + s->nhead, data, n);
+    s->nhead += n;
+
+    for (char *p = s->head + (before > 2 ? before - 2 : 0); p < s->head + s->nhead; p++) {
+      if (*p != '\n') {
+        continue;
+      }
+      if (p + 1 < s->head + s->nhead && p[1] == '\n') {
+        end = p + 2;
+        break;
+      }
+      if (p + 2 < s->head + s->nhead && p[1] == '\r' && p[2] == '\n') {
+        end = p + 3;
+        break;
+      }
+    }
+    if (!end) {
+      if (s->nhead == H2_HEAD_LIMIT) {
+        log("Response headers too large.");
+        return -1;
+      }
+      return 0;
+    }
+
+    /* Bytes past the blank line are body */
+    size_t used = end - s->head - before;
+    if (h2_reply(s, s->head, end - s->head) < 0) {
+      return -1;
+    }
+    data   += used;
+    length -= used;
+  }
+
+  if (s->ended || length == 0) {
+    return 0;
+  }
+  return h2_data(s, data, length);
+}
+
+/**
+ * Finish response of stream.
+ *
+ * @param   s           Stream structure.
+ *
+ * A handler that never wrote a whole response head (such as a failed CGI
+ * script) is answered with 502 Bad Gateway.  If the client was still sending
+ * the request body, the stream is then reset, since the body is not wanted.
+ **/
+static void h2_finish(H2Stream *s) {
+  static const char BadGateway[] = "HTTP/1.1 502 Bad Gateway\r\n\r\n";
+  H2Connection *c = s->conn;
+
+  if (s->reset) {
+    return;
+  }
+  if (!s->replied && h2_reply(s, (char *)BadGateway, sizeof(BadGateway) - 1) < 0) {
+    return;
+  }
+  if (!s->ended) {
+    h2_release(s);
+    h2_frame(c, H2_DATA, H2_FLAG_END_STREAM, s->id, NULL, 0);
+    s->ended = true;
+  }
+  if (!s->complete) {
+    h2_reset(c, s->id, H2_NO_ERROR);
+  }
+}
+
+/**
+ * Handle request of stream (on its own thread).
+ *
+ * @param   arg         Stream structure.
+ * @return  NULL.
+ *
+ * The stream is handled like any other request (see handle_request), and the
+ * rest of a file response is then sent through the output scheduler, so
+ * bandwidth caps apply to streams too.  The stream's admission is released
+ * once it is closed.
+ **/
+static void *h2_stream_main(void *arg) {
+  H2Stream *s = arg;
+  Request *r = &s->request;
+
+  handle_request(r);
+  output_drain(r);
+  h2_finish(s);
+#ifdef TRACE
+  trace(r, TRACE_CLOSE);
+  trace_emit(r);
+#endif
+  h2_close(s);
+  admission_stream_leave();
+  return NULL;
+}
+
+/**
+ * Start handling request of stream.
+ *
+ * @param   c           Connection structure.
+ * @param   s           Stream structure.
+ *
+ * Every stream runs on a thread of its own, so a slow CGI script or upstream
+ * server never holds up the other streams of the connection.  Those threads
+ * are outside the worker pool, so each is admitted like a connection (see
+ * admission_stream_enter), and a stream over the limits is refused with
+ * REFUSED_STREAM, which tells the client it may retry the request.  Signals
+ * are blocked in stream threads so that they reach the server loop.  If no
+ * thread can be created, the stream is handled right away instead.
+ **/
+static void h2_start(H2Connection *c, H2Stream *s) {
+  sigset_t all, previous;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int status;
+
+  /* Body length is what arrived, so a proxy route never reads past it */
+  Request *r = &s->request;
+  for (Header **h = &r->headers; *h; ) {
+    Header *header = *h;
+    if (strcasecmp(header->name, "content-length") == 0) {
+      *h = header->next;
+      free(header->name);
+      free(header->value);
+      free(header);
+    } else {
+      h = &header->next;
+    }
+  }
+  if (r->bend > 0) {
+    char length[32];
+    snprintf(length, sizeof(length), "%zu", r->bend);
+    h2_field(r, "content-length", length);
+  }
+
+  if (!admission_stream_enter()) {
+    debug("Refusing HTTP/2 stream %u over admission limits", s->id);
+    h2_reset(c, s->id, H2_REFUSED_STREAM);
+    h2_close(s);
+    return;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  s->running = true;
+  pthread_mutex_unlock(&c->lock);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+  status = pthread_create(&thread, &attr, h2_stream_main, s);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  pthread_attr_destroy(&attr);
+
+  if (status != 0) {
+    log("Unable to create stream thread: %s", strerror(status));
+    h2_stream_main(s);
+  }
+}
+
+/**
+ * Reject request of stream with 400 Bad Request.
+ *
+ * @param   c           Connection structure.
+ * @param   s           Stream structure.
+ *
+ * A request without a method is answered by handle_request as a request that
+ * could not be parsed.
+ **/
+static void h2_reject(H2Connection *c, H2Stream *s) {
+  free(s->request.method);
+  s->request.method = NULL;
+  h2_start(c, s);
+}
+
+/* Frames */
+
+/**
+ * Apply SETTINGS payload of client.
+ *
+ * @param   c           Connection structure.
+ * @param   p           Settings.
+ * @param   length      Length of settings.
+ * @return  true on success, false on a connection error (GOAWAY sent).
+ **/
+static bool h2_settings(H2Connection *c, const uint8_t *p, size_t length) {
+  if (length % 6) {
+    return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+  }
+
+  for (size_t i = 0; i < length; i += 6) {
+    uint16_t id = p[i] << 8 | p[i + 1];
+    uint32_t value = h2_get32(p + i + 2);
+
+    switch (id) {
+      case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+        if (value > H2_WINDOW_MAX) {
+          return h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+        }
+        pthread_mutex_lock(&c->lock);
+        for (H2Stream *s = c->streams; s; s = s->next) {
+          s->window += (int32_t)value - c->initial;
+        }
+        c->initial = value;
+        pthread_cond_broadcast(&c->changed);
+        pthread_mutex_unlock(&c->lock);
+        break;
+      case H2_SETTINGS_MAX_FRAME_SIZE:
+        if (value < H2_FRAME_SIZE || value > 0xffffff) {
+          return h2_goaway(c, H2_PROTOCOL_ERROR);
+        }
+        break;
+      case H2_SETTINGS_ENABLE_PUSH:
+        if (value > 1) {
+          return h2_goaway(c, H2_PROTOCOL_ERROR);
+        }
+        break;
+      default:
+        /* Responses do not use the dynamic table (see hpack_put_field) */
+        break;
+    }
+  }
+  return true;
+}
+
+/**
+ * Handle complete header block.
+ *
+ * @param   c           Connection structure.
+ * @return  true on success, false on a connection error.
+ *
+ * A block on a new stream opens it; the request is started once the client
+ * ends the stream (at once for requests without a body).  Streams beyond
+ * H2_MAX_STREAMS, or after GOAWAY, are refused.  Until the client acknowledges
+ * our SETTINGS, it does not know that limit and may open more streams at
+ * once, so up to H2_MAX_BURST are taken then.  A block on a stream whose
+ * body is arriving is a trailer and is ignored.
+ **/
+static bool h2_headers(H2Connection *c) {
+  uint32_t id = c->bstream;
+  bool end = c->bflags & H2_FLAG_END_STREAM;
+  bool malformed = false;
+  H2Stream *s;
+
+  c->bstream = 0;
+
+  pthread_mutex_lock(&c->lock);
+  s = h2_find(c, id);
+  bool running = s && s->running;
+  bool refused = c->goaway || c->nopen >= (c->settled ? H2_MAX_STREAMS : H2_MAX_BURST);
+  pthread_mutex_unlock(&c->lock);
+
+  /* Trailers of a request body */
+  if (s) {
+    if (hpack_decode(c, NULL, &malformed) < 0) {
+      return h2_goaway(c, H2_COMPRESSION_ERROR);
+    }
+    if (running || !end) {
+      h2_reset(c, id, H2_PROTOCOL_ERROR);
+      return true;
+    }
+    s->complete = true;
+    h2_start(c, s);
+    return true;
+  }
+
+  if (id <= c->last) {
+    return h2_goaway(c, H2_PROTOCOL_ERROR);
+  }
+  c->last = id;
+
+  if (refused || (s = h2_open(c, id)) == NULL) {
+    if (hpack_decode(c, NULL, &malformed) < 0) {
+      return h2_goaway(c, H2_COMPRESSION_ERROR);
+    }
+    h2_reset(c, id, H2_REFUSED_STREAM);
+    return true;
+  }
+
+  if (hpack_decode(c, &s->request, &malformed) < 0) {
+    h2_close(s);
+    return h2_goaway(c, H2_COMPRESSION_ERROR);
+  }
+  trace(&s->request, TRACE_REQUEST_LINE);
+  trace(&s->request, TRACE_HEADERS);
+
+  /* Stop taking streams once the connection has served its share */
+  if (KeepAliveRequests && ++c->nrequests >= KeepAliveRequests) {
+    h2_goaway(c, H2_NO_ERROR);
+  }
+
+  s->complete = end;
+  if (malformed || !s->request.method || !s->request.uri) {
+    log("Malformed HTTP/2 request.");
+    h2_reject(c, s);
+  } else if (end) {
+    h2_start(c, s);
+  }
+  return true;
+}
+
+/**
+ * Handle DATA frame.
+ *
+ * @param   c           Connection structure.
+ * @param   id          Stream identifier.
+ * @param   flags       Flags of frame.
+ * @param   data        Body bytes (without padding).
+ * @param   length      Number of body bytes.
+ * @param   size        Size of frame (counted against the receive windows).
+ * @return  true on success, false on a connection error.
+ *
+ * Request bodies are collected (up to H2_BODY_LIMIT, which is also the
+ * stream's receive window) and the request is started once the stream ends.
+ * The connection's receive window is returned as frames arrive.
+ **/
+static bool h2_body(H2Connection *c, uint32_t id, uint8_t flags, const uint8_t *data, size_t length,
+                    size_t size) {
+  H2Stream *s;
+
+  if ((c->consumed += size) >= H2_WINDOW / 2) {
+    uint8_t payload[4];
+    h2_put32(payload, c->consumed);
+    h2_frame(c, H2_WINDOW_UPDATE, 0, 0, payload, sizeof(payload));
+    c->consumed = 0;
+  }
+
+  if (id == 0 || id > c->last) {
+    return h2_goaway(c, H2_PROTOCOL_ERROR);
+  }
+
+  pthread_mutex_lock(&c->lock);
+  s = h2_find(c, id);
+  bool running = s && s->running;
+  pthread_mutex_unlock(&c->lock);
+  if (!s || running) {
+    h2_reset(c, id, H2_STREAM_CLOSED);
+    return true;
+  }
+
+  Request *r = &s->request;
+  if (!r->buffer && (r->buffer = malloc(H2_BODY_LIMIT)) == NULL) {
+    h2_reset(c, id, H2_INTERNAL_ERROR);
+    h2_close(s);
+    return true;
+  }
+  if (length > H2_BODY_LIMIT - r->bend) {
+    h2_reset(c, id, H2_FLOW_CONTROL_ERROR);
+    h2_close(s);
+    return true;
+  }
+  memcpy(r->buffer + r->bend, data, length);
+  r->bend += length;
+
+  if (flags & H2_FLAG_END_STREAM) {
+    s->complete = true;
+    h2_start(c, s);
+  } else if (r->bend == H2_BODY_LIMIT) {
+    log("HTTP/2 request body too large.");
+    h2_reject(c, s);
+  }
+  return true;
+}
+
+/**
+ * Read and handle next frame.
+ *
+ * @param   c           Connection structure.
+ * @return  true if the connection continues, false if it is done.
+ **/
+static bool h2_process(H2Connection *c) {
+  uint8_t header[H2_FRAME_HEADER];
+  uint8_t *p = c->frame;
+  int status;
+
+  /* Wait for frame (an idle timeout only ends a connection without streams) */
+  if ((status = h2_read(c, header, sizeof(header))) <= 0) {
+    pthread_mutex_lock(&c->lock);
+    bool idle = c->nstreams == 0;
+    pthread_mutex_unlock(&c->lock);
+    if (status == 0 && idle) {
+      h2_goaway(c, H2_NO_ERROR);
+    }
+    return status == 0 && !idle;
+  }
+
+  size_t length = header[0] << 16 | header[1] << 8 | header[2];
+  uint8_t type  = header[3];
+  uint8_t flags = header[4];
+  uint32_t id   = h2_get32(header + 5) & 0x7fffffff;
+
+  if (length > H2_FRAME_SIZE) {
+    return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+  }
+  if (h2_read(c, c->frame, length) <= 0) {
+    return false;
+  }
+
+  /* Nothing may come between the frames of a header block */
+  if (c->bstream && (type != H2_CONTINUATION || id != c->bstream)) {
+    return h2_goaway(c, H2_PROTOCOL_ERROR);
+  }
+
+  /* Strip padding (and priority) from DATA and HEADERS */
+  size_t size = length;
+  if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_FLAG_PADDED)) {
+    if (length < 1 || p[0] >= length) {
+      return h2_goaway(c, H2_PROTOCOL_ERROR);
+    }
+    length -= 1 + p[0];
+    p++;
+  }
+  if (type == H2_HEADERS && (flags & H2_FLAG_PRIORITY)) {
+    if (length < 5) {
+      return h2_goaway(c, H2_PROTOCOL_ERROR);
+    }
+    length -= 5;
+    p += 5;
+  }
+
+  switch (type) {
+    case H2_DATA:
+      return h2_body(c, id, flags, p, length, size);
+
+    case H2_HEADERS:
+      if (id == 0 || id % 2 == 0) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+      }
+      c->bstream = id;
+      c->bflags  = flags;
+      c->nblock  = 0;
+      /* Fall through */
+    case H2_CONTINUATION:
+      if (!c->bstream || c->nblock + length > H2_HEADER_BLOCK) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+      }
+      memcpy(c->block + c->nblock, p, length);
+      c->nblock += length;
+      return (flags & H2_FLAG_END_HEADERS) ? h2_headers(c) : true;
+
+    case H2_RST_STREAM:
+      if (length != 4 || id == 0) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+      }
+      pthread_mutex_lock(&c->lock);
+      H2Stream *s = h2_find(c, id);
+      bool waiting = s && !s->running;
+      if (s) {
+        s->reset = true;
+        pthread_cond_broadcast(&c->changed);
+      }
+      pthread_mutex_unlock(&c->lock);
+      if (waiting) {
+        h2_close(s);
+      }
+      return true;
+
+    case H2_SETTINGS:
+      if (id != 0) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+      }
+      if (flags & H2_FLAG_ACK) {
+        c->settled = true;
+        return true;
+      }
+      if (!h2_settings(c, p, length)) {
+        return false;
+      }
+      h2_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+      return true;
+
+    case H2_PING:
+      if (length != 8) {
+        return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+      }
+      if (!(flags & H2_FLAG_ACK)) {
+        h2_frame(c, H2_PING, H2_FLAG_ACK, 0, p, length);
+      }
+      return true;
+
+    case H2_GOAWAY:
+      c->goaway = true;
+      return true;
+
+    case H2_WINDOW_UPDATE:
+      if (length != 4) {
+        return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+      }
+      uint32_t increment = h2_get32(p) & 0x7fffffff;
+      bool overflow = false;
+      pthread_mutex_lock(&c->lock);
+      if (id == 0) {
+        overflow = increment == 0 || (int64_t)c->window + increment > H2_WINDOW_MAX;
+        if (!overflow) {
+          c->window += increment;
+        }
+      } else if ((s = h2_find(c, id)) != NULL) {
+        if (increment == 0 || (int64_t)s->window + increment > H2_WINDOW_MAX) {
+          s->reset = true;
+          h2_reset(c, id, H2_FLOW_CONTROL_ERROR);
+        } else {
+          s->window += increment;
+        }
+      }
+      pthread_cond_broadcast(&c->changed);
+      pthread_mutex_unlock(&c->lock);
+      return overflow ? h2_goaway(c, H2_FLOW_CONTROL_ERROR) : true;
+
+    case H2_PUSH_PROMISE:
+      return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+    default:
+      /* PRIORITY and unknown frames are ignored */
+      return true;
+  }
+}
+
+/**
+ * Decode HTTP2-Settings header of an h2c upgrade.
+ *
+ * @param   c           Connection structure.
+ * @param   value       Base64url encoded SETTINGS payload.
+ * @return  true on success, false if the settings are invalid.
+ **/
+static bool h2_upgrade_settings(H2Connection *c, const char *value) {
+  static const char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  uint8_t payload[256];
+  uint32_t bits = 0;
+  size_t n = 0;
+  int nbits = 0;
+
+  for (const char *p = value; *p && *p != '='; p++) {
+    const char *digit = strchr(Alphabet, *p);
+    if (!digit || n == sizeof(payload)) {
+      return false;
+    }
+    bits = bits << 6 | (digit - Alphabet);
+    if ((nbits += 6) >= 8) {
+      payload[n++] = bits >> (nbits -= 8);
+    }
+  }
+  return h2_settings(c, payload, n);
+}
+
+/* External Functions */
+
+/**
+ * Serve HTTP/2 connection.
+ *
+ * @param   r           HTTP Request structure of connection.
+ * @return  HTTP_STATUS_OK (the connection is closed afterwards).
+ *
+ * This is reached from handle_request for a connection that opened with the
+ * HTTP/2 preface (prior knowledge) or asked to upgrade with Upgrade: h2c, in
+ * which case the upgrading request becomes stream 1.  The calling thread reads
+ * and handles frames until the client goes away, while each request runs on
+ * a stream thread of its own and writes its response through the framing
+ * functions (see h2_writev and h2_sendfile).
+ *
+ * Only the client's dynamic HPACK table is kept (requests repeat most of their
+ * headers); responses are encoded statelessly (see hpack_put_field).  Frames
+ * are often small and each waits on the client's WINDOW_UPDATE, so the socket
+ * sends without Nagle's delay.
+ **/
+HTTPStatus h2_serve(Request *r) {
+  static const char Switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+  uint8_t settings[] = {
+    0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS,
+    0, H2_SETTINGS_INITIAL_WINDOW_SIZE, 0, 0, H2_BODY_LIMIT >> 8, H2_BODY_LIMIT & 0xff,
+  };
+  char preface[H2_PREFACE_LENGTH];
+  bool upgrade = !streq(r->method, "PRI");
+  H2Connection *c;
+
+  r->keepalive = false;
+  if (r->addr.ss_family != AF_UNIX) {
+    int on = 1;
+    setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  if ((c = calloc(1, sizeof(H2Connection))) == NULL ||
+      (c->block = malloc(H2_HEADER_BLOCK)) == NULL) {
+    log("Unable to allocate HTTP/2 connection.");
+    free(c);
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  }
+  c->r         = r;
+  c->window    = H2_WINDOW;
+  c->initial   = H2_WINDOW;
+  c->max_frame = H2_FRAME_SIZE;
+  c->table.limit = H2_TABLE_SIZE;
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_mutex_init(&c->wlock, NULL);
+  pthread_cond_init(&c->changed, NULL);
+
+  /* Switch protocols (the client's settings came in a header) */
+  if (upgrade) {
+    if (!h2_upgrade_settings(c, request_header(r, "HTTP2-Settings")) ||
+        response_write(r, Switching, sizeof(Switching) - 1) < 0) {
+      goto done;
+    }
+  }
+
+  /* Exchange prefaces: ours is a SETTINGS frame */
+  if (h2_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings)) < 0) {
+    goto done;
+  }
+  size_t skip = upgrade ? 0 : H2_PREFACE_LINE;
+  if (h2_read(c, preface + skip, H2_PREFACE_LENGTH - skip) <= 0 ||
+      memcmp(preface + skip, H2_PREFACE + skip, H2_PREFACE_LENGTH - skip) != 0) {
+    log("Invalid HTTP/2 connection preface.");
+    goto done;
+  }
+
+  /* Upgrading request is stream 1, with nothing more to come from the client */
+  if (upgrade) {
+    H2Stream *s = h2_open(c, 1);
+    if (!s) {
+      goto done;
+    }
+    s->request.method  = r->method;
+    s->request.uri     = r->uri;
+    s->request.query   = r->query;
+    s->request.headers = r->headers;
+    r->method  = r->uri = r->query = NULL;
+    r->headers = NULL;
+    s->complete = true;
+    c->last = 1;
+    c->nrequests++;
+    h2_start(c, s);
+  }
+
+  /* Handle frames until the client is done (or breaks the protocol) */
+  while (h2_process(c)) {
+    pthread_mutex_lock(&c->lock);
+    bool done = c->goaway && c->nstreams == 0;
+    pthread_mutex_unlock(&c->lock);
+    if (done) {
+      break;
+    }
+  }
+
+done:
+  /* Wait for running streams, after stopping any still waiting on windows */
+  pthread_mutex_lock(&c->lock);
+  c->closing = true;
+  pthread_cond_broadcast(&c->changed);
+  for (H2Stream *s = c->streams, *next; s; s = next) {
+    next = s->next;
+    if (!s->running) {
+      pthread_mutex_unlock(&c->lock);
+      h2_close(s);
+      pthread_mutex_lock(&c->lock);
+    }
+  }
+  while (c->nstreams > 0) {
+    pthread_cond_wait(&c->changed, &c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  if (!c->goaway) {
+    h2_goaway(c, H2_NO_ERROR);
+  }
+
+  hpack_evict(&c->table, 0);
+  pthread_cond_destroy(&c->changed);
+  pthread_mutex_destroy(&c->wlock);
+  pthread_mutex_destroy(&c->lock);
+  free(c->block);
+  free(c);
+  return HTTP_STATUS_OK;
+}
+
+/**
+ * Write response bytes of HTTP/2 stream.
+ *
+ * @param   r           HTTP Request structure of stream.
+ * @param   iov         Array of io vectors.
+ * @param   iovcnt      Number of io vectors.
+ * @return  Number of bytes written (all of them) or -1 on error.
+ *
+ * This stands in for writev in write_all, so handlers write their HTTP/1
+ * responses unchanged (see h2_feed).
+ **/
+ssize_t h2_writev(Request *r, const struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+
+  for (int i = 0; i < iovcnt; i++) {
+    if (h2_feed(r->stream, iov[i].iov_base, iov[i].iov_len) < 0) {
+      errno = EPIPE;
+      return -1;
+    }
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+/**
+ * Send file bytes of HTTP/2 stream.
+ *
+ * @param   r           HTTP Request structure of stream.
+ * @param   fd          File to send from.
+ * @param   offset      Offset in file (advanced).
+ * @param   length      Largest number of bytes to send.
+ * @return  Number of bytes sent or -1 on error.
+ *
+ * This stands in for sendfile in output_continue.  DATA frames need their
+ * header in front of the bytes, so a frame's worth of the file is read and
+ * sent at a time.
+ **/
+ssize_t h2_sendfile(Request *r, int fd, off_t *offset, size_t length) {
+  char buffer[H2_FRAME_SIZE];
+  ssize_t nread;
+
+  if ((nread = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), *offset)) <= 0) {
+    return nread;
+  }
+  if (h2_feed(r->stream, buffer, nread) < 0) {
+    errno = EPIPE;
+    return -1;
+  }
+  *offset += nread;
+  return nread;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -7,13 +7,16 @@
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <libgen.h> // used for basename in browse_request
 
 /* Internal Declarations */
 HTTPStatus handle_browse_request(Request *request);
-HTTPStatus handle_file_request(Request *request);
+HTTPStatus handle_file_request(Request *request, const struct stat *st);
 HTTPStatus handle_cgi_request(Request *request);
 HTTPStatus handle_error(Request *request, HTTPStatus status);
 
@@ -24,30 +27,79 @@ HTTPStatus handle_error(Request *request, HTTPStatus status);
  * @return  Status of the HTTP request.
  *
  * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * type, and then dispatches to the appropriate handler type.  Requests under
+ * a proxied prefix (see proxy_lookup) go upstream without touching the
+ * filesystem.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
 HTTPStatus  handle_request(Request *r) {
   HTTPStatus result;
+  char uri[BUFSIZ];
   
-  /* Parse request */
-  if(parse_request(r) < 0){
+  /* Count request as active before using configuration tables */
+  __atomic_add_fetch(&ActiveRequests, 1, __ATOMIC_SEQ_CST);
+  VirtualHostTable *vhosts = __atomic_load_n(&VirtualHosts, __ATOMIC_SEQ_CST);
+  
+  /* Parse request (HTTP/2 streams arrive parsed, without a method if malformed) */
+  r->vhost = vhosts->fallback;
+  if(r->stream ? !r->method : parse_request(r) < 0){
     log("Could not parse request.");
-    return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    r->keepalive = false;
+    result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    goto done;
+  }
+  
+  /* Serve connection as HTTP/2 from here on (each stream comes back here) */
+  if(r->h2c){
+    __atomic_sub_fetch(&ActiveRequests, 1, __ATOMIC_SEQ_CST);
+    return h2_serve(r);
+  }
+  
+  /* Determine virtual host from Host header */
+  r->vhost = vhost_lookup(vhosts, request_header(r, "Host"));
+  debug("HTTP REQUEST HOST: %s", r->vhost->name);
+  
+  /* Decode and normalize URI before touching the filesystem */
+  if(normalize_uri(r->uri, uri, sizeof(uri)) < 0){
+    log("Invalid request URI: %s", r->uri);
+    result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    goto done;
+  }
+  
+  /* Forward requests under a proxied prefix to an upstream server */
+  ProxyRoute *route = proxy_lookup(uri);
+  if(route){
+    trace(r, TRACE_HANDLER);
+    if((result = handle_proxy_request(r, route, uri)) != HTTP_STATUS_OK){
+      result = handle_error(r, result);
+    }
+    goto done;
+  }
+  
+  /* Answer recently missing paths without touching the filesystem */
+  if(negative_lookup(r->vhost->root, uri)){
+    debug("Known missing path: %s", uri);
+    result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+    goto done;
   }
   
   /* Determine request path */
-  r->path = determine_request_path(r->uri);
+  r->path = determine_request_path(r->vhost->root, uri);
   if(r->path == NULL){
     log("Could not determine request path.");
-    return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    negative_insert(r->vhost->root, uri);
+    result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+    goto done;
   }
   debug("HTTP REQUEST PATH: %s", r->path);
+  trace(r, TRACE_PATH);
   
   /* Dispatch to appropriate request handler type based on file type */
   struct stat fileStat;
   lstat(r->path, &fileStat);
+  result = HTTP_STATUS_BAD_REQUEST;
+  trace(r, TRACE_HANDLER);
   if (S_ISDIR(fileStat.st_mode)){
     result = handle_browse_request(r);
   }
@@ -56,33 +108,65 @@ HTTPStatus  handle_request(Request *r) {
       result = handle_cgi_request(r);
     }
     else if (access(r->path, R_OK) == 0){
-      result = handle_file_request(r); }
-  }
-  else {
-    result = HTTP_STATUS_BAD_REQUEST;
+      result = handle_file_request(r, &fileStat); }
   }
   
   if(result != HTTP_STATUS_OK){
     result = handle_error(r, result);
+  }else{
+    warmup_record(r->vhost, uri);
   }
   
+done:
+  vhost_record(r->vhost, result);
+  __atomic_sub_fetch(&ActiveRequests, 1, __ATOMIC_SEQ_CST);
   log("HTTP REQUEST STATUS: %s", http_status_string(result));
   return result;
 }
 
+/**
+ * Handle HTTP requests on a connection until it is closed.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the last HTTP request.
+ *
+ * Requests are handled one after another for as long as the client keeps the
+ * connection alive (see parse_request), so a page with many small files does
+ * not pay for a new connection per file.  The loop ends when the client closes
+ * the connection or sends nothing for KeepAliveTimeout seconds.
+ **/
+HTTPStatus  handle_connection(Request *r) {
+  HTTPStatus result = HTTP_STATUS_OK;
+  
+  while(request_wait(r)){
+    result = handle_request(r);
+    output_drain(r);
+    if(!r->keepalive){
+      break;
+    }
+    reset_request(r);
+  }
+  return result;
+}
+
 /**
  * Handle browse request.
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP browse request.
  *
- * This lists the contents of a directory in HTML.
+ * This lists the contents of a directory in HTML.  The listing is rendered
+ * into memory first so that it is sent along with the headers in one write.
  *
  * If the path cannot be opened or scanned as a directory, then handle error
  * with HTTP_STATUS_NOT_FOUND.
  **/
 HTTPStatus  handle_browse_request(Request *r) {
   struct dirent **entries;
+  Response res;
+  char *body = NULL;
+  size_t length = 0;
+  FILE *fs;
   int n;
   
   /* Open a directory for reading or scanning */
@@ -93,29 +177,41 @@ HTTPStatus  handle_browse_request(Request *r) {
     return HTTP_STATUS_NOT_FOUND;
   }
   
-  /* Write HTTP Header with OK Status and text/html Content-Type */
-  fprintf(r->file, "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n");
-  
   /* For each entry in directory, emit HTML list item */
-  fprintf(r->file, "<ul>");
+  if((fs = open_memstream(&body, &length)) == NULL){
+    log("Unable to open memory stream.");
+    for(int i = 0; i < n; i++){
+      free(entries[i]);
+    }
+    free(entries);
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  }
+  fprintf(fs, "<ul>");
   for(int i = 0; i < n; i++){
     if(strcmp(entries[i]->d_name,".") == 0){
       free(entries[i]);
       continue;
     }
     if(strcmp(r->uri,"/")==0){
-      fprintf(r->file,"<li><a href=\"/%s\">%s</a></li>\r\n", entries[i]->d_name, entries[i]->d_name);
+      fprintf(fs,"<li><a href=\"/%s\">%s</a></li>\r\n", entries[i]->d_name, entries[i]->d_name);
     }
     else{
-      fprintf(r->file, "<li<a href=\"/%s/%s\">%s</a></li>\r\n",basename(r->path),entries[i]->d_name,entries[i]->d_name);
+      fprintf(fs, "<li><a href=\"/%s/%s\">%s</a></li>\r\n",basename(r->path),entries[i]->d_name,entries[i]->d_name);
     }
     free(entries[i]);
   }
-  fprintf(r->file, "<ul>");
-  
-  /* Flush socket, return OK */
-  fflush(r->file);
+  fprintf(fs, "<ul>");
+  fclose(fs);
   free(entries);
+  
+  /* Write HTTP Header with OK Status and text/html Content-Type plus listing */
+  response_start(&res, HTTP_STATUS_OK, "text/html");
+  if(response_send(r, &res, length, body, length) < 0){
+    log("Cannot write to socket.");
+  }
+  
+  /* Free listing, return OK */
+  free(body);
   return HTTP_STATUS_OK; 
 }
 
@@ -123,155 +219,321 @@ HTTPStatus  handle_browse_request(Request *r) {
  * Handle file request.
  *
  * @param   r           HTTP Request structure.
+ * @param   st          Status of file.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * Files of up to CACHE_BODY_LIMIT bytes are served from the cache, so a hit
+ * does not open the file at all.  Otherwise, this opens and streams the
+ * contents of the specified file to the socket.  The first block of the file
+ * is sent with the headers in one write (which is the whole file for small
+ * files) and the rest is left to the output scheduler (see output_continue).
  *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
-HTTPStatus  handle_file_request(Request *r) {
-  FILE *fs;
+HTTPStatus  handle_file_request(Request *r, const struct stat *st) {
   char buffer[BUFSIZ];
   char *mimetype = NULL;
-  size_t nread;
+  CacheEntry *e;
+  Response res;
+  ssize_t nread;
+  int fd;
+  
+  /* Send small file from cache */
+  if(st->st_size <= CACHE_BODY_LIMIT && (e = cache_file(r->vhost, r->path, st)) != NULL){
+    response_start(&res, HTTP_STATUS_OK, e->type);
+    if(response_send(r, &res, e->length, e->data, e->length) < 0){
+      log("Cannot write to socket.");
+    }
+    cache_release(e);
+    return HTTP_STATUS_OK;
+  }
   
   /* Open file for reading */
-  if((fs = fopen(r->path, "r")) == NULL){
+  if((fd = open(r->path, O_RDONLY | O_CLOEXEC)) < 0){
     log("Could not open file for reading.");
-    goto fail;
+    return HTTP_STATUS_NOT_FOUND;
+  }
+  if((nread = read(fd, buffer, BUFSIZ)) < 0){
+    log("Could not read file: %s", strerror(errno));
+    close(fd);
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
   }
   
   /* Determine mimetype */
-  mimetype = determine_mimetype(r->path);
+  mimetype = determine_mimetype(r->path, r->vhost->mimetype);
   
   /* Write HTTP Headers with OK status and determined Content-Type */
-  if(fprintf(r->file, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", mimetype) < 0){
-    log("Cannot print to socket.");
-    goto fail;
+  response_start(&res, HTTP_STATUS_OK, mimetype);
+  if(response_send(r, &res, st->st_size, buffer, nread) < 0){
+    log("Cannot write to socket.");
+    goto done;
   }
   
-  /* Read from file and write to socket in chunks */
-  while((nread = fread(buffer, 1, BUFSIZ, fs)) > 0){ // 1 element of size BUFSIZ
-    if(fwrite(buffer, 1, nread, r->file) != nread){ // write to file, 1 element of size nread
-      log("Could not write to file");
-      goto fail;
-    }
+  /* Leave remainder of file to the output scheduler */
+  if(st->st_size > nread){
+    output_start(r, fd, nread, st->st_size - nread);
+    fd = -1;
   }
   
-  /* Close file, flush socket, deallocate mimetype, return OK */
-  fclose(fs);
-  fflush(r->file);
+done:
+  /* Close file (unless it is still being sent), deallocate mimetype, return OK */
+  if(fd >= 0){
+    close(fd);
+  }
   free(mimetype);
   return HTTP_STATUS_OK;
-  
-fail:
-  /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-  fclose(fs);
-  free(mimetype);
-  return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
 
 /**
- * Handle CGI request
+ * Add variable to CGI environment.
+ *
+ * @param   env         Environment array (NULL terminated, with room).
+ * @param   n           Number of entries in environment array.
+ * @param   name        Name of variable.
+ * @param   value       Value of variable.
+ **/
+static void cgi_setenv(char **env, size_t *n, const char *name, const char *value) {
+  if(asprintf(&env[*n], "%s=%s", name, value ? value : "") >= 0){
+    env[++(*n)] = NULL;
+  }
+}
+
+/**
+ * Stop filling cache entry with CGI output.
+ *
+ * @param   fill        Entry being filled (may point to NULL).
+ * @param   data        Output to store (or NULL if it is not to be cached).
+ * @param   length      Length of output.
+ *
+ * Requests waiting for the entry are woken either way (see cache_acquire).
+ **/
+static void cgi_complete_fill(CacheEntry **fill, const char *data, size_t length) {
+  if(*fill){
+    cache_complete(*fill, data, length, NULL);
+    *fill = NULL;
+  }
+}
+
+/**
+ * Run CGI script for request
  *
  * @param   r           HTTP Request structure.
- * @return  Status of the HTTP file request.
+ * @param   fill        Cache entry to fill with output (may point to NULL).
+ * @return  Status of the HTTP CGI request.
+ *
+ * This spawns the specified executable and streams its output to the socket.
+ *
+ * If *fill is an entry, the output is held back (up to CACHE_BODY_LIMIT) and
+ * the entry is completed before any of it is sent, so requests waiting for the
+ * entry never wait on this request's client.  If the output turns out to be
+ * too large to cache or the script fails, the entry is completed as failed
+ * instead and the output is sent all the same.  *fill is set to NULL once the
+ * entry is completed.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * The CGI variables are passed in a private environment (the server's own
+ * environment followed by the request's variables) rather than with setenv,
+ * so concurrent requests on different threads cannot see each other's values.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * If MaxCGI scripts are already running, then handle error with
+ * HTTP_STATUS_SERVICE_UNAVAILABLE.  If the path cannot be spawned, then handle
+ * error with HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
-HTTPStatus handle_cgi_request(Request *r) {
-  FILE *pfs;
+static HTTPStatus run_cgi_request(Request *r, CacheEntry **fill) {
+  static const char *HeaderVariables[][2] = {
+    {"Host",            "HTTP_HOST"},
+    {"User-Agent",      "HTTP_USER_AGENT"},
+    {"Accept",          "HTTP_ACCEPT"},
+    {"Accept-Language", "HTTP_ACCEPT_LANGUAGE"},
+    {"Accept-Encoding", "HTTP_ACCEPT_ENCODING"},
+    {"Connection",      "HTTP_CONNECTION"},
+  };
+  size_t nheaders = sizeof(HeaderVariables) / sizeof(HeaderVariables[0]);
+  HTTPStatus status = HTTP_STATUS_OK;
   char buffer[BUFSIZ];
+  char *held = NULL;
+  size_t nheld = 0;
+  ssize_t nread;
+  size_t n = 0;
+  int pipefd[2];
+  int wstatus = -1;
+  pid_t pid;
   
-  if(r->query != NULL){
-    setenv("QUERY_STRING",r->query,1);
-  }
-  else{
-    setenv("QUERY_STRING","",1);
+  /* Limit number of concurrent CGI processes */
+  if(!admission_cgi_enter()){
+    log("Too many CGI processes.");
+    cgi_complete_fill(fill, NULL, 0);
+    return HTTP_STATUS_SERVICE_UNAVAILABLE;
   }
-  setenv("DOCUMENT_ROOT",RootPath,1);
-  setenv("REQUEST_URI",r->uri,1);
-  setenv("REQUEST_METHOD",r->method,1);
-  setenv("REMOTE_ADDR",r->host,1);
-  setenv("REMOTE_PORT",r->port,1);
-  setenv("SCRIPT_FILENAME",r->path,1);
-  setenv("SERVER_PORT",r->port,1);
   
   /* Export CGI environment variables from request structure:
    * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
+  size_t nenviron = 0;
+  while(environ[nenviron]){
+    nenviron++;
+  }
   
+  char **env = calloc(nenviron + nheaders + 16, sizeof(char *));
+  if(!env){
+    admission_cgi_leave();
+    cgi_complete_fill(fill, NULL, 0);
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  }
   
+  cgi_setenv(env, &n, "QUERY_STRING", r->query);
+  cgi_setenv(env, &n, "DOCUMENT_ROOT", r->vhost->root);
+  cgi_setenv(env, &n, "REQUEST_URI", r->uri);
+  cgi_setenv(env, &n, "REQUEST_METHOD", r->method);
+  cgi_setenv(env, &n, "REMOTE_ADDR", request_host(r));
+  cgi_setenv(env, &n, "REMOTE_PORT", request_port(r));
+  cgi_setenv(env, &n, "SCRIPT_FILENAME", r->path);
+  cgi_setenv(env, &n, "SERVER_PORT", Port);
   
   /* Export CGI environment variables from request headers */
-  
-  Header* curr = r->headers;
-  
-  while(curr)
-    {
-      if(streq(curr->name,"Host"))
-	{
-	  setenv("HTTP_HOST",curr->value,1);
-	}
-      else if(streq(curr->name,"User-Agent"))
-	{
-	  setenv("HTTP_USER_AGENT",curr->value,1);
-	  
-	}
-      else if(streq(curr->name,"Accept"))
-	{
-	  setenv("HTTP_ACCEPT",curr->value,1);
-	  
-	}
-      else if(streq(curr->name,"Accept-Language"))
-	{
-	  setenv("HTTP_ACCEPT_LANGUAGE",curr->value,1);
-	}
-      else if(streq(curr->name,"Accept-Encoding"))
-	{
-	  setenv("HTTP_ACCEPT_ENCODING",curr->value,1);
-	}
-      else if(streq(curr->name,"Connection"))
-	{
-	  setenv("HTTP_CONNECTION",curr->value,1);
-	}
-      
-      curr=curr->next;
+  for(size_t i = 0; i < nheaders; i++){
+    const char *value = request_header(r, HeaderVariables[i][0]);
+    if(value){
+      cgi_setenv(env, &n, HeaderVariables[i][1], value);
     }
+  }
   
+  /* Spawn CGI Script with stdout connected to a pipe */
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t defaults;
+  char *argv[] = { r->path, NULL };
   
-
-
-
-
-    /* POpen CGI Script */
-
-    if((pfs=popen(r->path,"r"))==NULL)
-      {
-  log("unable to popen");
-  return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  if(pipe2(pipefd, O_CLOEXEC) < 0){
+    log("Unable to create pipe: %s", strerror(errno));
+    status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    goto done;
+  }
+  
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+  
+  /* Scripts get the default SIGPIPE action the server itself ignores */
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+  
+  for(size_t i = 0; i < nenviron; i++){
+    env[n + i] = environ[i];
+  }
+  errno = posix_spawn(&pid, r->path, &actions, &attr, argv, env);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(pipefd[1]);
+  
+  if(errno != 0){
+    log("Unable to spawn %s: %s", r->path, strerror(errno));
+    close(pipefd[0]);
+    status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    goto done;
+  }
+  
+  /* Copy data from script to socket (holding it back while filling) */
+  if(*fill && (held = malloc(CACHE_BODY_LIMIT)) == NULL){
+    cgi_complete_fill(fill, NULL, 0);
+  }
+  while((nread = read(pipefd[0], buffer, BUFSIZ)) > 0 || (nread < 0 && errno == EINTR)){
+    if(nread < 0){
+      continue;
+    }
+    if(*fill){
+      if(nheld + nread <= CACHE_BODY_LIMIT){
+        memcpy(held + nheld, buffer, nread);
+        nheld += nread;
+        continue;
       }
-
-    /* Copy data from popen to socket */
-
-    while(fgets(buffer,BUFSIZ,pfs) !=NULL)
-      {
-        if(fputs(buffer,r->file) < 0){
-          log("Fail to fputs.");
-          return HTTP_STATUS_INTERNAL_SERVER_ERROR;
-        }
-
+      cgi_complete_fill(fill, NULL, 0);
+      int written = response_write(r, held, nheld);
+      nheld = 0;
+      if(written < 0){
+        log("Fail to write to socket.");
+        break;
       }
+    }
+    if(response_write(r, buffer, nread) < 0){
+      log("Fail to write to socket.");
+      break;
+    }
+  }
+  
+  /* Close pipe, reap script */
+  close(pipefd[0]);
+  while(waitpid(pid, &wstatus, 0) < 0 && errno == EINTR);
+  
+done:
+  /* Complete entry with whole output of a successful script, then send it */
+  if(status == HTTP_STATUS_OK && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0){
+    cgi_complete_fill(fill, held, nheld);
+  }
+  cgi_complete_fill(fill, NULL, 0);
+  if(nheld && response_write(r, held, nheld) < 0){
+    log("Fail to write to socket.");
+  }
+  free(held);
+  for(size_t i = 0; i < n; i++){
+    free(env[i]);
+  }
+  free(env);
+  admission_cgi_leave();
+  return status;
+}
 
-    /* Close popen, flush socket, return OK */
-    pclose(pfs);
-    fflush(r->file);
-
+/**
+ * Handle CGI request
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP CGI request.
+ *
+ * This runs the CGI script and streams its output to the socket (see
+ * run_cgi_request).  The length of that output is not known in advance, so
+ * the end of the response is marked by closing the connection.
+ *
+ * If CGICacheTTL is set, the output of a successful GET is cached for that
+ * many seconds, keyed by the script and QUERY_STRING.  Concurrent identical
+ * requests wait for the one running script and share its output, so a burst
+ * of clients runs a slow script once.  This is opt-in, because the other CGI
+ * variables (client address and headers) are not part of the key.
+ **/
+HTTPStatus handle_cgi_request(Request *r) {
+  HTTPStatus status;
+  CacheEntry *e = NULL;
+  CacheEntry *filling = NULL;
+  char *key;
+  bool fill = false;
+  
+  /* Script output is delimited by closing the connection */
+  r->keepalive = false;
+  
+  /* Look up cached output */
+  if(CGICacheTTL && streq(r->method, "GET") &&
+     asprintf(&key, "%s?%s", r->path, r->query ? r->query : "") >= 0){
+    e = cache_acquire(r->vhost, key, NULL, CGICacheTTL, &fill);
+    free(key);
+  }
+  if(e && !fill){
+    if(response_write(r, e->data, e->length) < 0){
+      log("Fail to write to socket.");
+    }
+    cache_release(e);
     return HTTP_STATUS_OK;
+  }
+  
+  /* Run script (filling the cache entry if this request is its filler) */
+  if(fill){
+    filling = e;
+  }
+  status = run_cgi_request(r, &filling);
+  
+  if(fill){
+    cache_release(e);
+  }
+  return status;
 }
 
 /**
@@ -285,20 +547,24 @@ HTTPStatus handle_cgi_request(Request *r) {
  **/
 HTTPStatus  handle_error(Request *r, HTTPStatus status) {
     const char *status_string = http_status_string(status);
+    char body[BUFSIZ];
+    Response res;
 
-    /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\r\nContent-Type: text/html\r\n\r\n",status_string);
+    /* Render HTML Description of Error */
+    int length = snprintf(body, sizeof(body),
+        "<h1>Mr. Bui, I don't feel so good...</h1>"
+        "<h2>Something went wrong:</h2>"
+        "<p>%s\n</p>", status_string);
+
+    /* Write HTTP Header and HTML in one write */
+    response_start(&res, status, "text/html");
+    if(status == HTTP_STATUS_SERVICE_UNAVAILABLE){
+        response_header(&res, "Retry-After", RETRY_AFTER);
+    }
+    if(response_send(r, &res, length, body, length) < 0){
+        log("Cannot write to socket.");
+    }
 
-    /* Write HTML Description of Error*/
-    fprintf(r->file,"<h1>");
-    fprintf(r->file,"Mr. Bui, I don't feel so good...");
-    fprintf(r->file,"</h1>");
-    fprintf(r->file,"<h2>");
-    fprintf(r->file,"Something went wrong:");
-    fprintf(r->file,"</h2>");
-    fprintf(r->file,"<p>");
-    fprintf(r->file,"%s\n",status_string);
-    fprintf(r->file,"</p>");
     /* Return specified status */
     return status;
 }
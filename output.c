@@ -0,0 +1,302 @@
+/* output.c: Output Scheduler Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define OUTPUT_THROTTLE     10000000ULL /* Longest wait for bandwidth per round (ns) */
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Protects bucket */
+    TokenBucket     bucket;             /*< Bandwidth allowance of server */
+} OutputAllowance;
+
+/* Global Variables */
+
+size_t ConnectionRate = 0;
+size_t OutputRate     = 0;
+
+static OutputAllowance *Allowance = NULL;
+
+/* Internal Functions */
+
+/**
+ * Take bytes from token bucket.
+ *
+ * @param   b           TokenBucket structure.
+ * @param   rate        Rate the bucket fills at (bytes per second).
+ * @param   want        Number of bytes wanted.
+ * @param   wait        Set to time until some bytes are available (ns).
+ * @return  Number of bytes that may be sent now (at most want).
+ *
+ * A bucket holds at most a tenth of a second's worth of bytes, so an idle
+ * connection cannot save up a burst that would swamp everyone else.
+ **/
+static size_t bucket_take(TokenBucket *b, size_t rate, size_t want, unsigned long long *wait) {
+  unsigned long long now = monotonic_ns();
+  double capacity = rate / 10.0 > 1.0 ? rate / 10.0 : 1.0;
+  size_t granted;
+
+  if (!b->refilled) {
+    b->tokens = capacity;
+  } else {
+    b->tokens += (now - b->refilled) * (double)rate / 1e9;
+    if (b->tokens > capacity) {
+      b->tokens = capacity;
+    }
+  }
+  b->refilled = now;
+
+  granted = b->tokens < want ? (size_t)b->tokens : want;
+  b->tokens -= granted;
+  if (!granted) {
+    double needed = (want < capacity ? want : capacity) - b->tokens;
+    *wait = needed * 1e9 / rate;
+  }
+  return granted;
+}
+
+/* External Functions */
+
+/**
+ * Allocate server bandwidth allowance.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The allowance is placed in an anonymous shared mapping so that OutputRate
+ * limits the server as a whole, not each forked child.
+ **/
+int output_init(void) {
+  pthread_mutexattr_t attr;
+
+  Allowance = mmap(NULL, sizeof(OutputAllowance), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (Allowance == MAP_FAILED) {
+    log("Unable to map output allowance: %s", strerror(errno));
+    Allowance = NULL;
+    return -1;
+  }
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&Allowance->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return 0;
+}
+
+/**
+ * Hand rest of file to the output scheduler.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          File to send (closed once sent).
+ * @param   offset      Offset in file to start at.
+ * @param   length      Number of bytes to send.
+ *
+ * The socket is non-blocking until the file is sent, so a client that reads
+ * slowly never holds up the worker sending to it.  The response is then sent
+ * by calling output_continue (or output_drain) until it is done.
+ *
+ * The exception is a TLS connection the kernel does not encrypt: SSL_write
+ * must be retried with the same bytes after a short write, so its socket
+ * stays blocking and each round sends at most one TLS record.  HTTP/2 streams
+ * share their connection's socket and wait for flow control instead (see
+ * h2_sendfile), so it is left alone.
+ **/
+void output_start(Request *r, int fd, off_t offset, size_t length) {
+#ifdef TLS
+  if (!r->ssl || tls_offloaded(r))
+#endif
+  if (!r->stream)
+  fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) | O_NONBLOCK);
+  r->output    = fd;
+  r->offset    = offset;
+  r->remaining = length;
+  r->deficit   = 0;
+}
+
+/**
+ * Send the next quantum of response.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether the response is done, blocked, or has more to send.
+ *
+ * Responses are sent with deficit round robin: every round earns a response
+ * OUTPUT_QUANTUM more bytes, and whatever a full socket or the bandwidth caps
+ * did not let it send carries over to the next round (up to one quantum).
+ * Between rounds the threaded server queues the connection behind other work,
+ * so a bulk download only ever delays a small response by a quantum.
+ *
+ * If ConnectionRate or OutputRate leaves nothing to send, this sleeps until
+ * there is (but no longer than OUTPUT_THROTTLE) and sends nothing.
+ **/
+OutputStatus output_continue(Request *r) {
+  unsigned long long wait = 0;
+  size_t length, allowed;
+  ssize_t nsent;
+  int error;
+
+  if (r->output < 0) {
+    return OUTPUT_DONE;
+  }
+
+  /* Earn this round's allowance */
+  if (r->deficit > OUTPUT_QUANTUM) {
+    r->deficit = OUTPUT_QUANTUM;
+  }
+  r->deficit += OUTPUT_QUANTUM;
+  length = allowed = r->deficit < r->remaining ? r->deficit : r->remaining;
+
+  /* Apply bandwidth caps (the server cap may allow less than the connection's) */
+  if (ConnectionRate) {
+    length = allowed = bucket_take(&r->bucket, ConnectionRate, length, &wait);
+  }
+  if (OutputRate && length) {
+    pthread_mutex_lock(&Allowance->lock);
+    length = bucket_take(&Allowance->bucket, OutputRate, length, &wait);
+    pthread_mutex_unlock(&Allowance->lock);
+  }
+  if (!length) {
+    struct timespec ts = { .tv_nsec = wait < OUTPUT_THROTTLE ? wait : OUTPUT_THROTTLE };
+    r->bucket.tokens += allowed;
+    nanosleep(&ts, NULL);
+    return OUTPUT_MORE;
+  }
+
+  if (r->stream) {
+    nsent = h2_sendfile(r, r->output, &r->offset, length);
+  } else
+#ifdef TLS
+  if (r->ssl) {
+    nsent = tls_sendfile(r, r->output, &r->offset, length);
+  } else
+#endif
+  nsent = sendfile(r->fd, r->output, &r->offset, length);
+  error = errno;
+
+  /* Give back allowance the server cap withheld, and allowance not used */
+  r->bucket.tokens += allowed - length;
+  if (nsent < (ssize_t)length) {
+    size_t unused = nsent > 0 ? length - nsent : length;
+    r->bucket.tokens += unused;
+    if (OutputRate) {
+      pthread_mutex_lock(&Allowance->lock);
+      Allowance->bucket.tokens += unused;
+      pthread_mutex_unlock(&Allowance->lock);
+    }
+  }
+
+  if (nsent < 0) {
+    if (error == EAGAIN || error == EINTR) {
+      return error == EAGAIN ? OUTPUT_BLOCKED : OUTPUT_MORE;
+    }
+    log("Could not send file: %s", strerror(error));
+    goto fail;
+  }
+  if (nsent == 0) {
+    log("File truncated while sending.");
+    goto fail;
+  }
+
+  r->remaining -= nsent;
+  r->deficit   -= nsent;
+  if (!r->remaining) {
+    trace(r, TRACE_LAST_BYTE);
+    output_cancel(r);
+    return OUTPUT_DONE;
+  }
+  return OUTPUT_MORE;
+
+fail:
+  r->keepalive = false;
+  output_cancel(r);
+  return OUTPUT_ERROR;
+}
+
+/**
+ * Send the rest of response, waiting whenever the socket is full.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  OUTPUT_DONE on success and OUTPUT_ERROR on error.
+ *
+ * This is for servers where each connection has its own process.
+ **/
+OutputStatus output_drain(Request *r) {
+  OutputStatus status;
+  struct pollfd pfd = { .fd = r->fd, .events = POLLOUT };
+
+  while ((status = output_continue(r)) > OUTPUT_DONE) {
+    if (status == OUTPUT_BLOCKED && poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      r->keepalive = false;
+      output_cancel(r);
+      return OUTPUT_ERROR;
+    }
+  }
+  return status;
+}
+
+/**
+ * Wait until bandwidth caps allow bytes sent outside the scheduler.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   length      Number of bytes about to be sent.
+ *
+ * This is for response bytes that do not come from a file (such as proxied
+ * bodies): they are taken from the same token buckets as output_continue
+ * takes file bytes from, sleeping whenever either bucket is empty.
+ **/
+void output_throttle(Request *r, size_t length) {
+  while (length > 0 && (ConnectionRate || OutputRate)) {
+    unsigned long long wait = 0;
+    size_t allowed = length, granted;
+
+    if (ConnectionRate) {
+      allowed = bucket_take(&r->bucket, ConnectionRate, allowed, &wait);
+    }
+    granted = allowed;
+    if (OutputRate && granted) {
+      pthread_mutex_lock(&Allowance->lock);
+      granted = bucket_take(&Allowance->bucket, OutputRate, granted, &wait);
+      pthread_mutex_unlock(&Allowance->lock);
+    }
+    r->bucket.tokens += allowed - granted;
+    length -= granted;
+
+    if (!granted) {
+      struct timespec ts = { .tv_nsec = wait < OUTPUT_THROTTLE ? wait : OUTPUT_THROTTLE };
+      nanosleep(&ts, NULL);
+    }
+  }
+}
+
+/**
+ * Stop sending response and close its file.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * The socket is made blocking again, for the next request on the connection
+ * (unless it belongs to an HTTP/2 stream, see output_start).
+ **/
+void output_cancel(Request *r) {
+  if (r->output < 0) {
+    return;
+  }
+
+  close(r->output);
+  if (!r->stream) {
+    fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_NONBLOCK);
+  }
+  r->output    = -1;
+  r->remaining = 0;
+  r->deficit   = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,256 @@
+/* pool.c: Work-Stealing Thread Pool */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define DEQUE_CAPACITY  64              /* Initial capacity of each deque */
+
+/* Thread Local Variables */
+
+static __thread Worker *CurrentWorker = NULL;
+
+/* Internal Functions */
+
+/**
+ * Push task onto deque.
+ *
+ * @param   d           Deque structure.
+ * @param   task        Task to push.
+ * @param   front       Whether to push onto the front (run next).
+ * @return  -1 on error and 0 on success.
+ **/
+static int deque_push(Deque *d, Task task, bool front) {
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->capacity) {
+    size_t capacity = d->capacity ? 2 * d->capacity : DEQUE_CAPACITY;
+    Task *tasks = malloc(capacity * sizeof(Task));
+    if (!tasks) {
+      pthread_mutex_unlock(&d->lock);
+      return -1;
+    }
+    for (size_t i = 0; i < d->count; i++) {
+      tasks[i] = d->tasks[(d->head + i) % d->capacity];
+    }
+    free(d->tasks);
+    d->tasks    = tasks;
+    d->head     = 0;
+    d->capacity = capacity;
+  }
+
+  if (front) {
+    d->head = (d->head + d->capacity - 1) % d->capacity;
+    d->tasks[d->head] = task;
+  } else {
+    d->tasks[(d->head + d->count) % d->capacity] = task;
+  }
+  d->count++;
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+/**
+ * Pop task from deque.
+ *
+ * @param   d           Deque structure.
+ * @param   task        Set to popped task.
+ * @param   front       Whether to pop from the front (owner) or back (thief).
+ * @return  true if a task was popped, false if the deque was empty.
+ **/
+static bool deque_pop(Deque *d, Task *task, bool front) {
+  bool popped = false;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->count > 0) {
+    if (front) {
+      *task   = d->tasks[d->head];
+      d->head = (d->head + 1) % d->capacity;
+    } else {
+      *task   = d->tasks[(d->head + d->count - 1) % d->capacity];
+    }
+    d->count--;
+    popped = true;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return popped;
+}
+
+/**
+ * Find next task for worker.
+ *
+ * @param   w           Worker structure.
+ * @param   task        Set to next task.
+ * @return  true if a task was found, false otherwise.
+ *
+ * Workers take from the front of their own deque and steal from the back of
+ * the other workers' deques, starting with their neighbour.  This is called
+ * with the pool lock held, so tasks are only ever taken under it.
+ **/
+static bool worker_next(Worker *w, Task *task) {
+  Pool *p = w->pool;
+
+  if (deque_pop(&w->deque, task, true)) {
+    return true;
+  }
+
+  for (size_t i = 1; i < p->nworkers; i++) {
+    Worker *victim = &p->workers[(w->index + i) % p->nworkers];
+    if (deque_pop(&victim->deque, task, false)) {
+      __sync_fetch_and_add(&w->steals, 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Run tasks until the pool is stopped and drained.
+ *
+ * @param   arg         Worker structure.
+ * @return  NULL.
+ **/
+static void *worker_main(void *arg) {
+  Worker *w = arg;
+  Pool   *p = w->pool;
+  Task    task;
+
+  CurrentWorker = w;
+  affinity_pin(affinity_cpu(w->index));
+
+  while (true) {
+    /* Wait for pending tasks (or shutdown), and claim one */
+    pthread_mutex_lock(&p->lock);
+    while (p->pending == 0 && !p->stopping) {
+      pthread_cond_wait(&p->wakeup, &p->lock);
+    }
+    if (p->pending == 0 && p->stopping) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+
+    /* Tasks are queued before they are counted and only taken under the lock,
+     * so there are at least as many queued tasks as pending ones and a scan
+     * under the lock always finds one */
+    if (!worker_next(w, &task)) {
+      pthread_mutex_unlock(&p->lock);
+      continue;
+    }
+    p->pending--;
+    pthread_mutex_unlock(&p->lock);
+
+    task.func(task.arg);
+  }
+
+  return NULL;
+}
+
+/* External Functions */
+
+/**
+ * Create thread pool.
+ *
+ * @param   nworkers    Number of worker threads.
+ * @return  Newly allocated Pool (or NULL on error).
+ *
+ * Signals are blocked in the worker threads so that they are delivered to the
+ * thread running the server loop.
+ **/
+Pool *pool_create(size_t nworkers) {
+  Pool *p = calloc(1, sizeof(Pool));
+  sigset_t all, previous;
+
+  if (!p || (p->workers = calloc(nworkers, sizeof(Worker))) == NULL) {
+    log("Unable to allocate pool.");
+    free(p);
+    return NULL;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wakeup, NULL);
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+  for (size_t i = 0; i < nworkers; i++) {
+    Worker *w = &p->workers[i];
+    w->pool  = p;
+    w->index = i;
+    pthread_mutex_init(&w->deque.lock, NULL);
+    if ((errno = pthread_create(&w->thread, NULL, worker_main, w)) != 0) {
+      log("Unable to create worker: %s", strerror(errno));
+      break;
+    }
+    p->nworkers++;
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  if (p->nworkers == 0) {
+    pool_destroy(p);
+    return NULL;
+  }
+  return p;
+}
+
+/**
+ * Stop thread pool once all submitted tasks have run, and deallocate it.
+ *
+ * @param   p           Pool structure.
+ **/
+void pool_destroy(Pool *p) {
+  pthread_mutex_lock(&p->lock);
+  p->stopping = true;
+  pthread_cond_broadcast(&p->wakeup);
+  pthread_mutex_unlock(&p->lock);
+
+  for (size_t i = 0; i < p->nworkers; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+    debug("Worker %zu stole %lu tasks", i, p->workers[i].steals);
+  }
+
+  for (size_t i = 0; i < p->nworkers; i++) {
+    pthread_mutex_destroy(&p->workers[i].deque.lock);
+    free(p->workers[i].deque.tasks);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wakeup);
+  free(p->workers);
+  free(p);
+}
+
+/**
+ * Submit task to thread pool.
+ *
+ * @param   p           Pool structure.
+ * @param   func        Function to run.
+ * @param   arg         Argument to function.
+ * @param   front       Whether the task should run before queued tasks.
+ * @return  -1 on error and 0 on success.
+ *
+ * Tasks submitted from a worker go onto that worker's own deque (so related
+ * work stays on the same core); other tasks are spread round-robin.  Idle
+ * workers steal from busy ones, so one slow task never strands the tasks
+ * queued behind it.
+ **/
+int pool_submit(Pool *p, TaskFunc func, void *arg, bool front) {
+  Task task = { func, arg };
+  Worker *w = (CurrentWorker && CurrentWorker->pool == p) ? CurrentWorker
+            : &p->workers[__sync_fetch_and_add(&p->next, 1) % p->nworkers];
+
+  if (deque_push(&w->deque, task, front) < 0) {
+    log("Unable to queue task.");
+    return -1;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->pending++;
+  pthread_cond_signal(&p->wakeup);
+  pthread_mutex_unlock(&p->lock);
+  return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,1056 @@
+/* proxy.c: Reverse Proxy Functions */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PROXY_MAX_ROUTES    16          /* Most proxied prefixes */
+#define PROXY_MAX_BACKENDS  32          /* Most upstream servers (over all routes) */
+#define PROXY_IDLE          32          /* Idle connections kept per upstream server */
+#define PROXY_TIMEOUT       30          /* Longest wait on an upstream server (s) */
+#define PROXY_DOWN_TIME     5000000000ULL /* Time a failed upstream server is skipped (ns) */
+#define PROXY_SPLICE        (64 * 1024) /* Bytes moved per splice */
+#define PROXY_PROBE_TIME    2           /* Time between health probes (s) */
+#define PROXY_PROBE_TIMEOUT 1000        /* Longest wait on a health probe (ms) */
+
+typedef struct {
+    size_t      active;                 /*< Requests being forwarded */
+    unsigned long requests;             /*< Requests forwarded */
+    unsigned long reused;               /*< Requests sent on a pooled connection */
+    unsigned long failures;             /*< Failed connections and exchanges */
+    unsigned long long down_until;      /*< Time server may be tried again (ns) */
+} BackendMetrics;
+
+typedef struct {
+    BackendMetrics backends[PROXY_MAX_BACKENDS]; /*< Counters of each server */
+    size_t      turns[PROXY_MAX_ROUTES];  /*< Server of each route that wins the next tie */
+} ProxyShared;
+
+typedef struct {
+    char        *name;                  /*< Address as given on the command line */
+    struct sockaddr_storage addr;       /*< Address of server */
+    socklen_t   addrlen;                /*< Length of address */
+    const char  *path;                  /*< Path requested by health probes */
+    BackendMetrics *metrics;            /*< Shared counters and health */
+    pthread_mutex_t lock;               /*< Protects idle connections */
+    int         idle[PROXY_IDLE];       /*< Idle persistent connections */
+    size_t      nidle;                  /*< Number of idle connections */
+} Backend;
+
+struct proxy_route {
+    char        *prefix;                /*< URI prefix forwarded (without trailing '/') */
+    size_t      length;                 /*< Length of prefix */
+    Backend     *backends;              /*< Upstream servers of route */
+    size_t      count;                  /*< Number of upstream servers */
+    size_t      *turn;                  /*< Server that wins the next tie (shared) */
+};
+
+typedef enum {
+    PROXY_DONE,                         /* Response relayed to client */
+    PROXY_RETRY,                        /* Server failed; request may go elsewhere */
+    PROXY_FAILED,                       /* Server failed; request may not be sent again */
+    PROXY_CLIENT_FAILED,                /* Request body could not be read from client */
+} ProxyResult;
+
+/* Headers that only apply to one connection and are never forwarded */
+static const char *HopHeaders[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "Expect", "X-Forwarded-For",
+};
+
+/* Global Variables */
+
+static ProxyRoute Routes[PROXY_MAX_ROUTES];
+static size_t     NRoutes = 0;
+static Backend    Backends[PROXY_MAX_BACKENDS];
+static size_t     NBackends = 0;
+
+static __thread int Pipe[2] = {-1, -1}; /* Pipe response bodies are spliced through */
+
+/* Internal Functions */
+
+/**
+ * Resolve address of upstream server.
+ *
+ * @param   b           Backend structure to fill in.
+ * @param   name        Address (host:port, [v6]:port, or unix:/path).
+ * @return  true on success, false if the address cannot be resolved.
+ **/
+static bool proxy_resolve(Backend *b, const char *name) {
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo *results;
+  char host[NI_MAXHOST];
+  const char *colon;
+  int status;
+
+  memset(b, 0, sizeof(Backend));
+
+  /* Unix socket */
+  if (strncmp(name, "unix:", 5) == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *)&b->addr;
+    if (strlen(name + 5) >= sizeof(un->sun_path)) {
+      log("Upstream socket path too long: %s", name + 5);
+      return false;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, name + 5);
+    b->addrlen = sizeof(struct sockaddr_un);
+    goto done;
+  }
+
+  /* TCP host and port (IPv6 literals are bracketed) */
+  if ((colon = strrchr(name, ':')) == NULL || colon == name || (size_t)(colon - name) >= sizeof(host)) {
+    log("Upstream address must be host:port or unix:path: %s", name);
+    return false;
+  }
+  if (name[0] == '[' && colon[-1] == ']') {
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - name - 2), name + 1);
+  } else {
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - name), name);
+  }
+  if ((status = getaddrinfo(host, colon + 1, &hints, &results)) != 0) {
+    log("Unable to resolve upstream %s: %s", name, gai_strerror(status));
+    return false;
+  }
+  memcpy(&b->addr, results->ai_addr, results->ai_addrlen);
+  b->addrlen = results->ai_addrlen;
+  freeaddrinfo(results);
+
+done:
+  b->name = strdup(name);
+  pthread_mutex_init(&b->lock, NULL);
+  return true;
+}
+
+/**
+ * Pick upstream server for request.
+ *
+ * @param   route       Route of request.
+ * @param   tried       Bitmask of servers already tried for this request.
+ * @return  Server with the fewest active requests (or NULL if all were tried).
+ *
+ * Servers that failed in the last PROXY_DOWN_TIME nanoseconds are skipped.  If
+ * every server is down, the one that failed longest ago is tried anyway, so a
+ * route recovers as soon as any of its servers does.  Ties go to servers in
+ * turn, so an idle route still spreads requests over all of its servers.
+ **/
+static Backend * proxy_select(ProxyRoute *route, unsigned long tried) {
+  unsigned long long now = monotonic_ns();
+  size_t start = __sync_fetch_and_add(route->turn, 1);
+  Backend *best = NULL;
+  Backend *down = NULL;
+
+  for (size_t i = 0; i < route->count; i++) {
+    size_t k = (start + i) % route->count;
+    Backend *b = &route->backends[k];
+
+    if (tried & (1UL << k)) {
+      continue;
+    }
+    if (b->metrics->down_until > now) {
+      if (!down || b->metrics->down_until < down->metrics->down_until) {
+        down = b;
+      }
+      continue;
+    }
+    if (!best || b->metrics->active < best->metrics->active) {
+      best = b;
+    }
+  }
+  return best ? best : down;
+}
+
+/**
+ * Get connection to upstream server.
+ *
+ * @param   b           Backend structure.
+ * @param   pooled      Whether a pooled connection may be used.
+ * @param   reused      Set to whether the connection came from the pool.
+ * @return  Connected socket (or -1 on error).
+ *
+ * Idle pooled connections are checked with a non-blocking peek first: one
+ * the server closed (or that has stray bytes) is discarded rather than used.
+ * The server may still close a pooled connection as the request goes out,
+ * so requests that cannot be sent again (see proxy_replayable) only use
+ * fresh connections.
+ **/
+static int proxy_connect(Backend *b, bool pooled, bool *reused) {
+  struct timeval timeout = { .tv_sec = PROXY_TIMEOUT };
+  int on = 1;
+  int fd;
+
+  pthread_mutex_lock(&b->lock);
+  while (pooled && b->nidle > 0) {
+    char byte;
+    fd = b->idle[--b->nidle];
+    if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pthread_mutex_unlock(&b->lock);
+      *reused = true;
+      return fd;
+    }
+    close(fd);
+  }
+  pthread_mutex_unlock(&b->lock);
+
+  *reused = false;
+  if ((fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    log("Unable to make upstream socket: %s", strerror(errno));
+    return -1;
+  }
+
+  /* Bound connect, reads, and writes (SO_SNDTIMEO also bounds connect) */
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (b->addr.ss_family != AF_UNIX) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+
+  if (connect(fd, (struct sockaddr *)&b->addr, b->addrlen) < 0) {
+    log("Unable to connect to upstream %s: %s", b->name, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Return connection to upstream server.
+ *
+ * @param   b           Backend structure.
+ * @param   fd          Connected socket.
+ * @param   reusable    Whether the server will take another request on it.
+ **/
+static void proxy_release(Backend *b, int fd, bool reusable) {
+  if (reusable) {
+    pthread_mutex_lock(&b->lock);
+    if (b->nidle < PROXY_IDLE) {
+      b->idle[b->nidle++] = fd;
+      fd = -1;
+    }
+    pthread_mutex_unlock(&b->lock);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/**
+ * Mark upstream server as failed.
+ *
+ * @param   b           Backend structure.
+ *
+ * The server is skipped for PROXY_DOWN_TIME nanoseconds (see proxy_select) and
+ * its idle connections are closed, so the first request after that probes it
+ * with a fresh connection.
+ **/
+static void proxy_fail(Backend *b) {
+  __sync_fetch_and_add(&b->metrics->failures, 1);
+  b->metrics->down_until = monotonic_ns() + PROXY_DOWN_TIME;
+  log("Upstream %s failed; skipping it for %llu seconds", b->name, PROXY_DOWN_TIME / 1000000000ULL);
+
+  pthread_mutex_lock(&b->lock);
+  while (b->nidle > 0) {
+    close(b->idle[--b->nidle]);
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Move bytes between sockets without copying them through user space.
+ *
+ * @param   from        Socket to read from.
+ * @param   to          Socket to write to.
+ * @param   length      Number of bytes to move (SIZE_MAX for until EOF).
+ * @param   r           Request whose bandwidth caps apply (NULL for none).
+ * @return  Number of bytes moved.
+ *
+ * Bytes are spliced into a per-thread pipe and from there into the other
+ * socket, so the kernel moves page references instead of copying.  If a
+ * write fails with bytes left in the pipe, the pipe is closed so that they
+ * never leak into another response.
+ *
+ * Response bytes wait in the pipe until the bandwidth caps allow them out
+ * (see output_throttle).
+ **/
+static size_t proxy_splice(int from, int to, size_t length, Request *r) {
+  size_t moved = 0;
+
+  if (Pipe[0] < 0 && pipe2(Pipe, O_CLOEXEC) < 0) {
+    log("Unable to create splice pipe: %s", strerror(errno));
+    return 0;
+  }
+
+  while (moved < length) {
+    size_t want = length - moved < PROXY_SPLICE ? length - moved : PROXY_SPLICE;
+    ssize_t n = splice(from, NULL, Pipe[1], NULL, want, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    if (r) {
+      output_throttle(r, n);
+    }
+
+    for (ssize_t left = n; left > 0; ) {
+      ssize_t m = splice(Pipe[0], NULL, to, NULL, left, SPLICE_F_MOVE);
+      if (m < 0 && errno == EINTR) {
+        continue;
+      }
+      if (m <= 0) {
+        close(Pipe[0]);
+        close(Pipe[1]);
+        Pipe[0] = Pipe[1] = -1;
+        return moved + (n - left);
+      }
+      left -= m;
+    }
+    moved += n;
+  }
+  return moved;
+}
+
+/**
+ * Write all of the io vectors to upstream server.
+ *
+ * @param   fd          Upstream socket.
+ * @param   iov         Array of io vectors (modified).
+ * @param   iovcnt      Number of io vectors.
+ * @return  true on success, false on error.
+ **/
+static bool proxy_send(int fd, struct iovec *iov, int iovcnt) {
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+
+  while (msg.msg_iovlen > 0) {
+    ssize_t nwritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    while (msg.msg_iovlen > 0 && (size_t)nwritten >= msg.msg_iov->iov_len) {
+      nwritten -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + nwritten;
+      msg.msg_iov->iov_len -= nwritten;
+    }
+  }
+  return true;
+}
+
+/**
+ * Move bytes between client and upstream server through a buffer.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Upstream socket.
+ * @param   length      Number of bytes to move (SIZE_MAX for until EOF).
+ * @param   response    Whether to move response bytes to the client (or
+ * request bytes to the server).
+ * @return  Number of bytes moved.
+ *
+ * This is for clients that bytes cannot be spliced to or from (see
+ * proxy_spliceable).  Request bodies from a TLS client are always decrypted
+ * by OpenSSL (the kernel only takes over sending), and responses are
+ * encrypted by it when the kernel does not encrypt the session at all.
+ * Response bytes are subject to the bandwidth caps (see output_throttle).
+ **/
+static size_t proxy_copy(Request *r, int fd, size_t length, bool response) {
+  char buffer[BUFSIZ];
+  size_t moved = 0;
+
+  while (moved < length) {
+    size_t want = length - moved < sizeof(buffer) ? length - moved : sizeof(buffer);
+    ssize_t n;
+    if (response) {
+      n = read(fd, buffer, want);
+    } else
+#ifdef TLS
+    if (r->ssl) {
+      n = tls_read(r, buffer, want);
+    } else
+#endif
+    n = read(r->fd, buffer, want);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+
+    struct iovec iov = { buffer, n };
+    if (response) {
+      output_throttle(r, n);
+    }
+    if (response ? response_write(r, buffer, n) < 0 : !proxy_send(fd, &iov, 1)) {
+      break;
+    }
+    moved += n;
+  }
+  return moved;
+}
+
+/**
+ * Determine whether bytes may be spliced to client socket.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether the client socket carries response bytes as they are.
+ *
+ * HTTP/2 streams frame their bytes (see h2_writev), and TLS sessions encrypt
+ * them unless the kernel does.
+ **/
+static bool proxy_spliceable(Request *r) {
+  if (r->stream) {
+    return false;
+  }
+#ifdef TLS
+  if (r->ssl && !tls_offloaded(r)) {
+    return false;
+  }
+#endif
+  return true;
+}
+
+/**
+ * Determine whether header is hop-by-hop.
+ *
+ * @param   name        Name of header (not necessarily NUL terminated).
+ * @param   length      Length of name.
+ * @return  Whether the header must not be forwarded.
+ **/
+static bool proxy_hop_header(const char *name, size_t length) {
+  for (size_t i = 0; i < sizeof(HopHeaders) / sizeof(HopHeaders[0]); i++) {
+    if (strlen(HopHeaders[i]) == length && strncasecmp(HopHeaders[i], name, length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Write request headers in the order the client sent them.
+ *
+ * @param   fs          Stream to write to.
+ * @param   header      Header list (parsed in reverse order).
+ **/
+static void proxy_write_headers(FILE *fs, Header *header) {
+  if (!header) {
+    return;
+  }
+  proxy_write_headers(fs, header->next);
+  if (!proxy_hop_header(header->name, strlen(header->name))) {
+    fprintf(fs, "%s: %s\r\n", header->name, header->value);
+  }
+}
+
+/**
+ * Write path with the bytes that may not appear in one percent-encoded.
+ *
+ * @param   fs          Stream to write to.
+ * @param   path        Decoded path.
+ **/
+static void proxy_write_path(FILE *fs, const char *path) {
+  static const char Allowed[] = "-._~!$&'()*+,;=:@/";
+
+  for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    if (isalnum(*p) || (*p && strchr(Allowed, *p))) {
+      fputc(*p, fs);
+    } else {
+      fprintf(fs, "%%%02X", *p);
+    }
+  }
+}
+
+/**
+ * Render request line and headers sent upstream.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   uri         Normalized URI of request (see normalize_uri).
+ * @param   length      Set to length of rendered head.
+ * @return  Allocated head (or NULL on error).
+ *
+ * The upstream server gets the path the route matched, not the one the client
+ * sent, so it never sees dot-segments or escapes that resolve differently
+ * there than they did here.
+ * Requests go upstream as HTTP/1.0 with Connection: keep-alive, so the server
+ * may keep the connection open but never answers with a chunked body: each
+ * response is either delimited by Content-Length (and the connection pooled)
+ * or by the server closing the connection.  The client's address is appended
+ * to X-Forwarded-For.
+ **/
+static char * proxy_request_head(Request *r, const char *uri, size_t *length) {
+  const char *forwarded = request_header(r, "X-Forwarded-For");
+  const char *scheme = "http";
+  char *head = NULL;
+  FILE *fs;
+
+#ifdef TLS
+  if (r->ssl) {
+    scheme = "https";
+  }
+#endif
+
+  if ((fs = open_memstream(&head, length)) == NULL) {
+    log("Unable to open memory stream.");
+    return NULL;
+  }
+  fprintf(fs, "%s ", r->method);
+  proxy_write_path(fs, uri);
+  fprintf(fs, "%s%s HTTP/1.0\r\n", r->query ? "?" : "", r->query ? r->query : "");
+  proxy_write_headers(fs, r->headers);
+  fprintf(fs, "X-Forwarded-For: %s%s%s\r\n", forwarded ? forwarded : "", forwarded ? ", " : "", request_host(r));
+  fprintf(fs, "X-Forwarded-Proto: %s\r\n", scheme);
+  fprintf(fs, "Connection: keep-alive\r\n\r\n");
+  fclose(fs);
+  return head;
+}
+
+/**
+ * Determine whether request may be sent to upstream server again.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   body        Length of request body.
+ * @param   buffered    Bytes of request body already in the read buffer.
+ * @return  Whether the request may be sent again.
+ *
+ * A request that may have reached a server is only sent again if its method
+ * is idempotent (RFC 7231, Section 4.2.2) and its whole body is still in the
+ * read buffer: bytes streamed from the client cannot be read again.
+ **/
+static bool proxy_replayable(Request *r, size_t body, size_t buffered) {
+  static const char *Idempotent[] = { "GET", "HEAD", "OPTIONS", "PUT", "DELETE" };
+
+  if (body != buffered) {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(Idempotent) / sizeof(Idempotent[0]); i++) {
+    if (streq(r->method, Idempotent[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Send request to upstream server and relay its response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Upstream socket.
+ * @param   reused      Whether the socket came from the pool.
+ * @param   head        Rendered request head.
+ * @param   hlength     Length of request head.
+ * @param   body        Length of request body.
+ * @param   buffered    Bytes of request body already in the read buffer.
+ * @param   reusable    Set to whether the socket may go back to the pool.
+ * @return  Result of exchange.
+ *
+ * The response head is read into a buffer, its hop-by-hop headers are
+ * replaced with our own Connection header (and its version with HTTP/1.1 if
+ * the client connection persists), and it is sent to the client along
+ * with the start of the body.  The rest of the body is spliced from the
+ * upstream socket to the client.
+ *
+ * If the server fails before it responds, PROXY_RETRY lets the caller send the
+ * request again, but only if it is replayable (see proxy_replayable).
+ **/
+static ProxyResult proxy_exchange(Request *r, int fd, bool reused, const char *head, size_t hlength,
+                                  size_t body, size_t buffered, bool *reusable) {
+  struct iovec iov[] = {
+    { (void *)head, hlength },
+    { buffered ? r->buffer + r->bstart : NULL, buffered },
+  };
+  char response[BUFSIZ];
+  char out[BUFSIZ + 64];
+  size_t nresponse = 0;
+  size_t nout = 0;
+  char *end;
+  bool replayable = proxy_replayable(r, body, buffered);
+
+  *reusable = false;
+
+  /* Forward request head and body */
+  if (!proxy_send(fd, iov, buffered ? 2 : 1)) {
+    log("Could not send request upstream.");
+    return replayable ? PROXY_RETRY : PROXY_FAILED;
+  }
+  size_t forwarded;
+#ifdef TLS
+  if (r->ssl) {
+    forwarded = body > buffered ? proxy_copy(r, fd, body - buffered, false) : 0;
+  } else
+#endif
+  forwarded = body > buffered ? proxy_splice(r->fd, fd, body - buffered, NULL) : 0;
+  if (forwarded != body - buffered) {
+    log("Could not forward request body.");
+    r->keepalive = false;
+    return PROXY_CLIENT_FAILED;
+  }
+
+  /* Read response head */
+  while ((end = memmem(response, nresponse, "\r\n\r\n", 4)) == NULL) {
+    ssize_t nread;
+    if (nresponse == sizeof(response)) {
+      log("Upstream response headers too large.");
+      return PROXY_FAILED;
+    }
+    while ((nread = read(fd, response + nresponse, sizeof(response) - nresponse)) < 0 && errno == EINTR);
+    if (nread <= 0) {
+      if (nresponse == 0 && replayable) {
+        return PROXY_RETRY;
+      }
+      log("Upstream closed connection before responding.");
+      return PROXY_FAILED;
+    }
+    nresponse += nread;
+  }
+  end += 2;
+
+  /* Parse status line: HTTP/1.<minor> <code> <reason> */
+  char *line = memchr(response, '\n', end - response) + 1;
+  if (nresponse < 13 || strncmp(response, "HTTP/1.", 7) != 0 || response[8] != ' ') {
+    log("Invalid upstream status line.");
+    return PROXY_FAILED;
+  }
+  int code = atoi(response + 9);
+  bool upstream_keepalive = response[7] == '1';
+  bool known = false;
+  size_t length = 0;
+
+  nout = snprintf(out, sizeof(out), "HTTP/1.0 %.*s", (int)(line - response - 9), response + 9);
+
+  /* Copy end-to-end headers and note how the body is delimited */
+  while (line < end) {
+    char *next  = memchr(line, '\n', end - line) + 1;
+    char *colon = memchr(line, ':', next - line);
+    if (!colon) {
+      line = next;
+      continue;
+    }
+    char *value = colon + 1 + strspn(colon + 1, " \t");
+    if (colon - line == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+      length = strtoull(value, NULL, 10);
+      known  = true;
+    } else if (colon - line == 10 && strncasecmp(line, "Connection", 10) == 0) {
+      if (strncasecmp(value, "close", 5) == 0) {
+        upstream_keepalive = false;
+      } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+        upstream_keepalive = true;
+      }
+    } else if (colon - line == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+      upstream_keepalive = false;
+      known = false;
+    }
+    if (!proxy_hop_header(line, colon - line) || (colon - line == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)) {
+      memcpy(out + nout, line, next - line);
+      nout += next - line;
+    }
+    line = next;
+  }
+
+  /* Responses to HEAD and 1xx, 204, and 304 responses never have a body */
+  if (streq(r->method, "HEAD") || (code >= 100 && code < 200) || code == 204 || code == 304) {
+    length = 0;
+    known  = true;
+  }
+  if (!known) {
+    r->keepalive = false;
+  }
+  nout += snprintf(out + nout, sizeof(out) - nout, "Connection: %s\r\n\r\n", r->keepalive ? "keep-alive" : "close");
+  if (r->keepalive) {
+    out[7] = '1';
+  }
+
+  /* Send response head with the start of the body */
+  size_t start = (response + nresponse) - (end + 2);
+  size_t first = known && start > length ? length : start;
+  memcpy(out + nout, end + 2, first);
+  output_throttle(r, first);
+  if (response_write(r, out, nout + first) < 0) {
+    log("Cannot write to socket.");
+    r->keepalive = false;
+    return PROXY_DONE;
+  }
+
+  /* Splice the rest of the body (or copy it, if it must be encrypted or framed) */
+  size_t rest = known ? length - first : SIZE_MAX;
+  size_t moved;
+  if (!proxy_spliceable(r)) {
+    moved = rest ? proxy_copy(r, fd, rest, true) : 0;
+  } else {
+    moved = rest ? proxy_splice(fd, r->fd, rest, r) : 0;
+  }
+  trace(r, TRACE_LAST_BYTE);
+  if (known && moved != rest) {
+    log("Upstream response truncated.");
+    r->keepalive = false;
+    return PROXY_DONE;
+  }
+
+  *reusable = upstream_keepalive && known && start <= length;
+  return PROXY_DONE;
+}
+
+/**
+ * Forward request to upstream server.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   b           Backend structure.
+ * @param   head        Rendered request head.
+ * @param   hlength     Length of request head.
+ * @param   body        Length of request body.
+ * @param   buffered    Bytes of request body already in the read buffer.
+ * @return  Result of exchange.
+ *
+ * Stale pooled connections are discarded until the request goes through or a
+ * fresh connection is used.  A server that cannot be connected to never saw
+ * the request, so PROXY_RETRY is returned then whatever the request is.
+ **/
+static ProxyResult proxy_forward(Request *r, Backend *b, const char *head, size_t hlength,
+                                 size_t body, size_t buffered) {
+  bool pooled = proxy_replayable(r, body, buffered);
+  ProxyResult result;
+  bool reused, reusable;
+  int fd;
+
+  while (true) {
+    if ((fd = proxy_connect(b, pooled, &reused)) < 0) {
+      return PROXY_RETRY;
+    }
+    if (reused) {
+      __sync_fetch_and_add(&b->metrics->reused, 1);
+    }
+
+    result = proxy_exchange(r, fd, reused, head, hlength, body, buffered, &reusable);
+    proxy_release(b, fd, reusable);
+    if (result != PROXY_RETRY || !reused) {
+      return result;
+    }
+    debug("Upstream %s closed pooled connection; retrying", b->name);
+  }
+}
+
+/**
+ * Check whether upstream server answers.
+ *
+ * @param   b           Backend structure.
+ * @return  Whether the server answered a HEAD request for its route's prefix
+ * with anything other than a server error.
+ *
+ * Each probe uses a fresh connection, and no step may take longer than
+ * PROXY_PROBE_TIMEOUT milliseconds.
+ **/
+static bool proxy_probe(Backend *b) {
+  struct timeval timeout = { .tv_sec = PROXY_PROBE_TIMEOUT / 1000, .tv_usec = PROXY_PROBE_TIMEOUT % 1000 * 1000 };
+  struct pollfd pfd = { .events = POLLOUT };
+  char request[BUFSIZ], response[16] = "";
+  int error = 0;
+  socklen_t length = sizeof(error);
+  ssize_t n, nread = 0;
+  bool up = false;
+
+  if ((pfd.fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+    return false;
+  }
+
+  /* Connect without blocking past the timeout */
+  if (connect(pfd.fd, (struct sockaddr *)&b->addr, b->addrlen) < 0 &&
+      (errno != EINPROGRESS || poll(&pfd, 1, PROXY_PROBE_TIMEOUT) <= 0 ||
+       getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)) {
+    goto done;
+  }
+
+  /* Ask for the route's prefix and read the status line */
+  fcntl(pfd.fd, F_SETFL, fcntl(pfd.fd, F_GETFL) & ~O_NONBLOCK);
+  setsockopt(pfd.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(pfd.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  n = snprintf(request, sizeof(request), "HEAD %s HTTP/1.0\r\nUser-Agent: spidey-probe\r\n\r\n", b->path);
+  if (send(pfd.fd, request, n, MSG_NOSIGNAL) != n) {
+    goto done;
+  }
+  while (nread < 13 && (n = read(pfd.fd, response + nread, 13 - nread)) > 0) {
+    nread += n;
+  }
+  up = nread == 13 && strncmp(response, "HTTP/1.", 7) == 0 && response[9] != '5';
+
+done:
+  close(pfd.fd);
+  return up;
+}
+
+/**
+ * Probe upstream servers in the background.
+ *
+ * @param   arg         Unused.
+ * @return  NULL (never returns).
+ *
+ * Every PROXY_PROBE_TIME seconds, each server is probed (see proxy_probe): a
+ * server that stops answering is marked as failed before a request has to
+ * find out, and a failed server is back in rotation as soon as it answers,
+ * instead of waiting for PROXY_DOWN_TIME to pass.
+ **/
+static void *proxy_probe_thread(void *arg) {
+  while (true) {
+    sleep(PROXY_PROBE_TIME);
+    for (size_t i = 0; i < NBackends; i++) {
+      Backend *b = &Backends[i];
+      bool up = proxy_probe(b);
+      if (!up && b->metrics->down_until <= monotonic_ns()) {
+        proxy_fail(b);
+      } else if (!up) {
+        b->metrics->down_until = monotonic_ns() + PROXY_DOWN_TIME;
+      } else if (b->metrics->down_until) {
+        log("Upstream %s recovered", b->name);
+        b->metrics->down_until = 0;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* External Functions */
+
+/**
+ * Add proxied prefix.
+ *
+ * @param   spec        Route (prefix=upstream[,upstream...]).
+ * @return  true on success, false if the route is invalid.
+ *
+ * Upstream servers are given as host:port, [v6]:port, or unix:/path.
+ **/
+bool proxy_add_route(const char *spec) {
+  const char *equals = strchr(spec, '=');
+  ProxyRoute *route = &Routes[NRoutes];
+  char *upstreams, *name, *save = NULL;
+
+  if (!equals || spec[0] != '/' || NRoutes == PROXY_MAX_ROUTES) {
+    return false;
+  }
+
+  /* Prefix is matched on whole segments, so drop any trailing '/' */
+  route->length = equals - spec;
+  while (route->length > 1 && spec[route->length - 1] == '/') {
+    route->length--;
+  }
+  route->prefix   = strndup(spec, route->length);
+  route->backends = &Backends[NBackends];
+  route->count    = 0;
+
+  upstreams = strdup(equals + 1);
+  for (name = strtok_r(upstreams, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+    if (NBackends == PROXY_MAX_BACKENDS || !proxy_resolve(&Backends[NBackends], name)) {
+      free(upstreams);
+      free(route->prefix);
+      NBackends -= route->count;
+      return false;
+    }
+    Backends[NBackends].path = route->prefix;
+    NBackends++;
+    route->count++;
+  }
+  free(upstreams);
+
+  if (route->count == 0) {
+    free(route->prefix);
+    return false;
+  }
+  NRoutes++;
+  return true;
+}
+
+/**
+ * Allocate upstream server counters.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The counters are placed in an anonymous shared mapping so that least
+ * connections balancing, turns, and failed servers are seen by every forked
+ * child.  Idle connections are per process.
+ **/
+int proxy_init(void) {
+  ProxyShared *shared;
+
+  if (!NRoutes) {
+    return 0;
+  }
+
+  shared = mmap(NULL, sizeof(ProxyShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    log("Unable to map upstream counters: %s", strerror(errno));
+    return -1;
+  }
+  for (size_t i = 0; i < NBackends; i++) {
+    Backends[i].metrics = &shared->backends[i];
+  }
+  for (size_t i = 0; i < NRoutes; i++) {
+    Routes[i].turn = &shared->turns[i];
+    for (size_t j = 0; j < Routes[i].count; j++) {
+      debug("Proxying %s to %s", Routes[i].prefix, Routes[i].backends[j].name);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Start probing upstream servers in the background.
+ *
+ * In forking mode the probes run in the parent; their results reach every
+ * child through the shared counters (see proxy_init).
+ **/
+void proxy_start(void) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+
+  if (!NRoutes) {
+    return;
+  }
+
+  /* Leave signals to the server loop, whose accept they must interrupt */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, proxy_probe_thread, NULL) != 0) {
+    log("Unable to start upstream health probes.");
+  }
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * Find route for URI.
+ *
+ * @param   uri         Normalized URI (see normalize_uri).
+ * @return  Route with the longest prefix matching the URI (or NULL if none).
+ *
+ * A prefix matches whole path segments: /api matches /api and /api/users but
+ * not /apis.
+ **/
+ProxyRoute * proxy_lookup(const char *uri) {
+  ProxyRoute *match = NULL;
+
+  for (size_t i = 0; i < NRoutes; i++) {
+    ProxyRoute *route = &Routes[i];
+    char next = uri[route->length];
+    if (strncmp(uri, route->prefix, route->length) == 0 &&
+        (next == '/' || next == '\0' || route->prefix[route->length - 1] == '/') &&
+        (!match || route->length > match->length)) {
+      match = route;
+    }
+  }
+  return match;
+}
+
+/**
+ * Handle proxy request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   route       Route matching request URI.
+ * @param   uri         Normalized URI of request (see normalize_uri).
+ * @return  Status of the HTTP proxy request.
+ *
+ * The request is sent to the upstream server of the route with the fewest
+ * requests in flight (see proxy_select).  A server that cannot be reached is
+ * marked as failed and the request goes to the next one (see
+ * proxy_exchange for when a request that reached a server may be sent on).
+ *
+ * Response bodies are moved by the worker that sent the request, which holds
+ * the upstream connection until the body ends, so they are not queued behind
+ * other responses by the output scheduler; they are held to the same
+ * bandwidth caps, though (see output_throttle).
+ *
+ * Chunked request bodies are not supported, so such requests are handled as
+ * HTTP_STATUS_BAD_REQUEST.  If no server responds, then handle error with
+ * HTTP_STATUS_BAD_GATEWAY.
+ **/
+HTTPStatus handle_proxy_request(Request *r, ProxyRoute *route, const char *uri) {
+  const char *value = request_header(r, "Content-Length");
+  HTTPStatus status = HTTP_STATUS_BAD_GATEWAY;
+  unsigned long tried = 0;
+  size_t body, buffered, hlength;
+  ProxyResult result;
+  Backend *b;
+  char *head;
+
+  if (request_header(r, "Transfer-Encoding")) {
+    log("Chunked request bodies are not supported.");
+    return HTTP_STATUS_BAD_REQUEST;
+  }
+  body     = value ? strtoull(value, NULL, 10) : 0;
+  buffered = r->bend - r->bstart < body ? r->bend - r->bstart : body;
+
+  if ((head = proxy_request_head(r, uri, &hlength)) == NULL) {
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  }
+
+  while (status == HTTP_STATUS_BAD_GATEWAY && (b = proxy_select(route, tried)) != NULL) {
+    tried |= 1UL << (b - route->backends);
+
+    __sync_fetch_and_add(&b->metrics->active, 1);
+    __sync_fetch_and_add(&b->metrics->requests, 1);
+    result = proxy_forward(r, b, head, hlength, body, buffered);
+    __sync_fetch_and_sub(&b->metrics->active, 1);
+
+    switch (result) {
+      case PROXY_DONE:
+        if (b->metrics->down_until) {
+          log("Upstream %s recovered", b->name);
+          b->metrics->down_until = 0;
+        }
+        status = HTTP_STATUS_OK;
+        break;
+      case PROXY_RETRY:
+        proxy_fail(b);
+        break;
+      case PROXY_FAILED:
+        proxy_fail(b);
+        goto done;
+      case PROXY_CLIENT_FAILED:
+        status = HTTP_STATUS_BAD_REQUEST;
+        break;
+    }
+  }
+
+done:
+  /* Body bytes in the read buffer belong to this request, not the next */
+  r->bstart += buffered;
+  free(head);
+  return status;
+}
+
+/**
+ * Log upstream server counters.
+ **/
+void proxy_dump_metrics(void) {
+  unsigned long long now = monotonic_ns();
+
+  for (size_t i = 0; i < NRoutes; i++) {
+    for (size_t j = 0; j < Routes[i].count; j++) {
+      Backend *b = &Routes[i].backends[j];
+      log("METRICS proxy route=%s upstream=%s healthy=%d active=%zu requests=%lu reused=%lu failures=%lu idle=%zu",
+          Routes[i].prefix, b->name, b->metrics->down_until <= now, b->metrics->active,
+          b->metrics->requests, b->metrics->reused, b->metrics->failures, b->nidle);
+    }
+  }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -4,11 +4,76 @@
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
+#include <arpa/inet.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define BUFFER_POOL_SIZE    256         /* Free read buffers kept for reuse */
+#define PROXY_V1_SIZE       108         /* Longest PROXY v1 line (with NUL) */
+#define PROXY_V2_SIGNATURE  "\r\n\r\n\0\r\nQUIT\n"
+#define PROXY_V2_HEADER     16          /* Signature, command, family, length */
+
+/* Global Variables */
+
+MemoryMetrics MemoryState = {0};
+
+static pthread_mutex_t BufferLock = PTHREAD_MUTEX_INITIALIZER;
+static char *BufferPool = NULL;         /* Free read buffers (linked through their first bytes) */
+
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
+static int parse_request_proxy(Request *r);
+
+/**
+ * Borrow read buffer of BUFSIZ bytes.
+ *
+ * @return  Read buffer (or NULL if none could be allocated).
+ *
+ * Buffers are lent out only while a request is arriving or being parsed, and
+ * returned once a connection goes idle, so idle connections hold none.
+ **/
+static char *buffer_borrow(void) {
+  char *buffer;
+
+  pthread_mutex_lock(&BufferLock);
+  if((buffer = BufferPool) != NULL){
+    BufferPool = *(char **)buffer;
+    MemoryState.pooled--;
+  }
+  pthread_mutex_unlock(&BufferLock);
+
+  if(!buffer && (buffer = malloc(BUFSIZ)) == NULL){
+    log("Could not allocate read buffer.");
+    return NULL;
+  }
+  __sync_fetch_and_add(&MemoryState.buffers, 1);
+  return buffer;
+}
+
+/**
+ * Return read buffer to the pool.
+ *
+ * @param   buffer      Read buffer.
+ *
+ * At most BUFFER_POOL_SIZE buffers are kept; the rest go back to malloc.
+ **/
+static void buffer_return(char *buffer) {
+  __sync_fetch_and_sub(&MemoryState.buffers, 1);
+
+  pthread_mutex_lock(&BufferLock);
+  if(MemoryState.pooled < BUFFER_POOL_SIZE){
+    *(char **)buffer = BufferPool;
+    BufferPool = buffer;
+    MemoryState.pooled++;
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&BufferLock);
+  free(buffer);
+}
 
 /**
  * Accept request from server socket.
@@ -21,43 +86,64 @@ int parse_request_headers(Request *r);
  *  1. Allocates a request struct initialized to 0.
  *  2. Initializes the headers list in the request struct.
  *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  4. Stores the client address in the request struct.
+ *  5. Returns the request struct.
+ *
+ * The read buffer is only borrowed once request bytes are read (see
+ * request_fill), so a connection that is accepted but idle costs just the
+ * request struct.
+ *
+ * The client socket is accepted with SOCK_CLOEXEC so that CGI scripts do not
+ * inherit (and hold open) other connections.  The client address is only
+ * formatted when request_host or request_port is called, which is never on
+ * the accept path (not even for debug output).  Responses are
+ * written straight to the socket with the response functions, and requests
+ * are read through the request's own buffer so that bytes of a pipelined
+ * request are never hidden in a stdio stream.
+ *
+ * If KeepAliveTimeout is set, it also bounds how long a read from the client
+ * may block, which is how idle persistent connections are timed out.
+ *
+ * If the listening socket speaks TLS, a TLS session is attached to the
+ * request; its handshake happens on the first read (see tls_read).
  *
  * The returned request struct must be deallocated using free_request.
  **/
-Request * accept_request(int sfd) {
+Request * accept_request(int sfd, bool tls) {
   Request *r;
-  struct sockaddr raddr;
-  socklen_t rlen;
   
   /* Allocate request struct (zeroed) */
-  rlen = sizeof(struct sockaddr);
   r = calloc(1, sizeof(Request));
   r->headers = NULL;
+  r->addrlen = sizeof(r->addr);
+  r->output  = -1;
   
   /* Accept a client */
-  int cfd = accept(sfd, &raddr, &rlen);
-  if(cfd < 0){
-    log("Accepting client connection failed.");
+  r->fd = accept4(sfd, (struct sockaddr *)&r->addr, &r->addrlen, SOCK_CLOEXEC);
+  if(r->fd < 0){
+    if(errno != EINTR){
+      log("Accepting client connection failed: %s", strerror(errno));
+    }
     goto fail;
   }
+  r->accepted = monotonic_ns();
+  trace(r, TRACE_ACCEPT);
+  __sync_fetch_and_add(&MemoryState.connections, 1);
   
-  /* Lookup client information */
-  if(getnameinfo(&raddr, sizeof(raddr), r->host, sizeof(r->host), r->port, sizeof(r->port), 0) != 0){
-    log("Could not look up client information.");
-    goto fail;
+  /* Bound reads from client */
+  if(KeepAliveTimeout > 0){
+    struct timeval timeout = { .tv_sec = KeepAliveTimeout };
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
   }
   
-  /* Open socket stream */
-  r->file = fdopen(cfd, "w+");
-  if(!r->file){
-    log("Could not open socket stream.");
+#ifdef TLS
+  if(tls && tls_start(r) < 0){
+    close(r->fd);
+    __sync_fetch_and_sub(&MemoryState.connections, 1);
     goto fail;
   }
+#endif
   
-  log("Accepted request from %s:%s", r->host, r->port);
   return r;
   
  fail:
@@ -73,7 +159,7 @@ Request * accept_request(int sfd) {
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the request socket.
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
@@ -84,25 +170,351 @@ void free_request(Request *r) {
     return;
   }
   
-  /* Close socket or fd */
-  fclose(r->file);
+  /* End TLS session and close socket */
+#ifdef TLS
+  tls_close(r);
+#endif
   close(r->fd);
+#ifdef TRACE
+  trace(r, TRACE_CLOSE);
+  trace_emit(r);
+#endif
+  
+  /* Free per-request state and return read buffer */
+  reset_request(r);
+  if (r->buffer) {
+    buffer_return(r->buffer);
+  }
+  
+  /* Free request */
+  __sync_fetch_and_sub(&MemoryState.connections, 1);
+  free(r);
   
+}
+
+/**
+ * Reset request struct for the next request on the same connection.
+ *
+ * @param   r           Request structure.
+ *
+ * This frees the strings and headers of the previous request, but keeps the
+ * client socket, address, and any buffered bytes of the next request.  If
+ * nothing of the next request has arrived yet, the read buffer is returned.
+ *
+ * The trace record is kept: it is emitted when the next request arrives (see
+ * trace_mark) or, with its close time, when the connection is freed.
+ **/
+void reset_request(Request *r) {
   /* Free allocated strings */
   free(r->method);
   free(r->uri);
   free(r->path);
   free(r->query);
+  r->method = r->uri = r->path = r->query = NULL;
   
   /* Free headers */
-  if(r->headers){
-    free(r->headers->next);
+  while(r->headers){
+    Header *next = r->headers->next;
+    free(r->headers->name);
+    free(r->headers->value);
     free(r->headers);
+    r->headers = next;
   }
   
-  /* Free request */
-  free(r);
+  /* Drop any unsent response */
+  output_cancel(r);
+  
+  /* Return read buffer while connection is idle */
+  if(r->buffer && r->bstart == r->bend){
+    buffer_return(r->buffer);
+    r->buffer = NULL;
+    r->bstart = r->bend = 0;
+  }
+  
+  r->vhost     = NULL;
+  r->keepalive = false;
+  r->accepted  = 0;
+}
+
+#ifdef TLS
+/**
+ * Read bytes of PROXY protocol header from socket of TLS connection.
+ *
+ * @param   r           Request structure.
+ * @return  Number of bytes read (0 on EOF, timeout, or error).
+ *
+ * The load balancer sends the header in the clear, before the handshake, so
+ * it is read from the socket itself rather than through the TLS session.
+ * Bytes are only peeked at and just those of the header are consumed, which
+ * leaves the ClientHello behind it for OpenSSL.  Until the header's kind is
+ * known, no more is consumed than the shortest header could hold.
+ **/
+static ssize_t request_fill_proxy(Request *r) {
+  const char *header = r->buffer + r->bstart;
+  char *peeked = r->buffer + r->bend;
+  size_t have = r->bend - r->bstart;
+  ssize_t npeek;
+  size_t want;
+
+  while((npeek = recv(r->fd, peeked, BUFSIZ - r->bend, MSG_PEEK)) < 0 && errno == EINTR);
+  if(npeek <= 0){
+    return 0;
+  }
+
+  if(have + npeek >= 5 && strncmp(header, "PROXY", 5) == 0){
+    /* Version 1 ends with its line */
+    char *newline = memchr(peeked, '\n', npeek);
+    want = newline ? (size_t)(newline - peeked) + 1 : (size_t)npeek;
+  }else if(have + npeek >= PROXY_V2_HEADER){
+    /* Version 2 gives its length (a bad signature is caught by the parser) */
+    if(have < PROXY_V2_HEADER){
+      want = PROXY_V2_HEADER - have;
+    }else{
+      size_t length = PROXY_V2_HEADER + (((unsigned char)header[14] << 8) | (unsigned char)header[15]);
+      want = length > have ? length - have : 0;
+    }
+  }else{
+    want = npeek;
+  }
+  if(want > (size_t)npeek){
+    want = npeek;
+  }
+  if(want == 0){
+    return 0;
+  }
+
+  while((npeek = read(r->fd, peeked, want)) < 0 && errno == EINTR);
+  return npeek;
+}
+#endif
+
+/**
+ * Read more bytes from client socket into request buffer.
+ *
+ * @param   r           Request structure.
+ * @return  Number of bytes read (0 on EOF, timeout, or error).
+ **/
+static ssize_t request_fill(Request *r) {
+  ssize_t nread;
+  
+  /* Borrow buffer for the bytes about to arrive */
+  if(!r->buffer && (r->buffer = buffer_borrow()) == NULL){
+    return 0;
+  }
+  
+  /* Move unparsed bytes to the front of the buffer */
+  if(r->bstart > 0){
+    memmove(r->buffer, r->buffer + r->bstart, r->bend - r->bstart);
+    r->bend  -= r->bstart;
+    r->bstart = 0;
+  }
+  if(r->bend == BUFSIZ){
+    return 0;
+  }
+  
+#ifdef TLS
+  if(r->ssl && ProxyProtocol && !r->proxied){
+    nread = request_fill_proxy(r);
+  }else if(r->ssl){
+    while((nread = tls_read(r, r->buffer + r->bend, BUFSIZ - r->bend)) < 0 && errno == EINTR);
+  }else
+#endif
+  while((nread = read(r->fd, r->buffer + r->bend, BUFSIZ - r->bend)) < 0 && errno == EINTR);
+  if(nread < 0){
+    debug("Could not read from socket: %s", strerror(errno));
+    return 0;
+  }
+  r->bend += nread;
+  return nread;
+}
+
+/**
+ * Read from client socket until request buffer holds enough bytes.
+ *
+ * @param   r           Request structure.
+ * @param   n           Number of unparsed bytes wanted (at most BUFSIZ).
+ * @return  true if n bytes are buffered, false otherwise.
+ **/
+static bool request_buffer(Request *r, size_t n) {
+  while(r->bend - r->bstart < n){
+    if(request_fill(r) == 0){
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Read line from request buffer.
+ *
+ * @param   r           Request structure.
+ * @param   line        Buffer to store line in.
+ * @param   size        Size of line buffer.
+ * @return  Length of line (or 0 if nothing could be read).
+ *
+ * Like fgets, the line keeps its trailing newline unless it is truncated.
+ * The newline is found with memchr, which glibc dispatches at load time to a
+ * vectorized (SSE2/AVX2/EVEX) implementation, and the length is returned so
+ * that callers never have to scan the line again to find its end.
+ **/
+static size_t request_readline(Request *r, char *line, size_t size) {
+  size_t length = 0;
+  
+  while(length + 1 < size){
+    if(r->bstart == r->bend && request_fill(r) == 0){
+      break;
+    }
+    
+    size_t available = r->bend - r->bstart;
+    size_t wanted    = size - 1 - length;
+    char  *newline   = memchr(r->buffer + r->bstart, '\n', available);
+    size_t n = newline ? (size_t)(newline - (r->buffer + r->bstart)) + 1 : available;
+    if(n > wanted){
+      n = wanted;
+    }
+    
+    memcpy(line + length, r->buffer + r->bstart, n);
+    r->bstart += n;
+    length    += n;
+    if(line[length - 1] == '\n'){
+      break;
+    }
+  }
+  
+  line[length] = '\0';
+  return length;
+}
+
+/**
+ * Wait for next request on connection.
+ *
+ * @param   r           Request structure.
+ * @return  true if request bytes are available, false if the client closed
+ * the connection (or it timed out).
+ **/
+bool request_wait(Request *r) {
+  if(r->bstart == r->bend && request_fill(r) == 0){
+    return false;
+  }
   
+  if(!r->accepted){
+    r->accepted = monotonic_ns();
+    trace(r, TRACE_ACCEPT);
+  }
+  trace(r, TRACE_FIRST_BYTE);
+  return true;
+}
+
+/**
+ * Check whether bytes of the next request are already buffered.
+ *
+ * @param   r           Request structure.
+ * @return  Whether the next read would not have to wait for the client.
+ *
+ * Besides the read buffer, a TLS session may hold decrypted bytes that the
+ * socket will never signal again.
+ **/
+bool request_pending(Request *r) {
+#ifdef TLS
+  if(tls_pending(r)){
+    return true;
+  }
+#endif
+  return r->bstart < r->bend;
+}
+
+/**
+ * Format client address of request.
+ *
+ * @param   r           Request structure.
+ * @param   host        Buffer of INET6_ADDRSTRLEN bytes for numeric host.
+ * @param   port        Buffer of NI_MAXSERV bytes for numeric port.
+ *
+ * The address is formatted numerically (NI_NUMERICHOST | NI_NUMERICSERV) so
+ * that no reverse DNS lookup is ever performed.  Clients on a Unix socket
+ * (that did not send a PROXY header) are reported as host "unix", port 0.
+ **/
+static void request_format_address(Request *r, char *host, char *port) {
+  if(r->addr.ss_family == AF_UNIX){
+    strcpy(host, "unix");
+    strcpy(port, "0");
+  }else if(getnameinfo((struct sockaddr *)&r->addr, r->addrlen, host, INET6_ADDRSTRLEN,
+                 port, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) != 0){
+    log("Could not format client address.");
+    strcpy(host, "unknown");
+    strcpy(port, "0");
+  }
+}
+
+/**
+ * Return host (numeric address) of client.
+ *
+ * @param   r           Request structure.
+ * @return  Numeric host string of client.
+ *
+ * The address is only formatted when needed (for logging and CGI), into a
+ * per-thread buffer that is valid until the next call from the same thread,
+ * so connections do not each carry a formatted copy.
+ **/
+const char * request_host(Request *r) {
+  static __thread char host[INET6_ADDRSTRLEN];
+  char port[NI_MAXSERV];
+
+  request_format_address(r, host, port);
+  return host;
+}
+
+/**
+ * Return port of client.
+ *
+ * @param   r           Request structure.
+ * @return  Numeric port string of client (see request_host).
+ **/
+const char * request_port(Request *r) {
+  static __thread char port[NI_MAXSERV];
+  char host[INET6_ADDRSTRLEN];
+
+  request_format_address(r, host, port);
+  return port;
+}
+
+/**
+ * Log connection memory counters.
+ *
+ * An idle connection holds only its request struct; a connection with a
+ * request in flight also holds a read buffer.  Pooled buffers are counted in
+ * the total but not against any connection.  In forking mode the counters
+ * only cover the process handling the signal.
+ **/
+void request_dump_metrics(void) {
+  size_t connections = MemoryState.connections;
+  size_t buffers     = MemoryState.buffers;
+  size_t pooled      = MemoryState.pooled;
+  size_t used        = connections * sizeof(Request) + buffers * BUFSIZ;
+
+  log("METRICS memory connections=%zu buffers=%zu pooled=%zu idle_connection=%zu per_connection=%zu total=%zu",
+      connections, buffers, pooled, sizeof(Request), connections ? used / connections : 0,
+      used + pooled * BUFSIZ);
+}
+
+/**
+ * Determine whether connection may switch to HTTP/2.
+ *
+ * @param   r           Request structure.
+ * @return  true if the connection may switch, false otherwise.
+ *
+ * Only cleartext connections switch (h2c); a TLS listener would have to offer
+ * h2 through ALPN instead.  An HTTP/2 connection is served by one thread for
+ * as long as it is open, so it needs KeepAliveTimeout to bound how long it
+ * may sit idle (which also keeps single mode to HTTP/1).
+ **/
+static bool request_h2c(Request *r) {
+#ifdef TLS
+  if(r->ssl){
+    return false;
+  }
+#endif
+  return KeepAliveTimeout > 0;
 }
 
 /**
@@ -111,25 +523,95 @@ void free_request(Request *r) {
  * @param   r           Request structure.
  * @return  -1 on error and 0 on success.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This function first parses the PROXY protocol header (on the first request
+ * of a connection if ProxyProtocol is set), the request method, any query,
+ * and then the headers, returning 0 on success, and -1 on error.  It also decides whether
+ * the connection is kept open for another request (see r->keepalive), or
+ * switches to HTTP/2 (see r->h2c): either because it opened with the HTTP/2
+ * preface, whose request line stops parsing, or because the request asked to
+ * upgrade to h2c.
  **/
 int parse_request(Request *r) {
+  r->keepalive = false;
+  
+  /* Parse PROXY protocol header (once, before the first request) */
+  if(ProxyProtocol && !r->proxied){
+    if(parse_request_proxy(r) < 0){
+      log("Could not parse PROXY protocol header.");
+      return -1;
+    }
+    r->proxied = true;
+  }
+  
   /* Parse HTTP Request Method */
   if(parse_request_method(r) < 0){
     log( "Could not parse request headers method.");
     return -1;
   }
+  trace(r, TRACE_REQUEST_LINE);
+  
+  /* HTTP/2 with prior knowledge (h2_serve reads the rest of the preface) */
+  if(streq(r->method, "PRI") && streq(r->uri, "*")){
+    if(!request_h2c(r)){
+      log("HTTP/2 is not available on this connection.");
+      return -1;
+    }
+    r->h2c = true;
+    return 0;
+  }
   
   /* Parse HTTP Requet Headers*/
   if(parse_request_headers(r) < 0){
     log("Could not parse HTTP Request Headers.");
     return -1;
   }
+  trace(r, TRACE_HEADERS);
+
+  /* Keep connection open if HTTP/1.1 (unless closed) or HTTP/1.0 keep-alive */
+  const char *connection = request_header(r, "Connection");
+  if(connection && strcasestr(connection, "close")){
+    r->keepalive = false;
+  }else if(connection && strcasestr(connection, "keep-alive")){
+    r->keepalive = true;
+  }
+  
+  /* Request bodies are never read, so they would be parsed as the next request */
+  const char *length = request_header(r, "Content-Length");
+  if((length && strtoul(length, NULL, 10) > 0) || request_header(r, "Transfer-Encoding")){
+    r->keepalive = false;
+  }
+  
+  if(KeepAliveTimeout <= 0 || ++r->nrequests >= KeepAliveRequests){
+    r->keepalive = false;
+  }
+  
+  /* Switch to HTTP/2 if asked to (the request becomes its first stream) */
+  const char *upgrade = request_header(r, "Upgrade");
+  if(upgrade && strcasestr(upgrade, "h2c") && request_header(r, "HTTP2-Settings") &&
+     !(length && strtoul(length, NULL, 10) > 0) && !request_header(r, "Transfer-Encoding") &&
+     request_h2c(r)){
+    r->h2c = true;
+  }
 
   return 0;
 }
 
+/**
+ * Lookup value of HTTP Request Header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Name of header (case-insensitive).
+ * @return  Value of header (or NULL if not present).
+ **/
+const char * request_header(Request *r, const char *name) {
+  for (Header *header = r->headers; header != NULL; header = header->next) {
+    if (strcasecmp(header->name, name) == 0) {
+      return header->value;
+    }
+  }
+  return NULL;
+}
+
 /**
  * Parse HTTP Request Method and URI.
  *
@@ -145,40 +627,40 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, and query (if it exists), and
+ * defaults r->keepalive to whether the version is HTTP/1.1.
  **/
 int parse_request_method(Request *r) {
   char buffer[BUFSIZ];
   char *method;
   char *uri;
   char *query;
-  const char* delim = " \t\n";
+  char *version;
+  const char* delim = " \t\r\n";
+  char *save = NULL;
+  
   /* Read line from socket */
-  if(fgets(buffer,BUFSIZ,r->file) == NULL){
+  if(request_readline(r, buffer, BUFSIZ) == 0){
     log("Could not read from socket.");
     goto fail;
   }
   
   /* Parse method and uri */
-  skip_whitespace(buffer);
-  
-  if((method = strtok(buffer, delim)) == NULL){
+  if((method = strtok_r(buffer, delim, &save)) == NULL){
     log("Could not parse method.");
     goto fail;
   }
-  if((uri = strtok(NULL, delim)) == NULL){
+  if((uri = strtok_r(NULL, delim, &save)) == NULL){
     log("Could not parse uri.");
     goto fail;
   }
+  version = strtok_r(NULL, delim, &save);
+  r->keepalive = version && streq(version, "HTTP/1.1");
   
   /* Parse query from uri */
-  char *temp  = strchr(uri, '?');
-  if (temp != NULL){
-    temp++;
-    int difference = strlen(uri) - strlen(temp);
-    *(uri + difference - 1) = '\0';
+  if((query = strchr(uri, '?')) != NULL){
+    *query++ = '\0';
   }
-  query = temp;
   
   /* Record method, uri, and query in request struct */
   r->method = strdup(method);
@@ -226,8 +708,8 @@ fail:
 int parse_request_headers(Request *r) {
   struct header *curr = NULL;
   char buffer[BUFSIZ];
-  char *name;
   char *value;
+  size_t length;
   
   /* Parse headers from socket */
   char *temp; // temporary char to split the buffer
@@ -235,29 +717,29 @@ int parse_request_headers(Request *r) {
   /* Parse headers from socket */
   r->headers = curr;
   
-  while(fgets(buffer, BUFSIZ, r->file)){
-    if((strcmp(buffer, "\n")) == 0 || (strcmp(buffer, "\r\n")) == 0){
+  while((length = request_readline(r, buffer, BUFSIZ)) > 0){
+    /* Strip line ending (the end of headers is an empty line) */
+    while(length > 0 && (buffer[length - 1] == '\n' || buffer[length - 1] == '\r')){
+      length--;
+    }
+    if(length == 0){
       log("Reached end of headers.");
       break;
     }
-    chomp(buffer);
-    if((temp = strchr(buffer, ':')) == NULL){
+    if((temp = memchr(buffer, ':', length)) == NULL){
       log("Not a valid header format.");
       goto fail;
     }
     // split buffer at the position of the colon
-    *temp = '\0';
-    name = buffer; // get just the name
-    value = skip_whitespace(temp + 1); // goes to space after colon
+    value = temp + 1 + strspn(temp + 1, " \t"); // goes to space after colon
     
-    //value = temp;
     if((curr = calloc(1, sizeof(struct header))) == NULL){
       log("Could not allocate memory for header.");
       goto fail;
     }
     // set headers in the request struct
-    curr->name = strdup(name); 
-    curr->value = strdup(value);
+    curr->name  = strndup(buffer, temp - buffer);
+    curr->value = strndup(value, buffer + length - value);
     
     
     curr->next = r->headers;
@@ -276,4 +758,96 @@ int parse_request_headers(Request *r) {
  fail:
   return -1;
 }
+
+/**
+ * Parse PROXY protocol header sent by a load balancer.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Both versions of the header are accepted:
+ *
+ *  v1: PROXY TCP4|TCP6|UNKNOWN <src> <dst> <sport> <dport>\r\n
+ *  v2: <12 byte signature> <version/command> <family> <length> <addresses>
+ *
+ * The source address in the header replaces the address of the connection,
+ * so logs, virtual host metrics, and CGI see the real client.  On a TLS
+ * connection the header precedes the handshake (see request_fill_proxy).  A v1 UNKNOWN
+ * or v2 LOCAL header (health checks from the balancer itself) keeps the
+ * connection's own address, as does a v2 header for another family.
+ **/
+static int parse_request_proxy(Request *r) {
+  struct sockaddr_in  *in  = (struct sockaddr_in *)&r->addr;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&r->addr;
+
+  if(!request_buffer(r, 5)){
+    return -1;
+  }
+
+  /* Version 1: text line */
+  if(strncmp(r->buffer + r->bstart, "PROXY", 5) == 0){
+    char line[PROXY_V1_SIZE];
+    char protocol[8], src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    unsigned sport, dport;
+
+    size_t length = request_readline(r, line, sizeof(line));
+    if(length < 2 || line[length - 2] != '\r' || line[length - 1] != '\n'){
+      return -1;
+    }
+    if(strncmp(line, "PROXY UNKNOWN", 13) == 0){
+      return 0;
+    }
+    if(sscanf(line, "PROXY %7s %45s %45s %u %u", protocol, src, dst, &sport, &dport) != 5 || sport > 65535){
+      return -1;
+    }
+
+    memset(&r->addr, 0, sizeof(r->addr));
+    if(streq(protocol, "TCP4") && inet_pton(AF_INET, src, &in->sin_addr) == 1){
+      in->sin_family = AF_INET;
+      in->sin_port   = htons(sport);
+      r->addrlen     = sizeof(*in);
+    }else if(streq(protocol, "TCP6") && inet_pton(AF_INET6, src, &in6->sin6_addr) == 1){
+      in6->sin6_family = AF_INET6;
+      in6->sin6_port   = htons(sport);
+      r->addrlen       = sizeof(*in6);
+    }else{
+      return -1;
+    }
+    return 0;
+  }
+
+  /* Version 2: binary header */
+  if(!request_buffer(r, PROXY_V2_HEADER)){
+    return -1;
+  }
+  unsigned char *header = (unsigned char *)r->buffer + r->bstart;
+  size_t length = (header[14] << 8) | header[15];
+  if(memcmp(header, PROXY_V2_SIGNATURE, 12) != 0 || (header[12] & 0xF0) != 0x20 ||
+     length > BUFSIZ - PROXY_V2_HEADER || !request_buffer(r, PROXY_V2_HEADER + length)){
+    return -1;
+  }
+  header = (unsigned char *)r->buffer + r->bstart;
+  r->bstart += PROXY_V2_HEADER + length;
+
+  /* Command 1 is PROXY; family 0x11 is TCP over IPv4 and 0x21 TCP over IPv6 */
+  unsigned char *addresses = header + PROXY_V2_HEADER;
+  if((header[12] & 0x0F) != 1){
+    return 0;
+  }
+  if(header[13] == 0x11 && length >= 12){
+    memset(&r->addr, 0, sizeof(r->addr));
+    in->sin_family = AF_INET;
+    memcpy(&in->sin_addr, addresses, 4);
+    memcpy(&in->sin_port, addresses + 8, 2);
+    r->addrlen = sizeof(*in);
+  }else if(header[13] == 0x21 && length >= 36){
+    memset(&r->addr, 0, sizeof(r->addr));
+    in6->sin6_family = AF_INET6;
+    memcpy(&in6->sin6_addr, addresses, 16);
+    memcpy(&in6->sin6_port, addresses + 32, 2);
+    r->addrlen = sizeof(*in6);
+  }
+  return 0;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,218 @@
+/* response.c: HTTP Response Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define FRAGMENT(s)     { s, sizeof(s) - 1 }
+#define STATUS_MINOR    7               /* Offset of minor version in status line */
+
+typedef struct {
+    const char  *data;                  /*< Constant header fragment */
+    size_t      length;                 /*< Length of fragment */
+} Fragment;
+
+static const Fragment StatusLines[HTTP_STATUS_COUNT] = {
+    [HTTP_STATUS_OK]                    = FRAGMENT("HTTP/1.0 200 OK\r\n"),
+    [HTTP_STATUS_BAD_REQUEST]           = FRAGMENT("HTTP/1.0 400 Bad Request\r\n"),
+    [HTTP_STATUS_NOT_FOUND]             = FRAGMENT("HTTP/1.0 404 Not Found\r\n"),
+    [HTTP_STATUS_INTERNAL_SERVER_ERROR] = FRAGMENT("HTTP/1.0 500 Internal Server Error\r\n"),
+    [HTTP_STATUS_BAD_GATEWAY]           = FRAGMENT("HTTP/1.0 502 Bad Gateway\r\n"),
+    [HTTP_STATUS_SERVICE_UNAVAILABLE]   = FRAGMENT("HTTP/1.0 503 Service Unavailable\r\n"),
+};
+
+static const Fragment ServerHeader = FRAGMENT("Server: spidey\r\n");
+
+/* Internal Functions */
+
+/**
+ * Append bytes to response header.
+ *
+ * @param   res         Response structure.
+ * @param   data        Bytes to append.
+ * @param   length      Number of bytes to append.
+ *
+ * Anything that does not fit in the header buffer is dropped and the response
+ * is marked as truncated.
+ **/
+static void response_append(Response *res, const char *data, size_t length) {
+  if (res->length + length > sizeof(res->header)) {
+    res->truncated = true;
+    return;
+  }
+  memcpy(res->header + res->length, data, length);
+  res->length += length;
+}
+
+/**
+ * Append Date header, formatting it at most once per second per thread.
+ *
+ * @param   res         Response structure.
+ **/
+static void response_append_date(Response *res) {
+  static __thread time_t cached = 0;
+  static __thread char   date[64];
+  static __thread size_t length = 0;
+  time_t now = time(NULL);
+
+  if (now != cached) {
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    length = strftime(date, sizeof(date), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    cached = now;
+  }
+
+  response_append(res, date, length);
+}
+
+/**
+ * Write all of the io vectors to request socket.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   iov         Array of io vectors (modified).
+ * @param   iovcnt      Number of io vectors.
+ * @return  -1 on error and 0 on success.
+ *
+ * On a TLS connection the vectors are encrypted by tls_writev, and on an
+ * HTTP/2 stream they are framed by h2_writev.
+ **/
+static int write_all(Request *r, struct iovec *iov, int iovcnt) {
+  trace(r, TRACE_FIRST_RESPONSE);
+  while (iovcnt > 0) {
+    ssize_t nwritten;
+    if (r->stream) {
+      nwritten = h2_writev(r, iov, iovcnt);
+    } else
+#ifdef TLS
+    if (r->ssl) {
+      nwritten = tls_writev(r, iov, iovcnt);
+    } else
+#endif
+    nwritten = writev(r->fd, iov, iovcnt);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    /* Skip past fully written vectors and advance into a partial one */
+    while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+      nwritten -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + nwritten;
+      iov->iov_len -= nwritten;
+    }
+  }
+  trace(r, TRACE_LAST_BYTE);
+  return 0;
+}
+
+/* External Functions */
+
+/**
+ * Start HTTP response.
+ *
+ * @param   res         Response structure.
+ * @param   status      HTTP Status of response.
+ * @param   type        Content-Type of response body.
+ *
+ * This copies the precomputed status line, the Server header, and the cached
+ * Date header into the response buffer, followed by the Content-Type.
+ **/
+void response_start(Response *res, HTTPStatus status, const char *type) {
+  res->length    = 0;
+  res->truncated = false;
+
+  response_append(res, StatusLines[status].data, StatusLines[status].length);
+  response_append(res, ServerHeader.data, ServerHeader.length);
+  response_append_date(res);
+  response_header(res, "Content-Type", type);
+}
+
+/**
+ * Add header to HTTP response.
+ *
+ * @param   res         Response structure.
+ * @param   name        Name of header.
+ * @param   value       Value of header.
+ **/
+void response_header(Response *res, const char *name, const char *value) {
+  size_t nlength = strlen(name);
+  size_t vlength = strlen(value);
+
+  response_append(res, name, nlength);
+  response_append(res, ": ", 2);
+  response_append(res, value, vlength);
+  response_append(res, "\r\n", 2);
+}
+
+/**
+ * Send HTTP response headers and first body segment.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   res         Response structure.
+ * @param   length      Total length of body (or -1 if unknown).
+ * @param   body        First segment of body (may be NULL).
+ * @param   nbody       Length of first segment of body.
+ * @return  -1 on error and 0 on success.
+ *
+ * The headers and body segment are flushed with a single writev, so a
+ * response whose whole body is passed here leaves in one system call.
+ *
+ * The Connection header tells the client whether it may send another request
+ * on the connection; that requires the length of the body to be known.  A
+ * persistent connection is answered as HTTP/1.1 (the status lines are
+ * HTTP/1.0, which is what a connection that closes after the body needs).
+ **/
+int response_send(Request *r, Response *res, off_t length, const void *body, size_t nbody) {
+  char content_length[32];
+
+  if (length >= 0) {
+    snprintf(content_length, sizeof(content_length), "%lld", (long long)length);
+    response_header(res, "Content-Length", content_length);
+  } else {
+    r->keepalive = false;
+  }
+  response_header(res, "Connection", r->keepalive ? "keep-alive" : "close");
+  response_append(res, "\r\n", 2);
+  if (r->keepalive) {
+    res->header[STATUS_MINOR] = '1';
+  }
+
+  if (res->truncated) {
+    log("Response headers too large.");
+    return -1;
+  }
+
+  struct iovec iov[] = {
+    { res->header, res->length },
+    { (void *)body, nbody },
+  };
+  return write_all(r, iov, nbody ? 2 : 1);
+}
+
+/**
+ * Write bytes directly to request socket.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   data        Bytes to write.
+ * @param   length      Number of bytes to write.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_write(Request *r, const void *data, size_t length) {
+  struct iovec iov = { (void *)data, length };
+  return write_all(r, &iov, 1);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -10,25 +10,42 @@
 /**
  * Handle one HTTP request at a time.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Listening sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The loop ends when handle_signals reports that a new binary has taken over
+ * the server sockets.  Since requests are handled inline, there is nothing left
+ * in flight to drain at that point.
+ *
+ * Persistent connections are disabled in this mode (see main), since an idle
+ * client would keep every other client waiting.
  **/
-int single_server(int sfd) {
+int single_server(ListenerSet *listeners) {
+  /* Pin to first CPU in affinity list */
+  affinity_pin(affinity_cpu(0));
+  
   /* Accept and handle HTTP request */
-  while (true) {
+  while (handle_signals(listeners)) {
     Request * r;
+    int i;
     /* Accept request */
-    r = accept_request(sfd);
+    if((i = socket_wait(listeners)) < 0){
+      continue;
+    }
+    r = accept_request(listeners->fds[i], listeners->tls[i]);
+    if(!r){
+      continue;
+    }
     /* Handle request */
-    if(handle_request(r) != HTTP_STATUS_OK){
+    if(handle_connection(r) != HTTP_STATUS_OK){
       log("Unable to handle request.");
     }
     /* Free request */
     free_request(r);
   }
   
-    /* Close server socket */
-  close(sfd);
+    /* Close server sockets */
+  socket_close(listeners);
   return EXIT_SUCCESS;
 }
 
@@ -7,16 +7,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /**
  * Allocate socket, bind it, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * @return  Allocated server socket file descriptor (or -1 on error).
  **/
 int socket_listen(const char *port) {
   /* Lookup server address information */
@@ -30,30 +34,43 @@ int socket_listen(const char *port) {
   int status;
   if((status = getaddrinfo(NULL,port,&hints,&results))!= 0){
     log("getaddrinfo failed.");
-    return EXIT_FAILURE;
+    return -1;
   }
   
   /* For each server entry, allocate socket and try to connect */
   int socket_fd = -1;
   for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
     /* Allocate socket */
-    if((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) <0) {
+    if((socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) <0) {
       log("Unable to make socket.");
       continue;
     }
     
+    /* Allow rebinding while old connections are in TIME_WAIT */
+    int on = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    
+    /* Only wake accept once the client has sent data */
+#ifdef TCP_DEFER_ACCEPT
+    if(DeferAccept > 0 && setsockopt(socket_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &DeferAccept, sizeof(DeferAccept)) < 0){
+      log("Unable to set TCP_DEFER_ACCEPT: %s", strerror(errno));
+    }
+#endif
+    
     /* Bind socket */
     if(bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0){
       log("Unable to bind.");
       close(socket_fd);
-      return EXIT_FAILURE;
+      freeaddrinfo(results);
+      return -1;
     }
     
     /* Listen to socket */
     if(listen(socket_fd, SOMAXCONN) < 0) {
       log("Unable to listen.");
       close(socket_fd);
-      return EXIT_FAILURE;
+      freeaddrinfo(results);
+      return -1;
     }
   }
   
@@ -62,4 +79,140 @@ int socket_listen(const char *port) {
   return socket_fd;
 }
 
+/**
+ * Allocate Unix domain socket, bind it to path, and listen on it.
+ *
+ * @param   path        Path of socket.
+ * @return  Allocated server socket file descriptor (or -1 on error).
+ *
+ * A stale socket left at path by a previous server is removed first.  The
+ * socket is not removed on exit, since after a binary upgrade the new server
+ * is still listening on it.
+ **/
+int socket_listen_unix(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct stat st;
+  int socket_fd;
+  
+  if(strlen(path) >= sizeof(addr.sun_path)){
+    log("Unix socket path too long: %s", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  
+  /* Remove stale socket */
+  if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)){
+    unlink(path);
+  }
+  
+  if((socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0){
+    log("Unable to make socket.");
+    return -1;
+  }
+  if(bind(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+    log("Unable to bind %s: %s", path, strerror(errno));
+    close(socket_fd);
+    return -1;
+  }
+  if(listen(socket_fd, SOMAXCONN) < 0){
+    log("Unable to listen.");
+    close(socket_fd);
+    return -1;
+  }
+  return socket_fd;
+}
+
+/**
+ * Take over listening sockets of a previous server.
+ *
+ * @param   listeners   ListenerSet to add inherited sockets to.
+ * @return  Number of sockets inherited.
+ *
+ * A previous spidey performing a binary upgrade passes its listening sockets
+ * as a comma-separated list in the LISTEN_FD_ENV environment variable.  A
+ * socket that speaks TLS has a 't' after its number; a binary built without
+ * TLS closes such sockets rather than serve plain HTTP on them.
+ **/
+size_t socket_inherit(ListenerSet *listeners) {
+  char *inherited = getenv(LISTEN_FD_ENV);
+  char *save = NULL;
+  
+  if(!inherited){
+    return 0;
+  }
+  
+  inherited = strdup(inherited);
+  unsetenv(LISTEN_FD_ENV);
+  for(char *fd = strtok_r(inherited, ",", &save); fd && listeners->count < MAX_LISTENERS; fd = strtok_r(NULL, ",", &save)){
+    char *suffix;
+    int socket_fd = strtol(fd, &suffix, 10);
+    bool tls = *suffix == 't';
+    int listening = 0;
+    socklen_t length = sizeof(listening);
+#ifndef TLS
+    if(tls){
+      log("Closing inherited TLS socket %d (built without TLS).", socket_fd);
+      close(socket_fd);
+      continue;
+    }
+#endif
+    if(getsockopt(socket_fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == 0 && listening){
+      log("Inherited listening %ssocket %d.", tls ? "TLS " : "", socket_fd);
+      fcntl(socket_fd, F_SETFD, FD_CLOEXEC);
+      listeners->tls[listeners->count]   = tls;
+      listeners->fds[listeners->count++] = socket_fd;
+    }else{
+      log("Inherited socket %s is not listening.", fd);
+    }
+  }
+  free(inherited);
+  return listeners->count;
+}
+
+/**
+ * Wait until a listening socket has a connection to accept.
+ *
+ * @param   listeners   ListenerSet structure.
+ * @return  Index of listening socket to accept from (or -1 if interrupted).
+ *
+ * With a single listener this returns immediately and accept does the
+ * waiting.  Otherwise ready listeners are taken in turn, so a busy listener
+ * cannot starve the others.
+ **/
+int socket_wait(ListenerSet *listeners) {
+  struct pollfd pfds[MAX_LISTENERS];
+  
+  if(listeners->count == 1){
+    return 0;
+  }
+  
+  for(size_t i = 0; i < listeners->count; i++){
+    pfds[i].fd     = listeners->fds[i];
+    pfds[i].events = POLLIN;
+  }
+  if(poll(pfds, listeners->count, -1) <= 0){
+    return -1;
+  }
+  
+  for(size_t i = 0; i < listeners->count; i++){
+    size_t n = (listeners->next + i) % listeners->count;
+    if(pfds[n].revents){
+      listeners->next = n + 1;
+      return n;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Close all listening sockets.
+ *
+ * @param   listeners   ListenerSet structure.
+ **/
+void socket_close(ListenerSet *listeners) {
+  for(size_t i = 0; i < listeners->count; i++){
+    close(listeners->fds[i]);
+  }
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
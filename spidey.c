@@ -3,9 +3,12 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
 /* Global Variables */
@@ -13,6 +16,29 @@ char *Port	      = "9898";
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
+char *VirtualHostsPath = NULL;
+int  DeferAccept      = 0;
+bool ProxyProtocol    = false;
+size_t Workers        = 16;
+int  KeepAliveTimeout = 5;
+size_t KeepAliveRequests = 100;
+
+char **Arguments      = NULL;
+static char *Executable = NULL;         /* Path to exec on upgrade */
+
+static char  *UnixPaths[MAX_LISTENERS]; /* Unix sockets to listen on */
+static size_t NUnixPaths = 0;
+static bool   PortGiven  = false;       /* Whether -p was given */
+
+volatile sig_atomic_t DumpMetrics   = 0;
+volatile sig_atomic_t ReloadConfig  = 0;
+volatile sig_atomic_t UpgradeBinary = 0;
+volatile sig_atomic_t StopServer    = 0;
+
+unsigned long ActiveRequests = 0;
+
+MimeTypeTable    *RetiredMimeTypes    = NULL;
+VirtualHostTable *RetiredVirtualHosts = NULL;
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +47,40 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-  fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+  fprintf(stderr, "Usage: %s [haAbBcCdEGHkKmMpPQrsStuvwWx]\n", progname);
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "    -h            Display help message\n");
-  fprintf(stderr, "    -c mode       Single or Forking mode\n");
+  fprintf(stderr, "    -a cpus       Pin workers to CPU list (ie. 0,2-3) or auto\n");
+  fprintf(stderr, "    -A path       Warm caches from access log (Common Log Format)\n");
+  fprintf(stderr, "    -b rate       Limit each connection to rate bytes per second\n");
+  fprintf(stderr, "    -B rate       Limit server to rate bytes per second\n");
+  fprintf(stderr, "    -c mode       Single, Forking, or Threaded mode\n");
+  fprintf(stderr, "    -C limit      Maximum concurrent connections\n");
+  fprintf(stderr, "    -d seconds    Defer accept until request data arrives\n");
+  fprintf(stderr, "    -G limit      Maximum concurrent CGI processes\n");
+  fprintf(stderr, "    -H limit      Maximum concurrent HTTP/2 streams (default 256)\n");
+  fprintf(stderr, "    -k seconds    Keep idle connections open (0 disables)\n");
   fprintf(stderr, "    -m path       Path to mimetypes file\n");
   fprintf(stderr, "    -M mimetype   Default mimetype\n");
   fprintf(stderr, "    -p port       Port to listen on\n");
+  fprintf(stderr, "    -P            Expect PROXY protocol header on connections\n");
+  fprintf(stderr, "    -Q ms         Shed requests queued past target delay\n");
   fprintf(stderr, "    -r path       Root directory\n");
+  fprintf(stderr, "    -S bytes      Size of file cache (0 disables)\n");
+#ifdef TLS
+  fprintf(stderr, "    -s port       Port to listen on for TLS\n");
+  fprintf(stderr, "    -E path       Path to TLS certificate chain (PEM)\n");
+  fprintf(stderr, "    -K path       Path to TLS private key (PEM, default is -E)\n");
+#endif
+  fprintf(stderr, "    -t seconds    Cache CGI output of GET requests\n");
+  fprintf(stderr, "    -u path       Listen on Unix socket (TCP too only if -p is given)\n");
+#ifdef TRACE
+  fprintf(stderr, "    -T path       Path to request trace file\n");
+#endif
+  fprintf(stderr, "    -v path       Path to virtual hosts file\n");
+  fprintf(stderr, "    -w workers    Number of threads in Threaded mode\n");
+  fprintf(stderr, "    -W path       Warm caches from hot set (saved there on exit)\n");
+  fprintf(stderr, "    -x route      Proxy URI prefix to upstreams (ie. /api=host:port,unix:/path)\n");
   exit(status);
 }
 
@@ -40,8 +92,12 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, AffinitySet, CacheSize, CGICacheTTL,
+ * ConnectionRate, DeferAccept, KeepAliveTimeout, MaxConnections, MaxCGI,
+ * MaxStreams, MimeTypesPath, DefaultMimeType, OutputRate, Port,
+ * ProxyProtocol, QueueTarget, RootPath, TLSCertificatePath, TLSKeyPath,
+ * TLSPort, UnixPaths, VirtualHostsPath, WarmupLogPath, WarmupPath, Workers,
+ * and proxy routes if specified.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
   int argind = 1;    
@@ -51,16 +107,50 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
     case 'h':
       usage(argv[0], 0);
       break;
+    case 'a':
+      if(!affinity_parse(argv[argind++])){
+        return false;
+      }
+      break;
+    case 'A':
+      WarmupLogPath = argv[argind++];
+      break;
+    case 'b':
+      ConnectionRate = strtoul(argv[argind++], NULL, 10);
+      break;
+    case 'B':
+      OutputRate = strtoul(argv[argind++], NULL, 10);
+      break;
     case 'c':
       if(strcmp(argv[argind], "forking") == 0){
 	*mode = FORKING; 
       }else if(strcmp(argv[argind], "single") == 0){
 	*mode = SINGLE;
+      }else if(strcmp(argv[argind], "threaded") == 0){
+	*mode = THREADED;
       }else{
 	*mode = UNKNOWN;
       }
       argind++;
       break;
+    case 'C':
+      MaxConnections = strtoul(argv[argind++], NULL, 10);
+      break;
+    case 'd':
+      DeferAccept = atoi(argv[argind++]);
+      break;
+    case 'G':
+      MaxCGI = strtoul(argv[argind++], NULL, 10);
+      break;
+    case 'H':
+      MaxStreams = strtoul(argv[argind++], NULL, 10);
+      break;
+    case 'k':
+      KeepAliveTimeout = atoi(argv[argind++]);
+      break;
+    case 'Q':
+      QueueTarget = strtoul(argv[argind++], NULL, 10);
+      break;
     case 'm':
       MimeTypesPath = argv[argind++];
       break;
@@ -69,10 +159,58 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
       break;
     case 'p':
       Port = argv[argind++];
+      PortGiven = true;
+      break;
+    case 'P':
+      ProxyProtocol = true;
       break;
     case 'r':
       RootPath = argv[argind++];
       break;
+    case 'S':
+      CacheSize = strtoul(argv[argind++], NULL, 10);
+      break;
+    case 't':
+      CGICacheTTL = strtoul(argv[argind++], NULL, 10);
+      break;
+#ifdef TLS
+    case 's':
+      TLSPort = argv[argind++];
+      break;
+    case 'E':
+      TLSCertificatePath = argv[argind++];
+      break;
+    case 'K':
+      TLSKeyPath = argv[argind++];
+      break;
+#endif
+#ifdef TRACE
+    case 'T':
+      TracePath = argv[argind++];
+      break;
+#endif
+    case 'u':
+      if(NUnixPaths == MAX_LISTENERS - 2){
+        return false;
+      }
+      UnixPaths[NUnixPaths++] = argv[argind++];
+      break;
+    case 'v':
+      VirtualHostsPath = argv[argind++];
+      break;
+    case 'w':
+      if((Workers = strtoul(argv[argind++], NULL, 10)) == 0){
+        return false;
+      }
+      break;
+    case 'W':
+      WarmupPath = argv[argind++];
+      break;
+    case 'x':
+      if(!proxy_add_route(argv[argind++])){
+        return false;
+      }
+      break;
     default:
       return false;
     }
@@ -81,39 +219,417 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
   return true;
 }
 
+/**
+ * Record signal for the server loop to handle.
+ *
+ * @param   signum      Signal number.
+ **/
+void signal_handler(int signum) {
+  switch(signum){
+  case SIGUSR1:
+    DumpMetrics = 1;
+    break;
+  case SIGHUP:
+    ReloadConfig = 1;
+    break;
+  case SIGUSR2:
+    UpgradeBinary = 1;
+    break;
+  case SIGTERM:
+    StopServer = 1;
+    break;
+  }
+}
+
+/**
+ * Reload mimetypes and virtual hosts.
+ *
+ * If either fails to load, the current table is kept so that a bad edit does
+ * not take the server down.  Replaced tables may still be in use by requests
+ * on other threads, so they are retired rather than freed.
+ **/
+void reload_config(void) {
+  MimeTypeTable *mimetypes = mimetypes_load(MimeTypesPath);
+  if(mimetypes){
+    if(MimeTypes){
+      MimeTypes->retired = RetiredMimeTypes;
+      RetiredMimeTypes = MimeTypes;
+    }
+    __atomic_store_n(&MimeTypes, mimetypes, __ATOMIC_SEQ_CST);
+  }else{
+    log("Keeping previous mimetypes.");
+  }
+  
+  VirtualHostTable *vhosts = vhost_load(VirtualHostsPath);
+  if(vhosts){
+    VirtualHosts->retired = RetiredVirtualHosts;
+    RetiredVirtualHosts = VirtualHosts;
+    __atomic_store_n(&VirtualHosts, vhosts, __ATOMIC_SEQ_CST);
+  }else{
+    log("Keeping previous virtual hosts.");
+  }
+  
+  log("Reloaded configuration.");
+}
+
+/**
+ * Free retired tables once no request can still be using them.
+ *
+ * Requests count themselves in ActiveRequests before reading the tables, so
+ * once the count is zero every request that started before a table was
+ * retired has finished.
+ **/
+void release_config(void) {
+  if((!RetiredMimeTypes && !RetiredVirtualHosts) || __atomic_load_n(&ActiveRequests, __ATOMIC_SEQ_CST) > 0){
+    return;
+  }
+  
+  while(RetiredMimeTypes){
+    MimeTypeTable *next = RetiredMimeTypes->retired;
+    mimetypes_unload(RetiredMimeTypes);
+    RetiredMimeTypes = next;
+  }
+  
+  /* Cached entries are charged to the hosts they were cached for */
+  if(RetiredVirtualHosts){
+    cache_flush();
+  }
+  while(RetiredVirtualHosts){
+    VirtualHostTable *next = RetiredVirtualHosts->retired;
+    vhost_unload(RetiredVirtualHosts);
+    RetiredVirtualHosts = next;
+  }
+}
+
+/**
+ * Find the spidey binary to exec on upgrade.
+ *
+ * @param   name        Name the binary was started as (argv[0]).
+ * @return  Allocated path of binary.
+ *
+ * A name without a slash was found through PATH, so it is looked up the same
+ * way here, at startup.  The path is deliberately not resolved through
+ * /proc/self/exe or symbolic links: an upgrade must run the binary installed
+ * there now, not the one this process was started from.  Only if the name
+ * cannot be found is /proc/self/exe used.
+ **/
+char *resolve_executable(const char *name) {
+  char candidate[PATH_MAX];
+  char *path;
+  char *save = NULL;
+  
+  if(strchr(name, '/') || !getenv("PATH")){
+    return strdup(name);
+  }
+  
+  path = strdup(getenv("PATH"));
+  for(char *dir = strtok_r(path, ":", &save); dir; dir = strtok_r(NULL, ":", &save)){
+    snprintf(candidate, sizeof(candidate), "%s/%s", dir, name);
+    if(access(candidate, X_OK) == 0){
+      free(path);
+      return strdup(candidate);
+    }
+  }
+  free(path);
+  return strdup("/proc/self/exe");
+}
+
+/**
+ * Build environment of new binary.
+ *
+ * @param   listeners   Listening sockets.
+ * @return  Allocated array of this process's environment with LISTEN_FD_ENV
+ * set to the socket numbers (or NULL on error).  Only the array and its first
+ * entry (the LISTEN_FD_ENV setting) are allocated.
+ *
+ * The array is built before forking: a fork of a threaded server may only
+ * call async-signal-safe functions, which setenv (and malloc) are not.
+ **/
+char **upgrade_environment(ListenerSet *listeners) {
+  char fds[MAX_LISTENERS * 12] = "";
+  size_t length = 0;
+  size_t n = 0;
+  char **env;
+  
+  for(size_t i = 0; i < listeners->count; i++){
+    length += snprintf(fds + length, sizeof(fds) - length, "%s%d%s", i ? "," : "", listeners->fds[i],
+                       listeners->tls[i] ? "t" : "");
+  }
+  
+  while(environ[n]){
+    n++;
+  }
+  if((env = calloc(n + 2, sizeof(char *))) == NULL){
+    return NULL;
+  }
+  
+  if(asprintf(&env[0], "%s=%s", LISTEN_FD_ENV, fds) < 0){
+    free(env);
+    return NULL;
+  }
+  n = 1;
+  for(char **e = environ; *e; e++){
+    if(strncmp(*e, LISTEN_FD_ENV "=", sizeof(LISTEN_FD_ENV)) != 0){
+      env[n++] = *e;
+    }
+  }
+  return env;
+}
+
+/**
+ * Execute a new spidey binary that inherits the listening sockets.
+ *
+ * @param   listeners   Listening sockets.
+ * @return  true if the new binary is running, false otherwise.
+ *
+ * The new binary is started from a grandchild so that it is not a child of
+ * this process (which waits for its own children while draining).  It is
+ * passed the socket numbers in LISTEN_FD_ENV and execs the same command line.
+ * A close-on-exec pipe reports whether the exec succeeded: the parent reads
+ * EOF on success or the errno on failure.
+ *
+ * Between fork and execve the children only make async-signal-safe calls,
+ * since the server may have other threads (holding allocator or stdio locks)
+ * when it forks.
+ **/
+bool upgrade_binary(ListenerSet *listeners) {
+  char **env;
+  int status[2];
+  int error = 0;
+  
+  if((env = upgrade_environment(listeners)) == NULL){
+    log("Unable to build environment of new binary.");
+    return false;
+  }
+  if(pipe2(status, O_CLOEXEC) < 0){
+    log("Unable to create pipe: %s", strerror(errno));
+    free(env[0]);
+    free(env);
+    return false;
+  }
+  
+  pid_t pid = fork();
+  if(pid == 0){
+    close(status[0]);
+    if(fork() != 0){
+      _exit(EXIT_SUCCESS);
+    }
+    for(size_t i = 0; i < listeners->count; i++){
+      fcntl(listeners->fds[i], F_SETFD, 0);
+    }
+    execve(Executable, Arguments, env);
+    error = errno;
+    if(write(status[1], &error, sizeof(error)) < 0){
+      _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_FAILURE);
+  }
+  
+  close(status[1]);
+  free(env[0]);
+  free(env);
+  if(pid < 0){
+    log("Unable to fork: %s", strerror(errno));
+    close(status[0]);
+    return false;
+  }
+  
+  waitpid(pid, NULL, 0);
+  while(read(status[0], &error, sizeof(error)) < 0 && errno == EINTR);
+  close(status[0]);
+  if(error){
+    log("Unable to exec %s: %s", Executable, strerror(error));
+    return false;
+  }
+  
+  log("Upgraded to new binary.");
+  return true;
+}
+
+/**
+ * Handle any signals recorded since the last call.
+ *
+ * @param   listeners   Listening sockets.
+ * @return  true if the server should keep accepting, false if it should drain.
+ *
+ * This is called by the server loops between requests, outside of signal
+ * context, so it is safe to log and allocate here.
+ *
+ * SIGTERM drains the server just like an upgrade does, without starting a new
+ * binary.  Either way the hot set is saved first (see warmup_dump), so the
+ * next binary warms up from it.
+ **/
+bool handle_signals(ListenerSet *listeners) {
+  if(DumpMetrics){
+    DumpMetrics = 0;
+    vhost_dump_metrics(VirtualHosts);
+    admission_dump_metrics();
+    request_dump_metrics();
+    cache_dump_metrics();
+    proxy_dump_metrics();
+#ifdef TLS
+    if(TLSState){
+      tls_dump_metrics();
+    }
+#endif
+  }
+  
+  if(ReloadConfig){
+    ReloadConfig = 0;
+    reload_config();
+  }
+  release_config();
+  
+  if(UpgradeBinary){
+    UpgradeBinary = 0;
+    warmup_dump();
+    if(upgrade_binary(listeners)){
+      return false;
+    }
+  }
+  
+  if(StopServer){
+    warmup_dump();
+    return false;
+  }
+  
+  return true;
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
 int main(int argc, char *argv[]) {
-  ServerMode mode;
+  ServerMode mode = SINGLE;
   char *PROGRAM_NAME = argv[0];
+  Arguments = argv;
+  Executable = resolve_executable(argv[0]);
   
   /* Parse command line options */
   if(!parse_options(argc, argv, &mode)){
     usage(PROGRAM_NAME, 1);
   }
   
-  /* Listen to server socket */
-  int server_fd = socket_listen(Port);
+  /* An idle client would block every other client in single mode */
+  if(mode == SINGLE){
+    KeepAliveTimeout = 0;
+  }
+  
+  /* Listen to server sockets (unless inherited from the previous binary) */
+  ListenerSet listeners = {0};
+  if(socket_inherit(&listeners) == 0){
+    if(PortGiven || NUnixPaths == 0){
+      if((listeners.fds[listeners.count++] = socket_listen(Port)) < 0){
+        fatal("Unable to listen on port %s.", Port);
+      }
+      log("Listening on port %s", Port);
+    }
+    for(size_t i = 0; i < NUnixPaths; i++){
+      if((listeners.fds[listeners.count++] = socket_listen_unix(UnixPaths[i])) < 0){
+        fatal("Unable to listen on %s.", UnixPaths[i]);
+      }
+      log("Listening on %s", UnixPaths[i]);
+    }
+#ifdef TLS
+    if(TLSPort){
+      listeners.tls[listeners.count] = true;
+      if((listeners.fds[listeners.count++] = socket_listen(TLSPort)) < 0){
+        fatal("Unable to listen on port %s.", TLSPort);
+      }
+      log("Listening on port %s for TLS", TLSPort);
+    }
+#endif
+  }
   
   /* Determine real RootPath */
   RootPath = realpath(RootPath, NULL);
   
-  log("Listening on port %s", Port);
+  /* Allocate admission counters */
+  if(admission_init() < 0){
+    fatal("Unable to initialize admission control.");
+  }
+  
+  /* Map shared cache before any worker is started */
+  if(cache_init() < 0){
+    fatal("Unable to initialize cache.");
+  }
+  
+  /* Map shared output allowance */
+  if(output_init() < 0){
+    fatal("Unable to initialize output scheduler.");
+  }
+  
+  /* Map shared upstream server counters */
+  if(proxy_init() < 0){
+    fatal("Unable to initialize reverse proxy.");
+  }
+  
+  /* Map shared hot set */
+  if(warmup_init() < 0){
+    fatal("Unable to initialize cache warm-up.");
+  }
+  
+#ifdef TLS
+  /* Load certificate (and create session ticket keys) before any worker is started */
+  for(size_t i = 0; i < listeners.count; i++){
+    if(listeners.tls[i]){
+      if(tls_init() < 0){
+        fatal("Unable to initialize TLS.");
+      }
+      break;
+    }
+  }
+#endif
+  
+  /* Load mimetypes and virtual hosts */
+  MimeTypes = mimetypes_load(MimeTypesPath);
+  if((VirtualHosts = vhost_load(VirtualHostsPath)) == NULL){
+    fatal("Unable to load virtual hosts.");
+  }
+  
+#ifdef TRACE
+  /* Open trace file before starting any workers */
+  trace_open();
+#endif
+  
+  /* Handle signals without restarting accept so they are acted on promptly */
+  struct sigaction action = { .sa_handler = signal_handler };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+  sigaction(SIGUSR2, &action, NULL);
+  sigaction(SIGHUP, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  
+  /* Report writes to closed client or upstream sockets as EPIPE instead */
+  signal(SIGPIPE, SIG_IGN);
+  
   debug("RootPath        = %s", RootPath);
   debug("MimeTypesPath   = %s", MimeTypesPath);
+  debug("VirtualHosts    = %s", VirtualHostsPath ? VirtualHostsPath : "(none)");
   debug("DefaultMimeType = %s", DefaultMimeType);
-  debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+  debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" : "Threaded");
+  
+  /* Warm caches while the server starts accepting */
+  warmup_start();
+  
+  /* Probe upstream servers while the server runs */
+  proxy_start();
   
   /* Start either forking or single HTTP server */
   if(mode == SINGLE){
-    single_server(server_fd);
+    single_server(&listeners);
   }else if(mode == FORKING){
-    forking_server(server_fd);
+    forking_server(&listeners);
+  }else if(mode == THREADED){
+    threaded_server(&listeners);
   }else if(mode == UNKNOWN){
     usage(PROGRAM_NAME, 1);
   }
+  release_config();
+  vhost_unload(VirtualHosts);
+  mimetypes_unload(MimeTypes);
   free(RootPath);
+  free(Executable);
   return EXIT_SUCCESS;
 }
 
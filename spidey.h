@@ -6,11 +6,18 @@
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* Constants */
 
 #define WHITESPACE	" \t\n"
+#define LISTEN_FD_ENV	"SPIDEY_LISTEN_FD"
+#define RETRY_AFTER	"1"
 
 /**
  * Concurrency modes
@@ -18,6 +25,7 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    THREADED,                           /**< Thread pool */
     UNKNOWN
 } ServerMode;
 
@@ -27,6 +35,12 @@ extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern char *VirtualHostsPath;          /**< Path to virtual hosts file */
+extern int  DeferAccept;                /**< TCP_DEFER_ACCEPT timeout (0 = off) */
+extern bool ProxyProtocol;              /**< Whether connections start with a PROXY header */
+extern size_t Workers;                  /**< Number of worker threads */
+extern int  KeepAliveTimeout;           /**< Idle connection timeout (0 = off) */
+extern size_t KeepAliveRequests;        /**< Requests per connection */
 
 /* Logging Macros */
 
@@ -39,8 +53,47 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Request Tracing */
+
+typedef enum {
+    TRACE_ACCEPT = 0,                   /* Connection accepted */
+    TRACE_FIRST_BYTE,                   /* First request byte available */
+    TRACE_REQUEST_LINE,                 /* Request line parsed */
+    TRACE_HEADERS,                      /* Headers parsed */
+    TRACE_PATH,                         /* Request path resolved */
+    TRACE_HANDLER,                      /* Handler started */
+    TRACE_FIRST_RESPONSE,               /* First response byte written */
+    TRACE_LAST_BYTE,                    /* Last response byte written */
+    TRACE_CLOSE,                        /* Connection closed */
+    TRACE_PHASES,
+} TracePhase;
+
+#ifdef TRACE
+#include <stdint.h>
+
+typedef struct {
+    uint32_t    pid;                    /*< Process of worker */
+    uint32_t    tid;                    /*< Thread of worker */
+    uint64_t    phases[TRACE_PHASES];   /*< CLOCK_MONOTONIC nanoseconds */
+} TraceRecord;
+
+extern char *TracePath;                 /**< Path to trace file */
+
+#define trace(r, phase) trace_mark((r), (phase))
+#else
+#define trace(r, phase)
+#endif
+
+#include <sys/uio.h>
+
+#ifdef TLS
+#include <openssl/ssl.h>
+#endif
+
 /* HTTP Request */
 
+typedef struct virtual_host VirtualHost;
+
 typedef struct header Header;
 struct header {
     char    *name;                      /*< Name of header entry */
@@ -49,22 +102,78 @@ struct header {
 };
 
 typedef struct {
+    double  tokens;                     /*< Bytes that may be sent now */
+    unsigned long long refilled;        /*< Time tokens were last added (ns) */
+} TokenBucket;
+
+typedef struct h2_stream H2Stream;
+
+typedef struct request Request;
+struct request {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *file;                      /*< Client socket file stream */
+    char    *buffer;                    /*< Bytes read from client socket (borrowed) */
+    size_t  bstart;                     /*< Offset of first unparsed byte */
+    size_t  bend;                       /*< Offset past last buffered byte */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
     char    *path;                      /*< Real path corrsponding to URI and RootPath */
     char    *query;                     /*< HTTP query string */
 
-    char host[NI_MAXHOST];              /*< Host name of client */
-    char port[NI_MAXSERV];              /*< Port number of client */
+    struct sockaddr_storage addr;       /*< Address of client */
+    socklen_t addrlen;                  /*< Length of client address */
+    bool    proxied;                    /*< Whether PROXY header was parsed */
 
     Header  *headers;                   /*< List of name, value Header pairs */
-} Request;
 
-Request *       accept_request(int sfd);
+    VirtualHost *vhost;                 /*< Virtual host serving request */
+    unsigned long long accepted;        /*< Time request was accepted (ns) */
+
+    bool    keepalive;                  /*< Whether connection persists after response */
+    bool    h2c;                        /*< Whether connection switches to HTTP/2 */
+    H2Stream *stream;                   /*< HTTP/2 stream of request (NULL for HTTP/1) */
+    size_t  nrequests;                  /*< Requests parsed on connection */
+    unsigned long long idle;            /*< Time connection became idle (ns) */
+    Request *prev;                      /*< Previous idle connection */
+    Request *next;                      /*< Next idle connection */
+
+    int     output;                     /*< File still being sent (or -1) */
+    off_t   offset;                     /*< Offset of next byte of output */
+    size_t  remaining;                  /*< Bytes of output left to send */
+    size_t  deficit;                    /*< Bytes output may send this round */
+    TokenBucket bucket;                 /*< Bandwidth allowance of connection */
+
+#ifdef TRACE
+    uint64_t trace[TRACE_PHASES];       /*< Timestamps of request phases */
+#endif
+#ifdef TLS
+    SSL     *ssl;                       /*< TLS session (NULL for plain connections) */
+#endif
+};
+
+typedef struct {
+    size_t  connections;                /*< Request structures allocated */
+    size_t  buffers;                    /*< Read buffers lent to connections */
+    size_t  pooled;                     /*< Read buffers kept for reuse */
+} MemoryMetrics;
+
+extern MemoryMetrics MemoryState;       /**< Connection memory counters */
+
+Request *       accept_request(int sfd, bool tls);
 void	        free_request(Request *request);
+void	        reset_request(Request *request);
+bool	        request_wait(Request *request);
+bool            request_pending(Request *request);
 int	        parse_request(Request *request);
+const char *    request_header(Request *request, const char *name);
+const char *    request_host(Request *request);
+const char *    request_port(Request *request);
+void            request_dump_metrics(void);
+
+#ifdef TRACE
+int             trace_open(void);
+void            trace_mark(Request *request, TracePhase phase);
+void            trace_emit(Request *request);
+#endif
 
 /* HTTP Request Handlers */
 
@@ -73,26 +182,331 @@ typedef enum {
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_COUNT,
 } HTTPStatus;
 
 HTTPStatus      handle_request(Request *request);
+HTTPStatus      handle_connection(Request *request);
+
+/* Reverse Proxy */
+
+typedef struct proxy_route ProxyRoute;
+
+bool            proxy_add_route(const char *spec);
+int             proxy_init(void);
+ProxyRoute *    proxy_lookup(const char *uri);
+void            proxy_start(void);
+HTTPStatus      handle_proxy_request(Request *request, ProxyRoute *route, const char *uri);
+void            proxy_dump_metrics(void);
+
+/* HTTP/2 */
+
+HTTPStatus      h2_serve(Request *request);
+ssize_t         h2_writev(Request *request, const struct iovec *iov, int iovcnt);
+ssize_t         h2_sendfile(Request *request, int fd, off_t *offset, size_t length);
+
+/* HTTP Response */
+
+#define RESPONSE_HEADER_SIZE    1024
+
+typedef struct {
+    char    header[RESPONSE_HEADER_SIZE]; /*< Status line and headers */
+    size_t  length;                     /*< Length of headers */
+    bool    truncated;                  /*< Whether headers overflowed */
+} Response;
+
+void            response_start(Response *res, HTTPStatus status, const char *type);
+void            response_header(Response *res, const char *name, const char *value);
+int             response_send(Request *r, Response *res, off_t length, const void *body, size_t nbody);
+int             response_write(Request *r, const void *data, size_t length);
+
+/* Output Scheduling */
+
+#define OUTPUT_QUANTUM      (128 * 1024)    /* Bytes sent per round */
+
+extern size_t ConnectionRate;           /**< Bytes per second per connection (0 = unlimited) */
+extern size_t OutputRate;               /**< Bytes per second for server (0 = unlimited) */
+
+typedef enum {
+    OUTPUT_ERROR = -1,                  /* Response could not be sent */
+    OUTPUT_DONE,                        /* Response was sent */
+    OUTPUT_MORE,                        /* More of response remains */
+    OUTPUT_BLOCKED,                     /* Socket is full */
+} OutputStatus;
+
+int             output_init(void);
+void            output_start(Request *request, int fd, off_t offset, size_t length);
+OutputStatus    output_continue(Request *request);
+OutputStatus    output_drain(Request *request);
+void            output_throttle(Request *request, size_t length);
+void            output_cancel(Request *request);
+
+/* Virtual Hosts */
+
+typedef struct {
+    unsigned long requests;             /*< Number of requests handled */
+    unsigned long statuses[HTTP_STATUS_COUNT]; /*< Number of responses per status */
+} HostMetrics;
+
+struct virtual_host {
+    char        *name;                  /*< Host header value (without port) */
+    char        *root;                  /*< Real path of document root */
+    char        *mimetype;              /*< Default file mimetype */
+    size_t      cache_size;             /*< Cache budget in bytes */
+    HostMetrics *metrics;               /*< Shared per-host counters */
+    VirtualHost *next;                  /*< Next host in hash bucket */
+};
+
+typedef struct virtual_host_table VirtualHostTable;
+struct virtual_host_table {
+    VirtualHost **buckets;              /*< Hash buckets of virtual hosts */
+    VirtualHost *fallback;              /*< Host used when nothing matches */
+    VirtualHostTable *retired;          /*< Next table awaiting release */
+};
+
+extern VirtualHostTable *VirtualHosts;  /**< Current virtual hosts table */
+
+VirtualHostTable *vhost_load(const char *path);
+void            vhost_unload(VirtualHostTable *table);
+VirtualHost *   vhost_lookup(VirtualHostTable *table, const char *host);
+void            vhost_record(VirtualHost *host, HTTPStatus status);
+void            vhost_dump_metrics(VirtualHostTable *table);
 
 /* HTTP Server */
 
-int             single_server(int sfd);
-int             forking_server(int sfd);
+extern char **Arguments;                /**< Command line (for upgrades) */
+extern volatile sig_atomic_t DumpMetrics;   /**< Set by SIGUSR1 */
+extern volatile sig_atomic_t ReloadConfig;  /**< Set by SIGHUP */
+extern volatile sig_atomic_t UpgradeBinary; /**< Set by SIGUSR2 */
+extern volatile sig_atomic_t StopServer;    /**< Set by SIGTERM */
+
+extern unsigned long ActiveRequests;    /**< Requests currently being handled */
+
+typedef struct listener_set ListenerSet;
+
+int             single_server(ListenerSet *listeners);
+int             forking_server(ListenerSet *listeners);
+int             threaded_server(ListenerSet *listeners);
+bool            handle_signals(ListenerSet *listeners);
+
+/* Thread Pool */
+
+typedef void (*TaskFunc)(void *arg);
+
+typedef struct {
+    TaskFunc    func;                   /*< Function to run */
+    void        *arg;                   /*< Argument to function */
+} Task;
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Protects deque */
+    Task        *tasks;                 /*< Ring buffer of tasks */
+    size_t      head;                   /*< Index of front task */
+    size_t      count;                  /*< Number of tasks */
+    size_t      capacity;               /*< Capacity of ring buffer */
+} Deque;
+
+typedef struct pool Pool;
+
+typedef struct {
+    Pool        *pool;                  /*< Pool worker belongs to */
+    size_t      index;                  /*< Index of worker in pool */
+    pthread_t   thread;                 /*< Worker thread */
+    Deque       deque;                  /*< Tasks queued on this worker */
+    unsigned long steals;               /*< Number of tasks stolen */
+} Worker;
+
+struct pool {
+    Worker      *workers;               /*< Array of workers */
+    size_t      nworkers;               /*< Number of workers */
+    size_t      next;                   /*< Next worker for external tasks */
+    pthread_mutex_t lock;               /*< Protects pending and stopping */
+    pthread_cond_t  wakeup;             /*< Signalled when tasks are pending */
+    size_t      pending;                /*< Number of queued, unclaimed tasks */
+    bool        stopping;               /*< Whether pool is shutting down */
+};
+
+Pool *          pool_create(size_t nworkers);
+void            pool_destroy(Pool *pool);
+int             pool_submit(Pool *pool, TaskFunc func, void *arg, bool front);
+
+/* Admission Control */
+
+typedef struct {
+    size_t      connections;            /*< Connections being handled */
+    size_t      cgi;                    /*< CGI processes running */
+    size_t      streams;                /*< HTTP/2 streams running */
+    unsigned long rejected;             /*< Connections rejected with 503 */
+} Admission;
+
+extern size_t MaxConnections;           /**< Limit on connections (0 = none) */
+extern size_t MaxCGI;                   /**< Limit on CGI processes (0 = none) */
+extern size_t MaxStreams;               /**< Limit on HTTP/2 streams running (0 = none) */
+extern size_t QueueTarget;              /**< Target queueing delay in ms (0 = off) */
+extern Admission *AdmissionState;       /**< Shared admission counters */
+
+int             admission_init(void);
+bool            admission_enter(void);
+void            admission_leave(void);
+bool            admission_cgi_enter(void);
+void            admission_cgi_leave(void);
+bool            admission_stream_enter(void);
+void            admission_stream_leave(void);
+bool            admission_admit(Request *request);
+void            reject_request(Request *request);
+void            admission_dump_metrics(void);
+
+/* Cache */
+
+#define CACHE_BODY_LIMIT    (64 * 1024) /* Largest body kept in the cache */
+#define CACHE_KEY_SIZE      256         /* Longest cached key (including NUL) */
+#define CACHE_TYPE_SIZE     64          /* Longest cached Content-Type (including NUL) */
+
+typedef enum {
+    CACHE_FILLING,                      /* Being filled by one request */
+    CACHE_READY,                        /* Body may be served */
+    CACHE_FAILED,                       /* Fill failed */
+} CacheEntryState;
+
+typedef struct cache_entry CacheEntry;
+struct cache_entry {
+    char        key[CACHE_KEY_SIZE];    /*< Real path (with query for CGI output) */
+    CacheEntryState state;              /*< State of entry */
+    char        *data;                  /*< Cached body (chunk in shared segment) */
+    size_t      length;                 /*< Length of body */
+    char        type[CACHE_TYPE_SIZE];  /*< Content-Type of body (empty for CGI) */
+    ino_t       ino;                    /*< Inode of source file */
+    off_t       size;                   /*< Size of source file */
+    struct timespec mtime;              /*< Modification time of source file */
+    unsigned long long expires;         /*< Time entry expires (0 = never) */
+    size_t      refs;                   /*< Requests using entry */
+    bool        linked;                 /*< Whether entry is in the cache */
+    pid_t       filler;                 /*< Process filling entry */
+    int         cls;                    /*< Slab class of body */
+    size_t      host;                   /*< Usage slot of host entry is charged to */
+    size_t      budget;                 /*< Cache budget of host (0 = none) */
+    CacheEntry  *next;                  /*< Next entry in hash bucket */
+    CacheEntry  *newer;                 /*< More recently used entry */
+    CacheEntry  *older;                 /*< Less recently used entry */
+};
+
+typedef struct {
+    unsigned long hits;                 /*< Bodies served from the cache */
+    unsigned long misses;               /*< Bodies filled by a request */
+    unsigned long coalesced;            /*< Requests that waited for a fill */
+    unsigned long evictions;            /*< Entries evicted to make room */
+    unsigned long negative_hits;        /*< URIs answered as missing */
+    unsigned long negative_misses;      /*< URIs looked up on the filesystem */
+    unsigned long negative_flushes;     /*< Flushes after directory changes */
+} CacheMetrics;
+
+extern size_t   CacheSize;             /**< Bytes of bodies to cache (0 = off) */
+extern unsigned CGICacheTTL;            /**< Lifetime of cached CGI output (0 = off) */
+extern CacheMetrics *CacheState;        /**< Shared cache counters */
+
+int             cache_init(void);
+CacheEntry *    cache_acquire(VirtualHost *host, const char *key, const struct stat *st, unsigned ttl, bool *fill);
+bool            cache_complete(CacheEntry *entry, const char *data, size_t length, const char *type);
+void            cache_release(CacheEntry *entry);
+CacheEntry *    cache_file(VirtualHost *host, const char *path, const struct stat *st);
+void            cache_flush(void);
+bool            negative_lookup(const char *root, const char *uri);
+void            negative_insert(const char *root, const char *uri);
+void            cache_dump_metrics(void);
+
+/* Cache Warm-up */
+
+extern char *WarmupPath;                /**< Hot set to warm up from and save to (NULL = none) */
+extern char *WarmupLogPath;             /**< Access log to warm up from (NULL = none) */
+
+int             warmup_init(void);
+void            warmup_start(void);
+void            warmup_record(VirtualHost *host, const char *uri);
+void            warmup_dump(void);
+
+/* CPU Affinity */
+
+extern cpu_set_t *AffinitySet;          /**< CPUs to run workers on (NULL = any) */
+
+bool            affinity_parse(const char *spec);
+int             affinity_cpu(size_t n);
+int             affinity_pin(int cpu);
+int             affinity_pin_connection(int fd, size_t n);
 
 /* Socket */
 
+#define MAX_LISTENERS       8           /* Most sockets listened on at once */
+
+struct listener_set {
+    int     fds[MAX_LISTENERS];         /*< Listening sockets */
+    bool    tls[MAX_LISTENERS];         /*< Whether each socket speaks TLS */
+    size_t  count;                      /*< Number of listening sockets */
+    size_t  next;                       /*< Listener to check first in socket_wait */
+};
+
 int	        socket_listen(const char *port);
+int	        socket_listen_unix(const char *path);
+size_t          socket_inherit(ListenerSet *listeners);
+int             socket_wait(ListenerSet *listeners);
+void            socket_close(ListenerSet *listeners);
+
+/* TLS */
+
+#ifdef TLS
+typedef struct {
+    unsigned long handshakes;           /*< Completed handshakes */
+    unsigned long resumed;              /*< Handshakes that resumed a session */
+    unsigned long offloaded;            /*< Sessions encrypted by the kernel */
+    unsigned long failures;             /*< Failed handshakes */
+} TLSMetrics;
+
+extern char *TLSPort;                   /**< Port to listen for TLS on (NULL = none) */
+extern char *TLSCertificatePath;        /**< Path to PEM certificate chain */
+extern char *TLSKeyPath;                /**< Path to PEM private key (NULL = in certificate file) */
+extern TLSMetrics *TLSState;            /**< Shared TLS counters */
+
+int             tls_init(void);
+int             tls_start(Request *request);
+ssize_t         tls_read(Request *request, void *buffer, size_t size);
+ssize_t         tls_writev(Request *request, const struct iovec *iov, int iovcnt);
+ssize_t         tls_sendfile(Request *request, int fd, off_t *offset, size_t length);
+bool            tls_offloaded(Request *request);
+bool            tls_pending(Request *request);
+void            tls_close(Request *request);
+void            tls_dump_metrics(void);
+#endif
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	        determine_mimetype(const char *path);
-char *	        determine_request_path(const char *uri);
+typedef struct mime_type MimeType;
+struct mime_type {
+    char        *extension;             /*< File extension (without '.') */
+    char        *mimetype;              /*< Corresponding mimetype */
+    MimeType    *next;                  /*< Next mimetype in hash bucket */
+};
+
+typedef struct mime_type_table MimeTypeTable;
+struct mime_type_table {
+    MimeType    **buckets;              /*< Hash buckets of mimetypes */
+    MimeTypeTable *retired;             /*< Next table awaiting release */
+};
+
+extern MimeTypeTable *MimeTypes;        /**< Current mimetypes table */
+
+MimeTypeTable * mimetypes_load(const char *path);
+void            mimetypes_unload(MimeTypeTable *table);
+const char *    mimetypes_lookup(MimeTypeTable *table, const char *ext);
+
+unsigned long   hash_string(const char *s);
+unsigned long long monotonic_ns(void);
+char *	        determine_mimetype(const char *path, const char *fallback);
+char *	        determine_request_path(const char *root, const char *uri);
+ssize_t         normalize_uri(const char *uri, char *buffer, size_t size);
 const char *    http_status_string(HTTPStatus status);
 char *	        skip_nonwhitespace(char *s);
 char *	        skip_whitespace(char *s);
@@ -14,6 +14,7 @@ error() {
 
 cleanup() {
     STATUS=${1:-$FAILURES}
+    stop_local
     rm -fr $WORKSPACE
     exit $STATUS
 }
@@ -37,8 +38,8 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
-    if [ "$status" != "$1" ]; then
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    if ! grep -q -E "^$1\$" <<<"$status"; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
     fi
@@ -73,6 +74,20 @@ check_hrefs() {
     fi
 }
 
+start_local() {
+    LOCAL_PORT=$((9000 + RANDOM % 1000))
+    ./$PROGRAM -r $WORKSPACE/www -p $LOCAL_PORT "$@" >> $WORKSPACE/log 2>&1 &
+    LOCAL_PIDS="$LOCAL_PIDS $!"
+    sleep 1
+}
+
+stop_local() {
+    for pid in $LOCAL_PIDS; do
+    	kill $pid 2> /dev/null && wait $pid 2> /dev/null
+    done
+    LOCAL_PIDS=
+}
+
 # Setup
 
 mkdir $WORKSPACE
@@ -115,7 +130,7 @@ printf "\n %-64s ... \n" "Handle Browse Requests"
 
 printf "     %-60s ... " "/"
 HREFS="/..,/html,/scripts,/song.txt,/text"
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.[01] 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/ > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. html scripts text" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
@@ -163,7 +178,7 @@ printf "\n %-64s ... \n" "Handle File Requests"
 
 printf "     %-60s ... " "/html/index.html"
 MD5SUM=55cdbe19dcf3ea685707213cdada01ef
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.[01] 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "avengers Spidey html" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
@@ -212,6 +227,8 @@ sleep 2
 
 printf "\n %-64s ... \n" "Handle CGI Requests"
 
+STATUS="HTTP/1.0 200 OK"
+
 printf "     %-60s ... " "/scripts/env.sh"
 CONTENT="text/plain"
 HEADERS="DOCUMENT_ROOT QUERY_STRING REMOTE_ADDR REMOTE_PORT REQUEST_METHOD REQUEST_URI SCRIPT_FILENAME SERVER_PORT HTTP_HOST HTTP_USER_AGENT"
@@ -265,7 +282,7 @@ sleep 2
 printf "\n %-64s ... \n" "Handle Errors"
 
 printf "     %-60s ... " "/asdf"
-STATUS="HTTP/1.0 404 Not Found"
+STATUS="HTTP/1.[01] 404 Not Found"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -297,3 +314,162 @@ if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$S
 else
     echo "Success"
 fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Local Instances"
+
+cp -r www $WORKSPACE/www
+
+printf "     %-60s ... " "Admission (-C 1)"
+STATUS="HTTP/1.0 503 Service Unavailable"
+CONTENT="text/html"
+start_local -c forking -C 1
+exec 3<> /dev/tcp/localhost/$LOCAL_PORT
+sleep 0.5
+curl -s -D $WORKSPACE/header localhost:$LOCAL_PORT/ > $WORKSPACE/test
+STATUS_=$?
+exec 3<&-
+if ! check_status $STATUS_ 0 || ! grep_all "503" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+stop_local
+
+printf "     %-60s ... " "Keep-Alive (2 requests)"
+start_local -c threaded
+curl -s -o /dev/null -o /dev/null -D $WORKSPACE/header -w '%{num_connects}\n' \
+    localhost:$LOCAL_PORT/html/index.html localhost:$LOCAL_PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ "$(paste -s -d , $WORKSPACE/test)" != "1,0" ] || ! grep_all "Connection:.keep-alive" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "Keep-Alive (101 requests)"
+URLS=
+for i in $(seq 101); do
+    URLS="$URLS -o /dev/null localhost:$LOCAL_PORT/html/index.html"
+done
+curl -s -D $WORKSPACE/header -w '%{num_connects}\n' $URLS > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_count "^1$" 2 || [ "$(grep -i -c "^Connection: close" $WORKSPACE/header)" -ne 1 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "HTTP/2 (prior knowledge)"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+curl -s --http2-prior-knowledge -D $WORKSPACE/header localhost:$LOCAL_PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "HTTP/2 200 ?" "text/html"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "HTTP/2 (upgrade)"
+curl -s --http2 -D $WORKSPACE/header localhost:$LOCAL_PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "^HTTP/1.1.101 ^HTTP/2.200" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+stop_local
+
+printf "     %-60s ... " "Dot Segments"
+STATUS="HTTP/1.[01] 400 Bad Request"
+CONTENT="text/html"
+start_local -c threaded
+for uri in /../ /html/../../ /%2e%2e/ /html/%2E%2E/%2e%2e/etc/passwd; do
+    curl -s --path-as-is -D $WORKSPACE/header localhost:$LOCAL_PORT$uri > $WORKSPACE/test
+    if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+	echo "FAILURE: $uri" >> $WORKSPACE/test
+	break
+    fi
+    rm -f $WORKSPACE/test
+done
+MD5SUM=c77059544e187022e19b940d0c55f408
+if [ -r $WORKSPACE/test ]; then
+    error "Failure"
+elif ! curl -s --path-as-is localhost:$LOCAL_PORT/html/./../text/hackers.txt > $WORKSPACE/test || ! check_md5sum $MD5SUM; then
+    error "Failure"
+else
+    echo "Success"
+fi
+stop_local
+
+printf "     %-60s ... " "Negative Cache"
+start_local -c threaded
+curl -s -o /dev/null -o /dev/null -w '%{http_code}\n' \
+    localhost:$LOCAL_PORT/text/new.txt localhost:$LOCAL_PORT/text/new.txt > $WORKSPACE/test
+kill -USR1 ${LOCAL_PIDS##* }
+sleep 0.5
+HITS=$(grep "METRICS negative" $WORKSPACE/log | tail -n 1 | sed -En 's/.* hits=([0-9]+).*/\1/p')
+echo "new" > $WORKSPACE/www/text/new.txt
+sleep 0.5
+curl -s -w '%{http_code}\n' localhost:$LOCAL_PORT/text/new.txt >> $WORKSPACE/test
+if [ "$(paste -s -d , $WORKSPACE/test)" != "404,404,new,200" ] || [ "${HITS:-0}" -lt 1 ]; then
+    echo "FAILURE: negative hits=$HITS" >> $WORKSPACE/test
+    error "Failure"
+else
+    echo "Success"
+fi
+stop_local
+
+printf "     %-60s ... " "Unix Socket (-u)"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+start_local -c threaded -u $WORKSPACE/socket
+curl -s --unix-socket $WORKSPACE/socket -D $WORKSPACE/header localhost/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "HTTP/1.[01] 200 OK" "text/html"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+stop_local
+
+printf "     %-60s ... " "PROXY v1 (-P)"
+start_local -c forking -P
+exec 3<> /dev/tcp/localhost/$LOCAL_PORT
+printf "PROXY TCP4 203.0.113.7 127.0.0.1 4242 80\r\nGET /scripts/env.sh HTTP/1.0\r\n\r\n" >&3
+cat <&3 > $WORKSPACE/test
+exec 3<&-
+if ! grep_all "^HTTP/1.0.200 REMOTE_ADDR=203.0.113.7 REMOTE_PORT=4242" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "PROXY v2 (-P)"
+exec 3<> /dev/tcp/localhost/$LOCAL_PORT
+printf '\r\n\r\n\0\r\nQUIT\n\x21\x11\x00\x0c\xcb\x00\x71\x08\x7f\x00\x00\x01\x10\x92\x00\x50' >&3
+printf "GET /scripts/env.sh HTTP/1.0\r\n\r\n" >&3
+cat <&3 > $WORKSPACE/test
+exec 3<&-
+if ! grep_all "^HTTP/1.0.200 REMOTE_ADDR=203.0.113.8 REMOTE_PORT=4242" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+stop_local
+
+printf "     %-60s ... " "Proxy Route (-x)"
+mkdir -p $WORKSPACE/backend/api
+echo "upstream" > $WORKSPACE/backend/api/hello.txt
+start_local -c threaded -r $WORKSPACE/backend
+BACKEND_PORT=$LOCAL_PORT
+BACKEND_PID=${LOCAL_PIDS##* }
+start_local -c threaded -x /api=127.0.0.1:$BACKEND_PORT
+curl -s -w '%{http_code}\n' localhost:$LOCAL_PORT/api/hello.txt > $WORKSPACE/test
+curl -s --path-as-is -w '%{http_code}\n' localhost:$LOCAL_PORT/api/x/../hello.txt >> $WORKSPACE/test
+curl -s -o /dev/null -w '%{http_code}\n' localhost:$LOCAL_PORT/html/index.html >> $WORKSPACE/test
+kill $BACKEND_PID && wait $BACKEND_PID 2> /dev/null
+curl -s -o /dev/null -w '%{http_code}\n' localhost:$LOCAL_PORT/api/hello.txt >> $WORKSPACE/test
+if [ "$(paste -s -d , $WORKSPACE/test)" != "upstream,200,upstream,200,200,502" ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+stop_local
@@ -26,24 +26,28 @@ def usage(status):
     sys.exit(status)
 
 def do_request(pid):
-    ''' Perform REQUESTS HTTP requests and return the average elapsed time. '''
+    ''' Perform REQUESTS HTTP requests and return the average elapsed and
+    first byte times. '''
     TOTALTIME = 0.0
+    FIRSTBYTE = 0.0
     for i in range(int(REQUESTS)):
         try:
             before = time.time()
-            response = requests.get(URL)
-            after = time.time()
+            response = requests.get(URL, stream=True)
+            firstTime = time.time() - before    # connect + accept + headers
             data = response.text
+            after = time.time()
             if VERBOSE:
                 print(data)
             requestTime = after - before
             TOTALTIME += requestTime
-            print("Process: {}, Request: {}, Elapsed Time: {:.2f}".format(pid, i, requestTime))
+            FIRSTBYTE += firstTime
+            print("Process: {}, Request: {}, Elapsed Time: {:.2f}, First Byte: {:.4f}".format(pid, i, requestTime, firstTime))
         except:
             print("Error in request")
         
-    print("Process: {}, AVERAGE   , Elapsed Time: {:.2f}".format(pid, TOTALTIME / float(REQUESTS)))
-    return TOTALTIME / float(REQUESTS)
+    print("Process: {}, AVERAGE   , Elapsed Time: {:.2f}, First Byte: {:.4f}".format(pid, TOTALTIME / float(REQUESTS), FIRSTBYTE / float(REQUESTS)))
+    return TOTALTIME / float(REQUESTS), FIRSTBYTE / float(REQUESTS)
 
 # Main execution
 
@@ -72,6 +76,7 @@ if __name__ == '__main__':
     pool = multiprocessing.Pool(PROCESSES)
     timeIterable = pool.map(do_request, range(PROCESSES))
 
-    print("TOTAL AVERAGE ELAPSED TIME: {:.6f}".format(sum(timeIterable) / PROCESSES))
+    print("TOTAL AVERAGE ELAPSED TIME: {:.6f}".format(sum(t[0] for t in timeIterable) / PROCESSES))
+    print("TOTAL AVERAGE FIRST BYTE TIME: {:.6f}".format(sum(t[1] for t in timeIterable) / PROCESSES))
 
 # vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,378 @@
+/* threaded.c: Threaded HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MAX_EVENTS      64              /* Events handled per epoll_wait */
+#define SWEEP_INTERVAL  1000            /* Interval of idle timeout sweep (ms) */
+
+/* Global Variables */
+
+static Pool *ThreadedPool = NULL;       /* Pool handling requests */
+static int   IdleFd       = -1;         /* Epoll watching listener and idle connections */
+static bool  Draining     = false;      /* Whether server stopped accepting */
+static size_t Sending     = 0;          /* Responses left to the output scheduler */
+
+static pthread_mutex_t IdleLock = PTHREAD_MUTEX_INITIALIZER;
+static Request *IdleHead = NULL;        /* Oldest idle connection */
+static Request *IdleTail = NULL;        /* Newest idle connection */
+
+void threaded_handle(void *arg);
+void threaded_output(void *arg);
+
+/* Internal Functions */
+
+/**
+ * Append connection to idle list.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * Must be called with IdleLock held.
+ **/
+static void idle_push(Request *r) {
+  r->idle = monotonic_ns();
+  r->prev = IdleTail;
+  r->next = NULL;
+  if (IdleTail) {
+    IdleTail->next = r;
+  } else {
+    IdleHead = r;
+  }
+  IdleTail = r;
+}
+
+/**
+ * Remove connection from idle list.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * Must be called with IdleLock held.
+ **/
+static void idle_remove(Request *r) {
+  if (r->prev) {
+    r->prev->next = r->next;
+  } else {
+    IdleHead = r->next;
+  }
+  if (r->next) {
+    r->next->prev = r->prev;
+  } else {
+    IdleTail = r->prev;
+  }
+  r->prev = r->next = NULL;
+}
+
+/**
+ * Queue connection on the pool.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * The queueing delay used by admission_admit starts now, not when the
+ * connection was first accepted.
+ **/
+static void threaded_queue(Request *r) {
+  r->accepted = monotonic_ns();
+  trace(r, TRACE_ACCEPT);
+  if (pool_submit(ThreadedPool, threaded_handle, r, false) < 0) {
+    free_request(r);
+    admission_leave();
+  }
+}
+
+/**
+ * Park persistent connection until its next request arrives.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * If the next request was already pipelined into the read buffer (or is
+ * waiting decrypted in its TLS session), it is queued right away.  Otherwise
+ * the connection is handed to the server loop's epoll instance, so an idle
+ * connection does not tie up a worker.
+ **/
+static void threaded_park(Request *r) {
+  struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = r };
+
+  if (request_pending(r)) {
+    threaded_queue(r);
+    return;
+  }
+
+  pthread_mutex_lock(&IdleLock);
+  if (Draining || epoll_ctl(IdleFd, EPOLL_CTL_ADD, r->fd, &event) < 0) {
+    pthread_mutex_unlock(&IdleLock);
+    free_request(r);
+    admission_leave();
+    return;
+  }
+  idle_push(r);
+  pthread_mutex_unlock(&IdleLock);
+}
+
+/**
+ * Take connection off idle list and stop watching it.
+ *
+ * @param   r           HTTP Request structure.
+ **/
+static void threaded_unpark(Request *r) {
+  pthread_mutex_lock(&IdleLock);
+  idle_remove(r);
+  epoll_ctl(IdleFd, EPOLL_CTL_DEL, r->fd, NULL);
+  pthread_mutex_unlock(&IdleLock);
+}
+
+/**
+ * Close idle connections that have not sent a request in KeepAliveTimeout
+ * seconds (or all of them if everything is true).
+ *
+ * @param   everything  Whether to close every idle connection.
+ **/
+static void threaded_sweep(bool everything) {
+  unsigned long long deadline = monotonic_ns() - KeepAliveTimeout * 1000000000ULL;
+
+  while (true) {
+    pthread_mutex_lock(&IdleLock);
+    Request *r = IdleHead;
+    if (!r || (!everything && r->idle > deadline)) {
+      pthread_mutex_unlock(&IdleLock);
+      break;
+    }
+    idle_remove(r);
+    epoll_ctl(IdleFd, EPOLL_CTL_DEL, r->fd, NULL);
+    pthread_mutex_unlock(&IdleLock);
+
+    debug("Closing idle connection from %s:%s", request_host(r), request_port(r));
+    free_request(r);
+    admission_leave();
+  }
+}
+
+/**
+ * Finish with connection once its response is sent.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * The connection is parked if it is kept alive and freed otherwise.
+ **/
+static void threaded_finish(Request *r) {
+  if(r->keepalive){
+    reset_request(r);
+    threaded_park(r);
+    return;
+  }
+  free_request(r);
+  admission_leave();
+}
+
+/**
+ * Schedule the rest of response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      Result of sending the last quantum.
+ *
+ * A response with more to send is queued at the back of the pool, so bulk
+ * downloads take turns with each other and with new requests.  A response
+ * whose socket is full is handed to the server loop's epoll instance until
+ * the client reads, so a slow client does not tie up a worker either.
+ **/
+static void threaded_send(Request *r, OutputStatus status) {
+  struct epoll_event event = { .events = EPOLLOUT, .data.ptr = r };
+
+  if(status == OUTPUT_MORE && pool_submit(ThreadedPool, threaded_output, r, false) == 0){
+    return;
+  }
+  if(status == OUTPUT_BLOCKED && epoll_ctl(IdleFd, EPOLL_CTL_ADD, r->fd, &event) == 0){
+    return;
+  }
+
+  if(r->output >= 0){
+    r->keepalive = false;
+    output_cancel(r);
+  }
+  __sync_fetch_and_sub(&Sending, 1);
+  threaded_finish(r);
+}
+
+/**
+ * Resume response once its socket has room.
+ *
+ * @param   r           HTTP Request structure.
+ **/
+static void threaded_resume(Request *r) {
+  epoll_ctl(IdleFd, EPOLL_CTL_DEL, r->fd, NULL);
+  threaded_send(r, OUTPUT_MORE);
+}
+
+/**
+ * Accept new connection and queue it on the pool.
+ *
+ * @param   sfd         Listening socket with a pending connection.
+ * @param   tls         Whether the listening socket speaks TLS.
+ **/
+static void threaded_accept(int sfd, bool tls) {
+  Request *r;
+
+  if((r = accept_request(sfd, tls)) == NULL){
+    return;
+  }
+
+  /* Reject request if too many connections are queued or running */
+  if(!admission_enter()){
+    reject_request(r);
+    free_request(r);
+    return;
+  }
+
+  if(pool_submit(ThreadedPool, threaded_handle, r, false) < 0){
+    free_request(r);
+    admission_leave();
+  }
+}
+
+/* External Functions */
+
+/**
+ * Send next quantum of response on a pool worker.
+ *
+ * @param   arg         HTTP Request structure.
+ **/
+void threaded_output(void *arg) {
+  Request *r = arg;
+
+  threaded_send(r, output_continue(r));
+}
+
+/**
+ * Handle request on a pool worker.
+ *
+ * @param   arg         HTTP Request structure.
+ *
+ * Requests that waited in the queue too long (see admission_admit) are shed
+ * with 503 Service Unavailable instead of being handled.  The rest of the
+ * response is then sent (see threaded_send).
+ **/
+void threaded_handle(void *arg) {
+  Request *r = arg;
+
+  if(!request_wait(r)){
+    goto close;
+  }
+
+  if(!admission_admit(r)){
+    reject_request(r);
+    goto close;
+  }
+
+  if(handle_request(r) != HTTP_STATUS_OK){
+    log("Unable to handle request.");
+  }
+  if(r->output >= 0){
+    __sync_fetch_and_add(&Sending, 1);
+    threaded_send(r, OUTPUT_MORE);
+    return;
+  }
+  threaded_finish(r);
+  return;
+
+close:
+  free_request(r);
+  admission_leave();
+}
+
+/**
+ * Hand off incoming HTTP requests to a pool of worker threads.
+ *
+ * @param   listeners   Listening sockets.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The server loop only accepts connections, watches idle persistent
+ * connections, and handles signals; everything that can block (reading the
+ * request, disk access, CGI scripts) runs on the work-stealing pool, so a slow
+ * request only ever ties up one worker.
+ *
+ * Listeners are registered with their index in the ListenerSet as epoll data
+ * and connections with their Request, which can never be at such a small
+ * address.
+ *
+ * The loop ends when handle_signals reports that a new binary has taken over
+ * the server sockets, at which point idle connections are closed and the pool
+ * finishes its queued requests and responses.
+ **/
+int threaded_server(ListenerSet *listeners) {
+  struct epoll_event events[MAX_EVENTS];
+
+  if((IdleFd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+    log("Unable to create epoll instance: %s", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  for(size_t i = 0; i < listeners->count; i++){
+    struct epoll_event listener = { .events = EPOLLIN, .data.u64 = i };
+    if(epoll_ctl(IdleFd, EPOLL_CTL_ADD, listeners->fds[i], &listener) < 0){
+      log("Unable to watch listening socket: %s", strerror(errno));
+      close(IdleFd);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if((ThreadedPool = pool_create(Workers)) == NULL){
+    log("Unable to create thread pool.");
+    close(IdleFd);
+    return EXIT_FAILURE;
+  }
+
+  /* Accept and queue HTTP requests */
+  while (handle_signals(listeners)) {
+    int nevents = epoll_wait(IdleFd, events, MAX_EVENTS, SWEEP_INTERVAL);
+
+    for(int i = 0; i < nevents; i++){
+      Request *r = events[i].data.ptr;
+
+      /* Accept new connection */
+      if(events[i].data.u64 < MAX_LISTENERS){
+        threaded_accept(listeners->fds[events[i].data.u64], listeners->tls[events[i].data.u64]);
+        continue;
+      }
+
+      /* Resume response blocked on a full socket */
+      if(r->output >= 0){
+        threaded_resume(r);
+        continue;
+      }
+
+      /* Queue idle connection with a new request */
+      threaded_unpark(r);
+      threaded_queue(r);
+    }
+
+    threaded_sweep(false);
+  }
+
+  /* Close server sockets (which a new binary may share) and idle connections */
+  for(size_t i = 0; i < listeners->count; i++){
+    epoll_ctl(IdleFd, EPOLL_CTL_DEL, listeners->fds[i], NULL);
+  }
+  socket_close(listeners);
+  pthread_mutex_lock(&IdleLock);
+  Draining = true;
+  pthread_mutex_unlock(&IdleLock);
+  threaded_sweep(true);
+
+  /* Finish responses still being sent, then drain pool */
+  while(__atomic_load_n(&Sending, __ATOMIC_SEQ_CST) > 0){
+    int nevents = epoll_wait(IdleFd, events, MAX_EVENTS, SWEEP_INTERVAL);
+    for(int i = 0; i < nevents; i++){
+      threaded_resume(events[i].data.ptr);
+    }
+  }
+  pool_destroy(ThreadedPool);
+  close(IdleFd);
+  return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,319 @@
+/* tls.c: TLS Functions */
+
+#include "spidey.h"
+
+#ifdef TLS
+
+#include <errno.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TLS_RECORD_SIZE     16384       /* Largest TLS record payload */
+
+/* Global Variables */
+
+char *TLSPort            = NULL;
+char *TLSCertificatePath = "spidey.pem";
+char *TLSKeyPath         = NULL;
+
+TLSMetrics *TLSState = NULL;
+
+static SSL_CTX *Context = NULL;
+
+/* Internal Functions */
+
+/**
+ * Log queued OpenSSL errors.
+ *
+ * @param   what        Operation that failed.
+ **/
+static void tls_log_errors(const char *what) {
+  unsigned long error;
+  char buffer[256];
+
+  while ((error = ERR_get_error()) != 0) {
+    ERR_error_string_n(error, buffer, sizeof(buffer));
+    log("%s: %s", what, buffer);
+  }
+}
+
+/**
+ * Map result of failed OpenSSL I/O call to errno.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   result      Return value of the call.
+ * @return  -1 (with errno set to EAGAIN if the call should be retried).
+ **/
+static ssize_t tls_error(Request *r, int result) {
+  int error = SSL_get_error(r->ssl, result);
+
+  if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+    errno = EAGAIN;
+  } else if (error != SSL_ERROR_SYSCALL || errno == 0) {
+    errno = EIO;
+  }
+  ERR_clear_error();
+  return -1;
+}
+
+/**
+ * Perform TLS handshake with client.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * The handshake runs on the worker that reads the first request, so a slow
+ * client never holds up the server loop.  Once it is done, OpenSSL has
+ * handed the session keys to the kernel if it could (see tls_offloaded).
+ **/
+static int tls_handshake(Request *r) {
+  int result;
+
+  while ((result = SSL_accept(r->ssl)) <= 0) {
+    if (SSL_get_error(r->ssl, result) == SSL_ERROR_SYSCALL && errno == EINTR) {
+      continue;
+    }
+    debug("TLS handshake with %s:%s failed", request_host(r), request_port(r));
+    __sync_fetch_and_add(&TLSState->failures, 1);
+    return tls_error(r, result);
+  }
+
+  __sync_fetch_and_add(&TLSState->handshakes, 1);
+  if (SSL_session_reused(r->ssl)) {
+    __sync_fetch_and_add(&TLSState->resumed, 1);
+  }
+  if (tls_offloaded(r)) {
+    __sync_fetch_and_add(&TLSState->offloaded, 1);
+  }
+  debug("TLS handshake with %s:%s: %s %s resumed=%d ktls=%d", request_host(r), request_port(r),
+        SSL_get_version(r->ssl), SSL_get_cipher_name(r->ssl), SSL_session_reused(r->ssl), tls_offloaded(r));
+  return 0;
+}
+
+/* External Functions */
+
+/**
+ * Create TLS context from certificate and key.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * SSL_OP_ENABLE_KTLS asks OpenSSL to install the session keys in the kernel
+ * after each handshake, so the record layer runs in the kernel and responses
+ * can still be sent with writev, sendfile, and splice.
+ *
+ * Sessions are resumed with stateless tickets.  The ticket keys are created
+ * here, before any worker is forked, so every forked child can resume a
+ * session any other child started.
+ **/
+int tls_init(void) {
+  TLSState = mmap(NULL, sizeof(TLSMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (TLSState == MAP_FAILED) {
+    log("Unable to map TLS counters: %s", strerror(errno));
+    TLSState = NULL;
+    return -1;
+  }
+
+  if ((Context = SSL_CTX_new(TLS_server_method())) == NULL) {
+    tls_log_errors("Unable to create TLS context");
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(Context, TLS1_2_VERSION);
+  SSL_CTX_set_options(Context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_session_id_context(Context, (const unsigned char *)"spidey", 6);
+  SSL_CTX_set_session_cache_mode(Context, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_num_tickets(Context, 1);
+
+  if (SSL_CTX_use_certificate_chain_file(Context, TLSCertificatePath) != 1 ||
+      SSL_CTX_use_PrivateKey_file(Context, TLSKeyPath ? TLSKeyPath : TLSCertificatePath, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(Context) != 1) {
+    tls_log_errors("Unable to load TLS certificate");
+    SSL_CTX_free(Context);
+    Context = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Start TLS session on accepted connection.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * The handshake itself is left to the first tls_read.  OpenSSL writes each
+ * handshake message separately, so Nagle's algorithm is turned off; otherwise
+ * the last message of a flight waits for the client's delayed ACK.
+ **/
+int tls_start(Request *r) {
+  int on = 1;
+
+  setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if ((r->ssl = SSL_new(Context)) == NULL || SSL_set_fd(r->ssl, r->fd) != 1) {
+    tls_log_errors("Unable to start TLS session");
+    SSL_free(r->ssl);
+    r->ssl = NULL;
+    return -1;
+  }
+  SSL_set_accept_state(r->ssl);
+  return 0;
+}
+
+/**
+ * Read decrypted bytes from client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   buffer      Buffer to read into.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read (0 on EOF, -1 on error).
+ **/
+ssize_t tls_read(Request *r, void *buffer, size_t size) {
+  int result;
+
+  if (!SSL_is_init_finished(r->ssl) && tls_handshake(r) < 0) {
+    return -1;
+  }
+  if ((result = SSL_read(r->ssl, buffer, size)) > 0) {
+    return result;
+  }
+  if (SSL_get_error(r->ssl, result) == SSL_ERROR_ZERO_RETURN) {
+    return 0;
+  }
+  return tls_error(r, result);
+}
+
+/**
+ * Write bytes to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   iov         Array of io vectors.
+ * @param   iovcnt      Number of io vectors.
+ * @return  Number of bytes written (or -1 on error).
+ *
+ * With kernel TLS the vectors go straight to writev and the kernel frames
+ * and encrypts them.  Otherwise each vector is written with SSL_write, which
+ * on a blocking socket only returns once all of it has been sent.
+ **/
+ssize_t tls_writev(Request *r, const struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+
+  if (!SSL_is_init_finished(r->ssl)) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (tls_offloaded(r)) {
+    return writev(r->fd, iov, iovcnt);
+  }
+
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    int result = SSL_write(r->ssl, iov[i].iov_base, iov[i].iov_len);
+    if (result <= 0) {
+      return total ? total : tls_error(r, result);
+    }
+    total += result;
+  }
+  return total;
+}
+
+/**
+ * Send part of file to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          File to send.
+ * @param   offset      Offset in file (advanced by the number of bytes sent).
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes sent (or -1 with errno set to EAGAIN if the
+ * socket is full).
+ *
+ * With kernel TLS this is SSL_sendfile, so file pages go from the page cache
+ * to the kernel's record layer without being copied to user space.  Without
+ * it, up to one record's worth of the file is read and written with
+ * SSL_write (see output_start for why that socket stays blocking).
+ **/
+ssize_t tls_sendfile(Request *r, int fd, off_t *offset, size_t length) {
+  char buffer[TLS_RECORD_SIZE];
+  ssize_t nsent;
+
+  if (tls_offloaded(r)) {
+    if ((nsent = SSL_sendfile(r->ssl, fd, *offset, length, 0)) < 0) {
+      return tls_error(r, nsent);
+    }
+  } else {
+    ssize_t nread = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), *offset);
+    struct iovec iov = { buffer, nread };
+    if (nread <= 0) {
+      return nread;
+    }
+    nsent = tls_writev(r, &iov, 1);
+  }
+
+  if (nsent > 0) {
+    *offset += nsent;
+  }
+  return nsent;
+}
+
+/**
+ * Check whether the kernel encrypts what is sent to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether kernel TLS is enabled for sending.
+ **/
+bool tls_offloaded(Request *r) {
+  return BIO_get_ktls_send(SSL_get_wbio(r->ssl)) > 0;
+}
+
+/**
+ * Check whether decrypted bytes are waiting in the TLS session.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether SSL_read would return bytes without touching the socket.
+ *
+ * Such bytes do not wake epoll, so a connection with pending bytes must not
+ * be parked waiting for them.
+ **/
+bool tls_pending(Request *r) {
+  return r->ssl && SSL_pending(r->ssl) > 0;
+}
+
+/**
+ * End TLS session.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * A close_notify alert is sent (if the handshake finished), but the client's
+ * is not waited for, since the socket is about to be closed anyway.
+ **/
+void tls_close(Request *r) {
+  if (!r->ssl) {
+    return;
+  }
+  if (SSL_is_init_finished(r->ssl)) {
+    SSL_shutdown(r->ssl);
+  }
+  ERR_clear_error();
+  SSL_free(r->ssl);
+  r->ssl = NULL;
+}
+
+/**
+ * Log TLS counters.
+ **/
+void tls_dump_metrics(void) {
+  log("METRICS tls handshakes=%lu resumed=%lu offloaded=%lu failures=%lu",
+      TLSState->handshakes, TLSState->resumed, TLSState->offloaded, TLSState->failures);
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,99 @@
+/* trace.c: Request Tracing Functions */
+
+#include "spidey.h"
+
+#ifdef TRACE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Global Variables */
+
+char *TracePath = "spidey.trace";
+
+static int TraceFd = -1;
+
+/**
+ * Open trace file for appending.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The file is opened before any workers are started so that forked children
+ * and threads all append to the same file.
+ **/
+int trace_open(void) {
+  if ((TraceFd = open(TracePath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+    log("Unable to open trace file %s: %s", TracePath, strerror(errno));
+    return -1;
+  }
+  log("Tracing requests to %s", TracePath);
+  return 0;
+}
+
+/**
+ * Record timestamp of request phase.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   phase       Phase of request.
+ *
+ * Each phase keeps its first timestamp, except TRACE_LAST_BYTE which is
+ * updated on every write.  The first byte of the next request on a
+ * persistent connection starts a new record: the previous request's record is
+ * emitted (without a close time) and the new one is accepted when the request
+ * was (r->accepted, which is on the same clock).  CLOCK_MONOTONIC is read through the vDSO, so this
+ * does not enter the kernel; the coarse clock's resolution (a scheduler tick)
+ * is too low to separate phases of a fast request.
+ **/
+void trace_mark(Request *r, TracePhase phase) {
+  struct timespec ts;
+
+  if (phase == TRACE_FIRST_BYTE && r->trace[TRACE_FIRST_BYTE]) {
+    trace_emit(r);
+    memset(r->trace, 0, sizeof(r->trace));
+    r->trace[TRACE_ACCEPT] = r->accepted;
+  }
+
+  if (phase != TRACE_LAST_BYTE && r->trace[phase]) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  r->trace[phase] = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Append trace record of request to trace file.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * Records are fixed-size and written with a single write to an O_APPEND file,
+ * so records from concurrent workers never interleave.  Use trace2json.py to
+ * convert the file to Chrome trace JSON.
+ *
+ * Only records of requests (that is, with a first byte) are written: a
+ * connection that closes without sending anything, or the forking server's
+ * copy of a connection handed to a child, has nothing to report.
+ **/
+void trace_emit(Request *r) {
+  TraceRecord record = {
+    .pid = getpid(),
+    .tid = gettid(),
+  };
+
+  if (TraceFd < 0 || !r->trace[TRACE_FIRST_BYTE]) {
+    return;
+  }
+
+  memcpy(record.phases, r->trace, sizeof(record.phases));
+  if (write(TraceFd, &record, sizeof(record)) != sizeof(record)) {
+    debug("Unable to write trace record: %s", strerror(errno));
+  }
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+
+import json
+import os
+import struct
+import sys
+
+# Globals
+
+PHASES = [
+    'accept', 'first byte', 'request line', 'headers', 'path',
+    'handler', 'first response byte', 'last byte', 'close',
+]
+RECORD = struct.Struct('=II{}Q'.format(len(PHASES)))
+
+# Functions
+
+def usage(status):
+    print('''Usage: {} TRACE [JSON]
+    Convert spidey binary trace (built with make TRACE=1) to Chrome trace JSON.
+    '''.format(os.path.basename(sys.argv[0])))
+    sys.exit(status)
+
+def read_records(path):
+    ''' Yield (pid, tid, phases) for each record in the trace file. '''
+    with open(path, 'rb') as stream:
+        while True:
+            data = stream.read(RECORD.size)
+            if len(data) < RECORD.size:
+                break
+            pid, tid, *phases = RECORD.unpack(data)
+            yield pid, tid, phases
+
+def convert(records):
+    ''' Convert records to a list of Chrome trace complete ("X") events, one
+    per phase, spanning from that phase to the next recorded phase. '''
+    events = []
+    for number, (pid, tid, phases) in enumerate(records):
+        marks = [(name, ts) for name, ts in zip(PHASES, phases) if ts]
+        for (name, start), (_, end) in zip(marks, marks[1:]):
+            events.append({
+                'name': name,
+                'cat':  'request',
+                'ph':   'X',
+                'ts':   start / 1000.0,
+                'dur':  (end - start) / 1000.0,
+                'pid':  pid,
+                'tid':  tid,
+                'args': {'request': number},
+            })
+    return events
+
+# Main execution
+
+if __name__ == '__main__':
+    ARGUMENTS = sys.argv[1:]
+    if not ARGUMENTS or ARGUMENTS[0] == '-h':
+        usage(0 if ARGUMENTS else 1)
+
+    EVENTS = convert(read_records(ARGUMENTS[0]))
+    OUTPUT = open(ARGUMENTS[1], 'w') if len(ARGUMENTS) > 1 else sys.stdout
+    json.dump({'traceEvents': EVENTS, 'displayTimeUnit': 'ns'}, OUTPUT)
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
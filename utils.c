@@ -2,110 +2,309 @@
 
 #include "spidey.h"
 
-#include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define MIMETYPE_BUCKETS    1024        /* Number of hash buckets (power of 2) */
+#define SPACES              " \t\n\v\f\r" /* Characters matched by isspace */
+
+/* Global Variables */
+
+MimeTypeTable *MimeTypes = NULL;
+
 /**
- * Determine mime-type from file extension.
+ * Hash string (FNV-1a).
  *
- * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
+ * @param   s           String.
+ * @return  Hash value of the string.
+ **/
+unsigned long hash_string(const char *s) {
+  unsigned long hash = 2166136261UL;
+  while (*s) {
+    hash ^= (unsigned char)*s++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+/**
+ * Load mime-types table.
  *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
+ * @param   path        Path to mime.types file.
+ * @return  Newly allocated MimeTypeTable (or NULL on error).
  *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
+ * The mime.types file (typically /etc/mime.types) consists of rules in the
  * following format:
  *
  *  <MIMETYPE>      <EXT1> <EXT2> ...
  *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
+ * Each extension is inserted into a hash table so that determine_mimetype does
+ * not have to scan the file for every request.  As with the file itself, the
+ * first rule for an extension wins.
+ **/
+MimeTypeTable * mimetypes_load(const char *path) {
+  MimeTypeTable *t = calloc(1, sizeof(MimeTypeTable));
+  char buffer[BUFSIZ];
+  FILE *fs;
+
+  if (!t || (t->buckets = calloc(MIMETYPE_BUCKETS, sizeof(MimeType *))) == NULL) {
+    log("Unable to allocate mimetypes table.");
+    free(t);
+    return NULL;
+  }
+
+  if ((fs = fopen(path, "r")) == NULL) {
+    log("Unable to open %s: %s", path, strerror(errno));
+    mimetypes_unload(t);
+    return NULL;
+  }
+
+  while (fgets(buffer, BUFSIZ, fs)) {
+    char *save = NULL;
+    char *mimetype = strtok_r(buffer, WHITESPACE, &save);
+    char *ext;
+
+    if (!mimetype || mimetype[0] == '#') {
+      continue;
+    }
+
+    while ((ext = strtok_r(NULL, WHITESPACE, &save)) != NULL) {
+      if (mimetypes_lookup(t, ext)) {
+        continue;
+      }
+
+      MimeType *m = calloc(1, sizeof(MimeType));
+      if (!m) {
+        continue;
+      }
+      m->extension = strdup(ext);
+      m->mimetype  = strdup(mimetype);
+
+      size_t bucket = hash_string(ext) & (MIMETYPE_BUCKETS - 1);
+      m->next = t->buckets[bucket];
+      t->buckets[bucket] = m;
+    }
+  }
+
+  fclose(fs);
+  return t;
+}
+
+/**
+ * Deallocate mime-types table.
+ *
+ * @param   t           MimeTypeTable structure.
+ **/
+void mimetypes_unload(MimeTypeTable *t) {
+  if (!t) {
+    return;
+  }
+
+  for (size_t i = 0; t->buckets && i < MIMETYPE_BUCKETS; i++) {
+    MimeType *m = t->buckets[i];
+    while (m) {
+      MimeType *next = m->next;
+      free(m->extension);
+      free(m->mimetype);
+      free(m);
+      m = next;
+    }
+  }
+  free(t->buckets);
+  free(t);
+}
+
+/**
+ * Lookup mime-type corresponding to file extension.
+ *
+ * @param   t           MimeTypeTable structure.
+ * @param   ext         File extension (without '.').
+ * @return  Mime-type (or NULL if there is no match).
+ **/
+const char * mimetypes_lookup(MimeTypeTable *t, const char *ext) {
+  size_t bucket = hash_string(ext) & (MIMETYPE_BUCKETS - 1);
+  for (MimeType *m = t->buckets[bucket]; m; m = m->next) {
+    if (streq(m->extension, ext)) {
+      return m->mimetype;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Determine mime-type from file extension.
+ *
+ * @param   path        Path to file.
+ * @param   fallback    Mimetype to use when no match is found.
+ * @return  An allocated string containing the mime-type of the specified file.
+ *
+ * This function first finds the file's extension and then looks it up in the
+ * MimeTypes table loaded from MimeTypesPath.
  *
  * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
+ * fallback.
  *
  * This function returns an allocated string that must be free'd.
  **/
-char * determine_mimetype(const char *path) {
-  char *ext;
-  char *mimetype = strdup(DefaultMimeType);
-  char *token;
-  char buffer[BUFSIZ];
-  FILE *fs = NULL;
+char * determine_mimetype(const char *path, const char *fallback) {
+  const char *base = strrchr(path, '/');
+  const char *ext;
+  const char *mimetype = NULL;
   
   /* Find file extension */
-  // takes you to one char after the '.'
-  if((ext = strchr(path, '.')) == NULL){
-    log("Cannot find file extension.");
-    return mimetype;
+  // takes you to one char after the last '.' in the file name
+  if((ext = strrchr(base ? base : path, '.')) == NULL){
+    debug("Cannot find file extension.");
+    return strdup(fallback);
   }
   ext++;
-  /* Open MimeTypesPath file */
-  if((fs = fopen(MimeTypesPath, "r")) == NULL){
-    log("cannot open file extension");
-    return mimetype;
+  
+  /* Lookup extension in mimetypes table */
+  MimeTypeTable *mimetypes = __atomic_load_n(&MimeTypes, __ATOMIC_SEQ_CST);
+  if(mimetypes){
+    mimetype = mimetypes_lookup(mimetypes, ext);
+  }
+  
+  if(mimetype == NULL){
+    debug("No matching mimetype found.");
+    mimetype = fallback;
   }
   
-  /* Scan file for matching file extensions */
-  bool exit = false;
-  while(fgets(buffer, BUFSIZ, fs) && !exit){
-    token = strtok(buffer, "\t");
-    token++; // get past the \0, now buffer is just the mimetype
-    token = skip_whitespace(token);
-    
-    while(!streq(token, "\n") == 0){
-      if(strncmp(token, ext, strlen(ext))){
-	mimetype = strdup(buffer);
-	exit = true;
-	break;
+  return strdup(mimetype);
+}
+
+/**
+ * Return value of hexadecimal digit.
+ *
+ * @param   c           Character.
+ * @return  Value of digit (or -1 if c is not a hexadecimal digit).
+ **/
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/**
+ * Decode and normalize URI path.
+ *
+ * @param   uri         Resource path of URI (without query).
+ * @param   buffer      Buffer to store normalized path in.
+ * @param   size        Size of buffer.
+ * @return  Length of normalized path (or -1 if the URI is invalid).
+ *
+ * Percent-escapes are decoded first, so an escaped "%2e%2e" is treated like
+ * "..".  Then empty and "." segments are dropped and each ".." segment drops
+ * the segment before it.  The result always starts with '/' and never climbs
+ * above the document root; a URI that would, a malformed escape, or an
+ * escaped NUL make the URI invalid.
+ *
+ * Runs of plain bytes are found with memchr and moved with memcpy, both of
+ * which glibc dispatches at load time to vectorized implementations, so
+ * typical URIs without escapes or dot segments are copied in a few calls.
+ **/
+ssize_t normalize_uri(const char *uri, char *buffer, size_t size) {
+  const char *end = uri + strlen(uri);
+  size_t n = 0;
+  size_t w = 0;
+
+  if (*uri != '/' || (size_t)(end - uri) >= size) {
+    return -1;
+  }
+
+  /* Decode percent-escapes (the result is never longer than the URI) */
+  for (const char *s = uri; s < end; s += 3) {
+    const char *escape = memchr(s, '%', end - s);
+    size_t run = (escape ? escape : end) - s;
+    memcpy(buffer + n, s, run);
+    n += run;
+    if (!escape) {
+      break;
+    }
+
+    int hi = hex_value(escape[1]);
+    int lo = hi < 0 ? -1 : hex_value(escape[2]);
+    if (lo < 0 || (hi == 0 && lo == 0)) {
+      return -1;
+    }
+    buffer[n++] = (hi << 4) | lo;
+    s = escape;
+  }
+  buffer[n] = '\0';
+  bool trailing = buffer[n - 1] == '/';
+
+  /* Resolve segments in place (each is written back as "/segment") */
+  for (size_t i = 0; i < n; ) {
+    i += strspn(buffer + i, "/");
+    if (i >= n) {
+      break;
+    }
+
+    char  *slash  = memchr(buffer + i, '/', n - i);
+    size_t next   = slash ? (size_t)(slash - buffer) : n;
+    size_t length = next - i;
+
+    if (length == 2 && buffer[i] == '.' && buffer[i + 1] == '.') {
+      if (w == 0) {
+        return -1;
       }
+      while (buffer[--w] != '/');
+    } else if (length != 1 || buffer[i] != '.') {
+      buffer[w++] = '/';
+      memmove(buffer + w, buffer + i, length);
+      w += length;
     }
-    
+    i = next;
   }
 
-  if(mimetype == NULL){
-    log("No matching mimetype found.");
+  if (w == 0 || trailing) {
+    buffer[w++] = '/';
   }
-  
-  // close fs
-  fclose(fs);
-  
-  return mimetype;
+  buffer[w] = '\0';
+  return w;
 }
 
 /**
- * Determine actual filesystem path based on RootPath and URI.
+ * Determine actual filesystem path based on document root and URI.
  *
- * @param   uri         Resource path of URI.
+ * @param   root        Real path of document root.
+ * @param   uri         Resource path of URI (normalized with normalize_uri).
  * @return  An allocated string containing the full path of the resource on the
  * local filesystem.
  *
  * This function uses realpath(3) to generate the realpath of the
  * file requested in the URI.
  *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
+ * As a security check, if the real path is not the root or inside of it (a
+ * symbolic link may point anywhere), then return NULL.
  *
  * Otherwise, return a newly allocated string containing the real path.  This
  * string must later be free'd.
  **/
-char * determine_request_path(const char *uri) {
+char * determine_request_path(const char *root, const char *uri) {
   
   char buffer[BUFSIZ];
   char *rlpath = buffer;
-  sprintf(rlpath, "%s%s", RootPath, uri);
+  size_t rootlen = strlen(root);
+  snprintf(rlpath, BUFSIZ, "%s%s", root, uri);
   
   if ((rlpath = realpath(rlpath, NULL)) == NULL){
     return NULL;
   }
-  *(rlpath + strlen(rlpath)) = '\0';
   
-  if (strncmp(rlpath, RootPath, strlen(RootPath)) != 0){
+  if (strncmp(rlpath, root, rootlen) != 0 || (rlpath[rootlen] != '\0' && rlpath[rootlen] != '/')){
+    free(rlpath);
     return NULL;
   }
   
@@ -126,23 +325,36 @@ const char * http_status_string(HTTPStatus status) {
     "400 Bad Request",
     "404 Not Found",
     "500 Internal Server Error",
+    "502 Bad Gateway",
+    "503 Service Unavailable",
     "418 I'm A Teapot",
   };
   
   return StatusStrings[status];
 }
 
+/**
+ * Return current monotonic time.
+ *
+ * @return  CLOCK_MONOTONIC time in nanoseconds.
+ **/
+unsigned long long monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /**
  * Advance string pointer pass all nonwhitespace characters
  *
  * @param   s           String.
  * @return  Point to first whitespace character in s.
+ *
+ * Like the other scans in the request path, this uses a glibc string function
+ * (strcspn) that is dispatched at load time to a vectorized implementation.
  **/
 char * skip_nonwhitespace(char *s) {
-  while(!isspace(*s)){
-    s++;
-  }
-  return s;
+  return s + strcspn(s, SPACES);
 }
 
 /**
@@ -152,10 +364,7 @@ char * skip_nonwhitespace(char *s) {
  * @return  Point to first non-whitespace character in s.
  **/
 char * skip_whitespace(char *s) {
-  while(isspace(*s)){
-    s++;
-  }
-  return s;
+  return s + strspn(s, SPACES);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,321 @@
+/* vhost.c: Virtual Host Functions */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define VHOST_BUCKETS   64              /* Number of hash buckets (power of 2) */
+#define VHOST_METRICS   256             /* Hosts with metrics (over all reloads) */
+#define VHOST_NAME_SIZE 256             /* Longest host name with metrics (including NUL) */
+
+typedef struct {
+    unsigned long hash;                 /*< Hash of host name (0 = free slot) */
+    char          name[VHOST_NAME_SIZE];    /*< Host name */
+    HostMetrics   metrics;              /*< Counters of host */
+} HostSlot;
+
+/* Global Variables */
+
+VirtualHostTable *VirtualHosts = NULL;
+
+static HostSlot *Metrics = NULL;        /* Shared counters of every host loaded */
+
+/* Internal Functions */
+
+/**
+ * Hash host name up to any port suffix (case-insensitive FNV-1a).
+ *
+ * @param   name        Host name (possibly with :port suffix).
+ * @param   length      Set to length of host name without port (may be NULL).
+ * @return  Hash value of the host name.
+ **/
+static unsigned long vhost_hash(const char *name, size_t *length) {
+  unsigned long hash = 2166136261UL;
+  size_t n = 0;
+
+  while (name[n] && name[n] != ':') {
+    hash ^= (unsigned char)tolower((unsigned char)name[n++]);
+    hash *= 16777619UL;
+  }
+
+  if (length) {
+    *length = n;
+  }
+  return hash;
+}
+
+/**
+ * Find shared metrics of host.
+ *
+ * @param   name        Host name.
+ * @return  Metrics of host (or NULL if there is no room for another host).
+ *
+ * The slots are mapped on the first load, before any worker is forked, and
+ * are never unmapped.  A host keeps its slot (found by its name, with the
+ * hash of the name to skip most slots) across reloads, so a SIGHUP does not
+ * reset its counters, and only hosts that were never loaded before claim new
+ * slots.  Reloads only happen in the server process, so claiming a slot needs
+ * no lock.
+ **/
+static HostMetrics *vhost_metrics(const char *name) {
+  unsigned long hash = vhost_hash(name, NULL) | 1;
+
+  if (strlen(name) >= VHOST_NAME_SIZE) {
+    log("Host name %s is too long for metrics.", name);
+    return NULL;
+  }
+
+  if (!Metrics) {
+    Metrics = mmap(NULL, VHOST_METRICS * sizeof(HostSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Metrics == MAP_FAILED) {
+      log("Unable to map host metrics: %s", strerror(errno));
+      Metrics = NULL;
+      return NULL;
+    }
+  }
+
+  for (size_t i = 0; i < VHOST_METRICS; i++) {
+    if (!Metrics[i].hash) {
+      Metrics[i].hash = hash;
+      strcpy(Metrics[i].name, name);
+    }
+    if (Metrics[i].hash == hash && strcasecmp(Metrics[i].name, name) == 0) {
+      return &Metrics[i].metrics;
+    }
+  }
+
+  log("No room for metrics of host %s.", name);
+  return NULL;
+}
+
+/**
+ * Allocate virtual host with shared metrics.
+ *
+ * @param   name        Host name (NULL for default host).
+ * @param   root        Document root (resolved with realpath).
+ * @param   mimetype    Default mimetype.
+ * @param   cache_size  Cache budget in bytes (0 for server default).
+ * @return  Newly allocated VirtualHost (or NULL on error).
+ *
+ * The metrics are placed in an anonymous shared mapping so that counters
+ * updated by forked children are visible to the parent process (see
+ * vhost_metrics).
+ **/
+static VirtualHost *vhost_create(const char *name, const char *root, const char *mimetype, size_t cache_size) {
+  VirtualHost *h = calloc(1, sizeof(VirtualHost));
+  if (!h) {
+    return NULL;
+  }
+
+  if ((h->root = realpath(root, NULL)) == NULL) {
+    log("Unable to resolve root %s: %s", root, strerror(errno));
+    goto fail;
+  }
+
+  if ((h->metrics = vhost_metrics(name ? name : "*")) == NULL) {
+    goto fail;
+  }
+
+  h->name       = strdup(name ? name : "*");
+  h->mimetype   = strdup(mimetype);
+  h->cache_size = cache_size;
+  return h;
+
+fail:
+  free(h->root);
+  free(h);
+  return NULL;
+}
+
+/**
+ * Deallocate virtual host.
+ *
+ * @param   h           VirtualHost structure.
+ **/
+static void vhost_free(VirtualHost *h) {
+  free(h->name);
+  free(h->root);
+  free(h->mimetype);
+  free(h);
+}
+
+/**
+ * Log metrics for virtual host.
+ *
+ * @param   h           VirtualHost structure.
+ **/
+static void vhost_log_metrics(VirtualHost *h) {
+  char buffer[BUFSIZ];
+  size_t n = 0;
+
+  for (HTTPStatus status = 0; status < HTTP_STATUS_COUNT; status++) {
+    n += snprintf(buffer + n, sizeof(buffer) - n, " %.3s=%lu",
+                  http_status_string(status), h->metrics->statuses[status]);
+  }
+
+  log("METRICS host=%s requests=%lu%s", h->name, h->metrics->requests, buffer);
+}
+
+/* External Functions */
+
+/**
+ * Load virtual hosts table.
+ *
+ * @param   path        Path to virtual hosts file (may be NULL).
+ * @return  Newly allocated VirtualHostTable (or NULL on error).
+ *
+ * The default host is always built from RootPath and DefaultMimeType.  If a
+ * path is specified, each non-comment line has the format:
+ *
+ *  <HOST>      <ROOT>  [MIMETYPE]  [CACHE_BYTES]
+ *
+ * A missing MIMETYPE defaults to DefaultMimeType and a missing (or 0)
+ * CACHE_BYTES means the host has no cache budget of its own.
+ **/
+VirtualHostTable *vhost_load(const char *path) {
+  VirtualHostTable *t = calloc(1, sizeof(VirtualHostTable));
+  char buffer[BUFSIZ];
+  FILE *fs = NULL;
+
+  if (!t || (t->buckets = calloc(VHOST_BUCKETS, sizeof(VirtualHost *))) == NULL) {
+    log("Unable to allocate virtual hosts table.");
+    goto fail;
+  }
+
+  if ((t->fallback = vhost_create(NULL, RootPath, DefaultMimeType, 0)) == NULL) {
+    goto fail;
+  }
+
+  if (!path) {
+    return t;
+  }
+
+  if ((fs = fopen(path, "r")) == NULL) {
+    log("Unable to open %s: %s", path, strerror(errno));
+    goto fail;
+  }
+
+  while (fgets(buffer, BUFSIZ, fs)) {
+    char *save = NULL;
+    char *name = strtok_r(buffer, WHITESPACE, &save);
+    char *root = strtok_r(NULL, WHITESPACE, &save);
+    char *mime = strtok_r(NULL, WHITESPACE, &save);
+    char *size = strtok_r(NULL, WHITESPACE, &save);
+
+    if (!name || name[0] == '#') {
+      continue;
+    }
+    if (!root) {
+      log("Missing root for host %s.", name);
+      goto fail;
+    }
+
+    VirtualHost *h = vhost_create(name, root, mime ? mime : DefaultMimeType,
+                                  size ? strtoul(size, NULL, 10) : 0);
+    if (!h) {
+      goto fail;
+    }
+
+    size_t bucket = vhost_hash(name, NULL) & (VHOST_BUCKETS - 1);
+    h->next = t->buckets[bucket];
+    t->buckets[bucket] = h;
+    debug("VirtualHost %s -> %s", h->name, h->root);
+  }
+
+  fclose(fs);
+  return t;
+
+fail:
+  if (fs) {
+    fclose(fs);
+  }
+  vhost_unload(t);
+  return NULL;
+}
+
+/**
+ * Deallocate virtual hosts table.
+ *
+ * @param   t           VirtualHostTable structure.
+ **/
+void vhost_unload(VirtualHostTable *t) {
+  if (!t) {
+    return;
+  }
+
+  if (t->buckets) {
+    for (size_t i = 0; i < VHOST_BUCKETS; i++) {
+      VirtualHost *h = t->buckets[i];
+      while (h) {
+        VirtualHost *next = h->next;
+        vhost_free(h);
+        h = next;
+      }
+    }
+    free(t->buckets);
+  }
+
+  if (t->fallback) {
+    vhost_free(t->fallback);
+  }
+  free(t);
+}
+
+/**
+ * Lookup virtual host corresponding to Host header.
+ *
+ * @param   t           VirtualHostTable structure.
+ * @param   host        Value of Host header (may be NULL).
+ * @return  Matching VirtualHost or the default host.
+ **/
+VirtualHost *vhost_lookup(VirtualHostTable *t, const char *host) {
+  size_t length;
+
+  if (!host) {
+    return t->fallback;
+  }
+
+  unsigned long bucket = vhost_hash(host, &length) & (VHOST_BUCKETS - 1);
+  for (VirtualHost *h = t->buckets[bucket]; h; h = h->next) {
+    if (strlen(h->name) == length && strncasecmp(h->name, host, length) == 0) {
+      return h;
+    }
+  }
+
+  return t->fallback;
+}
+
+/**
+ * Record status of request in virtual host metrics.
+ *
+ * @param   h           VirtualHost structure.
+ * @param   status      HTTP Status of request.
+ **/
+void vhost_record(VirtualHost *h, HTTPStatus status) {
+  __sync_fetch_and_add(&h->metrics->requests, 1);
+  __sync_fetch_and_add(&h->metrics->statuses[status], 1);
+}
+
+/**
+ * Log metrics for every virtual host.
+ *
+ * @param   t           VirtualHostTable structure.
+ **/
+void vhost_dump_metrics(VirtualHostTable *t) {
+  for (size_t i = 0; i < VHOST_BUCKETS; i++) {
+    for (VirtualHost *h = t->buckets[i]; h; h = h->next) {
+      vhost_log_metrics(h);
+    }
+  }
+  vhost_log_metrics(t->fallback);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,378 @@
+/* warmup.c: Cache Warm-up Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define WARMUP_ENTRIES      4096        /* Paths tracked in the hot set (power of 2) */
+#define WARMUP_PROBES       16          /* Slots tried before a path is not tracked */
+#define WARMUP_HOST_SIZE    64          /* Longest host name (including NUL) */
+#define WARMUP_READAHEAD    (4 * 1024 * 1024)   /* Bytes read ahead of each large file */
+#define WARMUP_READAHEAD_LIMIT (256 * 1024 * 1024) /* Bytes read ahead of all large files */
+
+typedef struct {
+    unsigned long hash;                 /*< Hash of host and URI (0 = free slot) */
+    unsigned long count;                /*< Number of requests */
+    char        host[WARMUP_HOST_SIZE]; /*< Name of virtual host */
+    char        uri[CACHE_KEY_SIZE];    /*< Normalized URI */
+} HotEntry;
+
+typedef struct {
+    size_t      paths;                  /*< Paths resolved */
+    size_t      missing;                /*< Paths added to the negative cache */
+    size_t      cached;                 /*< Bytes of small files cached */
+    size_t      readahead;              /*< Bytes of large files read ahead */
+} WarmupStats;
+
+/* Global Variables */
+
+char *WarmupPath    = NULL;
+char *WarmupLogPath = NULL;
+
+static HotEntry *HotSet = NULL;         /* Requests counted since start (shared) */
+
+/* Internal Functions */
+
+/**
+ * Count requests for URI in hot set table.
+ *
+ * @param   table       Hot set table (WARMUP_ENTRIES slots).
+ * @param   host        Name of virtual host.
+ * @param   uri         Normalized URI.
+ * @param   count       Number of requests to add.
+ *
+ * Slots are claimed with a compare-and-swap on the hash, so requests in any
+ * worker thread or process can count without a lock.  Entries are matched by
+ * hash alone, and a path whose probe sequence is full is simply not tracked.
+ **/
+static void hot_count(HotEntry *table, const char *host, const char *uri, unsigned long count) {
+  unsigned long hash = (hash_string(uri) * 31 + hash_string(host)) | 1;
+
+  if (strlen(host) >= WARMUP_HOST_SIZE || strlen(uri) >= CACHE_KEY_SIZE || strchr(uri, '\n')) {
+    return;
+  }
+
+  for (size_t i = 0; i < WARMUP_PROBES; i++) {
+    HotEntry *e = &table[(hash + i) & (WARMUP_ENTRIES - 1)];
+    if (__sync_bool_compare_and_swap(&e->hash, 0, hash)) {
+      strcpy(e->host, host);
+      strcpy(e->uri, uri);
+    }
+    if (e->hash == hash) {
+      __sync_fetch_and_add(&e->count, count);
+      return;
+    }
+  }
+}
+
+/**
+ * Compare hot set entries by descending count (for qsort).
+ **/
+static int hot_compare(const void *a, const void *b) {
+  const HotEntry *x = *(HotEntry * const *)a;
+  const HotEntry *y = *(HotEntry * const *)b;
+
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+/**
+ * Rank counted entries of hot set table.
+ *
+ * @param   table       Hot set table.
+ * @param   n           Set to number of entries ranked.
+ * @return  Allocated array of entries, most requested first (or NULL).
+ **/
+static HotEntry **hot_rank(HotEntry *table, size_t *n) {
+  HotEntry **ranked = calloc(WARMUP_ENTRIES, sizeof(HotEntry *));
+
+  *n = 0;
+  if (!ranked) {
+    return NULL;
+  }
+  for (size_t i = 0; i < WARMUP_ENTRIES; i++) {
+    if (table[i].hash && table[i].count) {
+      ranked[(*n)++] = &table[i];
+    }
+  }
+  qsort(ranked, *n, sizeof(HotEntry *), hot_compare);
+  return ranked;
+}
+
+/**
+ * Parse line of hot set dump or access log.
+ *
+ * @param   line        Line to parse (modified).
+ * @param   table       Hot set table to count the request in.
+ *
+ * A dump line is "count host uri", with the URI already normalized and
+ * running to the end of the line.  Any other line with a quoted request line
+ * ("GET /uri HTTP/1.1", as in the Common and Combined Log Formats) counts as
+ * one request for the default host.
+ **/
+static void warmup_parse(char *line, HotEntry *table) {
+  char uri[CACHE_KEY_SIZE];
+  char *request = strchr(line, '"');
+  char *end;
+
+  chomp(line);
+  if (!request) {
+    unsigned long count = strtoul(line, &end, 10);
+    char *host = skip_whitespace(end);
+    char *path = skip_nonwhitespace(host);
+    if (end == line || !*path) {
+      return;
+    }
+    *path++ = '\0';
+    hot_count(table, host, path, count);
+    return;
+  }
+
+  /* Only GET and HEAD requests are served from files */
+  request++;
+  if (strncmp(request, "GET ", 4) != 0 && strncmp(request, "HEAD ", 5) != 0) {
+    return;
+  }
+  request = skip_whitespace(skip_nonwhitespace(request));
+  end = request + strcspn(request, " ?\"");
+  *end = '\0';
+  if (normalize_uri(request, uri, sizeof(uri)) >= 0) {
+    hot_count(table, "*", uri, 1);
+  }
+}
+
+/**
+ * Count requests listed in hot set dump or access log.
+ *
+ * @param   path        Path of file (may be NULL).
+ * @param   table       Hot set table to count the requests in.
+ * @return  Whether the file was read.
+ **/
+static bool warmup_load(const char *path, HotEntry *table) {
+  char buffer[BUFSIZ];
+  FILE *fs;
+
+  if (!path) {
+    return false;
+  }
+  if ((fs = fopen(path, "r")) == NULL) {
+    log("Unable to warm up from %s: %s", path, strerror(errno));
+    return false;
+  }
+  while (fgets(buffer, sizeof(buffer), fs)) {
+    if (buffer[0] != '#' && strchr(buffer, '\n')) {
+      warmup_parse(buffer, table);
+    }
+  }
+  fclose(fs);
+  return true;
+}
+
+/**
+ * Warm up caches for one path.
+ *
+ * @param   host        Name of virtual host.
+ * @param   uri         Normalized URI.
+ * @param   stats       Warm-up counters (updated).
+ *
+ * This repeats what handle_request does up to sending the response: the path
+ * is resolved (warming the kernel's dentry and inode caches), missing paths
+ * go into the negative cache, and small files are read into the cache.  Large
+ * files are only read ahead into the page cache with posix_fadvise.
+ **/
+static void warmup_path(const char *host, const char *uri, WarmupStats *stats) {
+  struct stat st;
+  char *path;
+
+  if (proxy_lookup(uri)) {
+    return;
+  }
+
+  /* Count as active request while using the virtual hosts table */
+  __atomic_add_fetch(&ActiveRequests, 1, __ATOMIC_SEQ_CST);
+  VirtualHost *vhost = vhost_lookup(__atomic_load_n(&VirtualHosts, __ATOMIC_SEQ_CST), host);
+
+  if (negative_lookup(vhost->root, uri)) {
+    goto done;
+  }
+  if ((path = determine_request_path(vhost->root, uri)) == NULL) {
+    negative_insert(vhost->root, uri);
+    stats->missing++;
+    goto done;
+  }
+  stats->paths++;
+
+  if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) != 0) {
+    if (st.st_size <= CACHE_BODY_LIMIT) {
+      CacheEntry *e;
+      if (stats->cached + st.st_size <= CacheSize && (e = cache_file(vhost, path, &st)) != NULL) {
+        stats->cached += st.st_size;
+        cache_release(e);
+      }
+    } else if (stats->readahead < WARMUP_READAHEAD_LIMIT) {
+      int fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        posix_fadvise(fd, 0, WARMUP_READAHEAD, POSIX_FADV_WILLNEED);
+        stats->readahead += st.st_size < WARMUP_READAHEAD ? st.st_size : WARMUP_READAHEAD;
+        close(fd);
+      }
+    }
+  }
+  free(path);
+
+done:
+  __atomic_sub_fetch(&ActiveRequests, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Warm up caches from WarmupPath and WarmupLogPath.
+ *
+ * @param   arg         Unused.
+ * @return  NULL.
+ *
+ * Paths are warmed most requested first, so the hottest are ready soonest and
+ * small files stop being cached once they would fill CacheSize (caching more
+ * would only evict hotter ones).  The previous counts are carried over into
+ * the hot set at half weight, so a path that is no longer requested drops
+ * out after a few restarts.
+ **/
+static void *warmup_thread(void *arg) {
+  unsigned long long start = monotonic_ns();
+  WarmupStats stats = {0};
+  HotEntry *table;
+  HotEntry **ranked;
+  size_t n;
+
+  if ((table = calloc(WARMUP_ENTRIES, sizeof(HotEntry))) == NULL) {
+    return NULL;
+  }
+  bool loaded = warmup_load(WarmupPath, table);
+  if (!warmup_load(WarmupLogPath, table) && !loaded) {
+    free(table);
+    return NULL;
+  }
+
+  if ((ranked = hot_rank(table, &n)) != NULL) {
+    for (size_t i = 0; i < n; i++) {
+      if (HotSet && ranked[i]->count / 2) {
+        hot_count(HotSet, ranked[i]->host, ranked[i]->uri, ranked[i]->count / 2);
+      }
+      warmup_path(ranked[i]->host, ranked[i]->uri, &stats);
+    }
+    free(ranked);
+  }
+  free(table);
+
+  log("Warmed up %zu paths (%zu missing, %zu bytes cached, %zu bytes read ahead) in %llu ms",
+      stats.paths, stats.missing, stats.cached, stats.readahead, (monotonic_ns() - start) / 1000000);
+  return NULL;
+}
+
+/* External Functions */
+
+/**
+ * Allocate hot set table.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The table is placed in an anonymous shared mapping so that requests handled
+ * by forked children are counted too.  Nothing is counted without WarmupPath.
+ **/
+int warmup_init(void) {
+  if (!WarmupPath) {
+    return 0;
+  }
+
+  HotSet = mmap(NULL, WARMUP_ENTRIES * sizeof(HotEntry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (HotSet == MAP_FAILED) {
+    log("Unable to map hot set: %s", strerror(errno));
+    HotSet = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Start warming up caches in the background.
+ *
+ * The server starts accepting right away; until the warm-up reaches a path,
+ * requests for it simply take the usual cold path.
+ **/
+void warmup_start(void) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+
+  if (!WarmupPath && !WarmupLogPath) {
+    return;
+  }
+
+  /* Leave signals to the server loop, whose accept they must interrupt */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, warmup_thread, NULL) != 0) {
+    log("Unable to start warm-up thread.");
+  }
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * Count request in hot set.
+ *
+ * @param   host        Virtual host of request.
+ * @param   uri         Normalized URI of request.
+ **/
+void warmup_record(VirtualHost *host, const char *uri) {
+  if (HotSet) {
+    hot_count(HotSet, host->name, uri, 1);
+  }
+}
+
+/**
+ * Save hot set to WarmupPath for the next start.
+ *
+ * The dump is written to a temporary file and renamed over WarmupPath, so a
+ * new binary reading it during an upgrade never sees a partial dump.
+ **/
+void warmup_dump(void) {
+  char path[BUFSIZ];
+  HotEntry **ranked;
+  FILE *fs;
+  size_t n;
+
+  if (!HotSet || (ranked = hot_rank(HotSet, &n)) == NULL) {
+    return;
+  }
+
+  snprintf(path, sizeof(path), "%s.tmp", WarmupPath);
+  if ((fs = fopen(path, "w")) == NULL) {
+    log("Unable to save hot set to %s: %s", path, strerror(errno));
+    free(ranked);
+    return;
+  }
+  fprintf(fs, "# count host uri\n");
+  for (size_t i = 0; i < n; i++) {
+    fprintf(fs, "%lu %s %s\n", ranked[i]->count, ranked[i]->host, ranked[i]->uri);
+  }
+  free(ranked);
+
+  if (fclose(fs) != 0 || rename(path, WarmupPath) < 0) {
+    log("Unable to save hot set to %s: %s", WarmupPath, strerror(errno));
+    unlink(path);
+    return;
+  }
+  log("Saved hot set of %zu paths to %s", n, WarmupPath);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */